@@ -16,15 +16,63 @@
 
 #include "dnsmasq.h"
 
-static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
+static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL, **rev_table = NULL;
 #ifdef HAVE_DHCP
 static struct crec *dhcp_spare = NULL;
+
+/* With --dns-workers, the main process sends them changes to the DHCP
+   names a lease at a time, so that they needn't be restarted whenever a
+   lease changes. Each lease is known by a key, its address in the main
+   process, and a DNS worker keeps a copy of the names for each. */
+struct dhcp_copy {
+  void *key;
+  struct crec *chain; /* linked through ->prev, as for a lease */
+  char *names; /* NULL for those copied at fork() */
+  struct dhcp_copy *next;
+};
+static struct dhcp_copy **copy_hash = NULL;
+static unsigned int copy_hash_size;
+static unsigned char *dhcp_buff = NULL;
+static size_t dhcp_len = 0;
+static int dhcp_count = 0;
 #endif
 static struct crec *new_chain = NULL;
-static int cache_inserted = 0, cache_live_freed = 0, insert_error;
+static int cache_inserted = 0, cache_live_freed = 0, insert_error, insert_quiet = 0;
 static union bigname *big_free = NULL;
 static int bignames_left, hash_size;
 
+/* Whilst the tables are growing, the old ones, and the number of their
+   buckets which have been moved to the new ones. The rest are still in use. */
+static struct crec **old_hash = NULL, **old_rev = NULL;
+static int old_size, moved;
+
+/* Entries from hosts files and the configuration last until the next
+   cache_reload(), so they're packed into blocks, each twice the size of
+   the last, up to a limit, and the blocks are all freed together then. */
+struct hosts_block {
+  struct hosts_block *next;
+  size_t used, size;
+};
+#define HOSTS_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define HOSTS_BLOCK_MIN 4096
+#define HOSTS_BLOCK_MAX 1048576
+static struct hosts_block *hosts_blocks = NULL;
+static void *hosts_last = NULL;
+
+/* With --cache-slru the LRU list is in two parts: entries which have been
+   found again since they were inserted are protected, at the head, and
+   the rest follow from prob_head. New entries go in at prob_head, so a
+   run of names looked up only once can't push out the protected ones,
+   and when there are more than protect_max protected entries, the
+   oldest goes back to being probationary. */
+static struct crec *prob_head = NULL;
+static int protect_max, cache_protected = 0;
+static unsigned int protected_hits = 0, probation_hits = 0;
+
+/* With --serve-stale, answers from upstream are kept for stale_max seconds
+   after they expire, but are only found whilst serving_stale is set. */
+static int serving_stale = 0;
+
 /* type->string mapping: this is also used by the name-hash function as a mixing table. */
 static const struct {
   unsigned int type;
@@ -69,8 +117,33 @@ static const struct {
 static void cache_free(struct crec *crecp);
 static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
+static void cache_promote(struct crec *crecp);
 static void rehash(int size);
+static void rehash_move(int count);
+static struct crec **hash_bucket(char *name);
+static struct crec **rev_bucket(struct all_addr *addr, unsigned int flags);
 static void cache_hash(struct crec *crecp);
+static void rev_unhash(struct crec *crecp);
+static void cache_send_inserts(void);
+#ifdef HAVE_DHCP
+static void cache_recv_dhcp(unsigned char *buff, int count, time_t now);
+#endif
+
+/* Header for each cache entry passed from a TCP child to the parent,
+   followed by the name and, for DNSKEY and DS, the key data. */
+struct cache_xfer {
+  time_t ttd;
+  int target; /* index of CNAME target in batch, or -1 */
+  unsigned int uid;
+  unsigned short flags, namelen, datalen;
+  union {
+    struct all_addr addr;
+    struct {
+      unsigned short flags, keytag;
+      unsigned char algo, digest;
+    } key;
+  } u;
+};
 
 static unsigned int next_uid(void)
 {
@@ -91,6 +164,7 @@ void cache_init(void)
   int i;
  
   bignames_left = daemon->cachesize/10;
+  protect_max = (daemon->cachesize * daemon->cache_protect) / 100;
   
   if (daemon->cachesize > 0)
     {
@@ -98,6 +172,7 @@ void cache_init(void)
       
       for (i=0; i < daemon->cachesize; i++, crecp++)
 	{
+	  crecp->protect = 0;
 	  cache_link(crecp);
 	  crecp->flags = 0;
 	  crecp->uid = next_uid();
@@ -111,41 +186,94 @@ void cache_init(void)
 /* In most cases, we create the hash table once here by calling this with (hash_table == NULL)
    but if the hosts file(s) are big (some people have 50000 ad-block entries), the table
    will be much too small, so the hosts reading code calls rehash every 1000 addresses, to
-   expand the table. */
+   expand the table. The entries move to the new table a few buckets at a time, 
+   in rehash_move(), so that no one call has to move them all. */
 static void rehash(int size)
 {
-  struct crec **new, **old, *p, *tmp;
-  int i, new_size, old_size;
+  struct crec **new, **new_rev;
+  int i, new_size;
 
   /* hash_size is a power of two. */
   for (new_size = 64; new_size < size/10; new_size = new_size << 1);
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
-    new = safe_malloc(new_size * sizeof(struct crec *));
+    {
+      new = safe_malloc(new_size * sizeof(struct crec *));
+      new_rev = safe_malloc(new_size * sizeof(struct crec *));
+    }
   else if (new_size <= hash_size || !(new = whine_malloc(new_size * sizeof(struct crec *))))
     return;
+  else if (!(new_rev = whine_malloc(new_size * sizeof(struct crec *))))
+    {
+      free(new);
+      return;
+    }
 
   for(i = 0; i < new_size; i++)
-    new[i] = NULL;
+    new[i] = new_rev[i] = NULL;
+
+  /* add_hosts_entry() moves buckets for each name it adds, and the table
+     only doubles after about ten names per bucket have been added, so
+     the last growth is long finished by now. This is only a backstop. */
+  rehash_move(old_size);
 
-  old = hash_table;
+  old_hash = hash_table;
+  old_rev = rev_table;
   old_size = hash_size;
+  moved = 0;
   hash_table = new;
+  rev_table = new_rev;
   hash_size = new_size;
+}
+
+/* Move count buckets from the old tables to the new ones, if there are
+   any. Each old bucket only feeds new buckets which are still empty, since
+   their names are looked for in the old one until now, so adding to the
+   ends of the new chains keeps the order cache_hash() maintains. Not to be
+   called whilst anything holds a pointer into a hash chain. */
+static void rehash_move(int count)
+{
+  struct crec *p, *tmp, **up;
   
-  if (old)
+  for (; old_hash && count > 0; count--)
     {
-      for (i = 0; i < old_size; i++)
-	for (p = old[i]; p ; p = tmp)
-	  {
-	    tmp = p->hash_next;
-	    cache_hash(p);
-	  }
-      free(old);
+      int i = moved++;
+
+      for (p = old_hash[i]; p; p = tmp)
+	{
+	  tmp = p->hash_next;
+	  for (up = hash_bucket(cache_get_name(p)); *up; up = &((*up)->hash_next));
+	  p->hash_next = NULL;
+	  *up = p;
+	}
+
+      for (p = old_rev[i]; p; p = tmp)
+	{
+	  tmp = p->rev_next;
+	  for (up = rev_bucket(&p->addr.addr, p->flags); *up; up = &((*up)->rev_next));
+	  p->rev_next = NULL;
+	  *up = p;
+	}
+
+      if (moved == old_size)
+	{
+	  free(old_hash);
+	  free(old_rev);
+	  old_hash = old_rev = NULL;
+	}
     }
 }
-  
+
+static struct crec **table_bucket(struct crec **table, struct crec **old, unsigned int val)
+{
+  /* hash_size is a power of two, and a multiple of old_size */
+  if (old && (int)(val & (old_size - 1)) >= moved)
+    return old + (val & (old_size - 1));
+
+  return table + (val & (hash_size - 1));
+}
+
 static struct crec **hash_bucket(char *name)
 {
   unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
@@ -159,8 +287,59 @@ static struct crec **hash_bucket(char *name)
       val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
     } 
   
-  /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+  return table_bucket(hash_table, old_hash, val ^ (val >> 16));
+}
+
+/* Hash on the address for the reverse index. The address length comes from
+   the F_IPV4/F_IPV6 flags so that the stored and probed addresses agree. */
+static struct crec **rev_bucket(struct all_addr *addr, unsigned int flags)
+{
+  unsigned int val = 017465;
+  int i, addrlen = INADDRSZ;
+  const unsigned char *a = (const unsigned char *)addr;
+
+#ifdef HAVE_IPV6
+  if (flags & F_IPV6)
+    addrlen = IN6ADDRSZ;
+#else
+  (void)flags;
+#endif
+
+  for (i = 0; i < addrlen; i++)
+    val = ((val << 7) | (val >> (32 - 7))) ^ (a[i] * 0x9e3779b1u);
+  
+  return table_bucket(rev_table, old_rev, val ^ (val >> 16));
+}
+
+static void rev_unhash(struct crec *crecp)
+{
+  struct crec **up;
+
+  if (!(crecp->flags & F_REVERSE))
+    return;
+
+  for (up = rev_bucket(&crecp->addr.addr, crecp->flags); *up; up = &((*up)->rev_next))
+    if (*up == crecp)
+      {
+	*up = crecp->rev_next;
+	break;
+      }
+}
+
+/* Remove an entry from its name hash chain, and the reverse index. Only
+   used when we don't already have a pointer into the chain. */
+static void cache_unhash(struct crec *crecp)
+{
+  struct crec **up;
+
+  for (up = hash_bucket(cache_get_name(crecp)); *up; up = &((*up)->hash_next))
+    if (*up == crecp)
+      {
+	*up = crecp->hash_next;
+	break;
+      }
+
+  rev_unhash(crecp);
 }
 
 static void cache_hash(struct crec *crecp)
@@ -168,7 +347,8 @@ static void cache_hash(struct crec *crecp)
   /* maintain an invariant that all entries with F_REVERSE set
      are at the start of the hash-chain  and all non-reverse
      immortal entries are at the end of the hash-chain.
-     This allows reverse searches and garbage collection to be optimised */
+     This allows garbage collection to be optimised. Entries with F_REVERSE
+     set are also linked into the by-address index, for reverse searches. */
 
   struct crec **up = hash_bucket(cache_get_name(crecp));
 
@@ -183,6 +363,13 @@ static void cache_hash(struct crec *crecp)
     }
   crecp->hash_next = *up;
   *up = crecp;
+
+  if (crecp->flags & F_REVERSE)
+    {
+      up = rev_bucket(&crecp->addr.addr, crecp->flags);
+      crecp->rev_next = *up;
+      *up = crecp;
+    }
 }
 
 #ifdef HAVE_DNSSEC
@@ -208,6 +395,8 @@ static void cache_free(struct crec *crecp)
   crecp->prev = cache_tail;
   crecp->next = NULL;
   cache_tail = crecp;
+  if (daemon->cache_protect && !prob_head)
+    prob_head = crecp;
   
   /* retrieve big name for further use. */
   if (crecp->flags & F_BIGNAME)
@@ -222,8 +411,8 @@ static void cache_free(struct crec *crecp)
 #endif
 }    
 
-/* insert a new cache entry at the head of the list (youngest entry) */
-static void cache_link(struct crec *crecp)
+/* put a cache entry at the head of the list (youngest entry) */
+static void cache_link_head(struct crec *crecp)
 {
   if (cache_head) /* check needed for init code */
     cache_head->prev = crecp;
@@ -234,9 +423,46 @@ static void cache_link(struct crec *crecp)
     cache_tail = crecp;
 }
 
+/* insert a new cache entry, at the head of the probationary part
+   of the list if there is one. */
+static void cache_link(struct crec *crecp)
+{
+  if (!daemon->cache_protect)
+    cache_link_head(crecp);
+  else if (!prob_head)
+    {
+      if (cache_tail)
+	cache_tail->next = crecp;
+      else
+	cache_head = crecp;
+      crecp->prev = cache_tail;
+      crecp->next = NULL;
+      cache_tail = prob_head = crecp;
+    }
+  else
+    {
+      if ((crecp->prev = prob_head->prev))
+	crecp->prev->next = crecp;
+      else
+	cache_head = crecp;
+      crecp->next = prob_head;
+      prob_head->prev = crecp;
+      prob_head = crecp;
+    }
+}
+
 /* remove an arbitrary cache entry for promotion */ 
 static void cache_unlink (struct crec *crecp)
 {
+  if (crecp == prob_head)
+    prob_head = crecp->next;
+  
+  if (crecp->protect)
+    {
+      crecp->protect = 0;
+      cache_protected--;
+    }
+
   if (crecp->prev)
     crecp->prev->next = crecp->next;
   else
@@ -248,6 +474,60 @@ static void cache_unlink (struct crec *crecp)
     cache_tail = crecp->prev;
 }
 
+/* An upstream answer from the cache is being given to a client. Return
+   true if it has been asked for often enough, and is close enough to
+   expiry, that it's worth getting it again now with --prefetch, so that
+   later clients don't have to wait for it. */
+int cache_prefetch_due(struct crec *crecp, time_t now)
+{
+  if (!daemon->prefetch_hits ||
+      (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)))
+    return 0;
+
+  if (crecp->hits != 255)
+    crecp->hits++;
+  
+  if (crecp->hits < daemon->prefetch_hits ||
+      difftime(crecp->ttd, now) * 100 > (double)crecp->ttl * daemon->prefetch_percent)
+    return 0;
+  
+  /* count again if the refresh doesn't happen */
+  crecp->hits = 0;
+  return 1;
+}
+
+/* an entry has been found again: move it to the head of the list,
+   which protects it in a segmented cache. */
+static void cache_promote(struct crec *crecp)
+{
+  if (!daemon->cache_protect)
+    {
+      cache_unlink(crecp);
+      cache_link_head(crecp);
+      return;
+    }
+  
+  if (crecp->protect)
+    protected_hits++;
+  else
+    probation_hits++;
+  
+  cache_unlink(crecp);
+  cache_link_head(crecp);
+  crecp->protect = 1;
+  cache_protected++;
+  
+  /* oldest protected entries go back to the head of the probationary part */
+  while (cache_protected > protect_max)
+    {
+      struct crec *old = prob_head ? prob_head->prev : cache_tail;
+      
+      old->protect = 0;
+      cache_protected--;
+      prob_head = old;
+    }
+}
+
 char *cache_get_name(struct crec *crecp)
 {
   if (crecp->flags & F_BIGNAME)
@@ -275,6 +555,7 @@ struct crec *cache_enumerate(int init)
 
   if (init)
     {
+      rehash_move(old_size);
       bucket = 0;
       cache = NULL;
     }
@@ -314,16 +595,32 @@ static int is_expired(time_t now, struct crec *crecp)
   if (difftime(now, crecp->ttd) < 0)
     return 0;
   
+  if (daemon->stale_max && !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
+      difftime(now, crecp->ttd) < daemon->stale_max)
+    return 0;
+
   return 1;
 }
 
+/* Expired, but kept, and not wanted now. */
+static int is_stale(time_t now, struct crec *crecp)
+{
+  return daemon->stale_max && !serving_stale && 
+    !(crecp->flags & F_IMMORTAL) && difftime(now, crecp->ttd) >= 0;
+}
+
+void cache_serve_stale(int on)
+{
+  serving_stale = on;
+}
+
 static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t now, unsigned short flags)
 {
   /* Scan and remove old entries.
      If (flags & F_FORWARD) then remove any forward entries for name and any expired
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
-     entries in the whole cache.
+     entries with the same address hash, using the reverse index.
      If (flags == 0) remove any expired entries in the whole cache. 
 
      In the flags & F_FORWARD case, the return code is valid, and returns a non-NULL pointer
@@ -341,6 +638,7 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 	  if (is_expired(now, crecp) || is_outdated_cname_pointer(crecp))
 	    { 
 	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{
 		  cache_unlink(crecp);
@@ -358,6 +656,7 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		    return crecp;
 		  *up = crecp->hash_next;
+		  rev_unhash(crecp);
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		  continue;
@@ -370,6 +669,7 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 		  if (crecp->flags & F_CONFIG)
 		    return crecp;
 		  *up = crecp->hash_next;
+		  rev_unhash(crecp);
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		  continue;
@@ -379,14 +679,35 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 	  up = &crecp->hash_next;
 	}
     }
-  else
+  else if (flags & F_REVERSE)
     {
-      int i;
 #ifdef HAVE_IPV6
       int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 #else
       int addrlen = INADDRSZ;
 #endif 
+      for (up = rev_bucket(addr, flags), crecp = *up; crecp; crecp = crecp->rev_next)
+	if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
+	    (is_expired(now, crecp) ||
+	     ((flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
+	      memcmp(&crecp->addr.addr, addr, addrlen) == 0)))
+	  {
+	    *up = crecp->rev_next;
+	    /* F_REVERSE still set, but we've done the reverse unlink */
+	    crecp->flags &= ~F_REVERSE;
+	    cache_unhash(crecp);
+	    cache_unlink(crecp);
+	    cache_free(crecp);
+	  }
+	else
+	  up = &crecp->rev_next;
+    }
+  else
+    {
+      int i;
+
+      rehash_move(old_size);
+
       for (i = 0; i < hash_size; i++)
 	for (crecp = hash_table[i], up = &hash_table[i]; 
 	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
@@ -394,21 +715,13 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 	  if (is_expired(now, crecp))
 	    {
 	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{ 
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		}
 	    }
-	  else if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
-		   (flags & crecp->flags & F_REVERSE) && 
-		   (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
-		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
-	    {
-	      *up = crecp->hash_next;
-	      cache_unlink(crecp);
-	      cache_free(crecp);
-	    }
 	  else
 	    up = &crecp->hash_next;
     }
@@ -444,13 +757,15 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 {
   struct crec *new;
   union bigname *big_name = NULL;
-  int freed_all = flags & F_REVERSE;
+  int freed_all = 0;
   int free_avail = 0;
+  int expired;
 
   /* Don't log DNSSEC records here, done elsewhere */
   if (flags & (F_IPV4 | F_IPV6 | F_CNAME))
     {
-      log_query(flags | F_UPSTREAM, name, addr, NULL);
+      if (!insert_quiet)
+	log_query(flags | F_UPSTREAM, name, addr, NULL);
       /* Don't mess with TTL for DNSSEC records. */
       if (daemon->max_cache_ttl != 0 && daemon->max_cache_ttl < ttl)
 	ttl = daemon->max_cache_ttl;
@@ -462,6 +777,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
   if (insert_error)
     return NULL;
   
+  rehash_move(REHASH_STEP);
+
   /* First remove any expired entries and entries for the name/address we
      are currently inserting. */
   if ((new = cache_scan_free(name, addr, now, flags)))
@@ -517,7 +834,12 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 	    return NULL;
 	  }
 		
-	if (freed_all)
+	/* An entry past its TTL at the tail is one kept by --serve-stale:
+	   take it at once, rather than scanning the whole cache for
+	   expired entries, and don't count it as a live one. */
+	expired = !(new->flags & F_IMMORTAL) && difftime(now, new->ttd) >= 0;
+
+	if (freed_all || expired)
 	  {
 	    struct all_addr free_addr = new->addr.addr;;
 
@@ -529,7 +851,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 	    
 	    free_avail = 1; /* Must be free space now. */
 	    cache_scan_free(cache_get_name(new), &free_addr, now, new->flags);
-	    cache_live_freed++;
+	    if (!expired)
+	      cache_live_freed++;
 	  }
 	else
 	  {
@@ -587,6 +910,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
     }
 
   new->ttd = now + (time_t)ttl;
+  new->ttl = ttl;
+  new->hits = 0;
   new->next = new_chain;
   new_chain = new;
 
@@ -599,6 +924,9 @@ void cache_end_insert(void)
   if (insert_error)
     return;
   
+  if (!insert_quiet && (daemon->cache_parentfd != -1 || daemon->workers))
+    cache_send_inserts();
+
   while (new_chain)
     { 
       struct crec *tmp = new_chain->next;
@@ -616,6 +944,471 @@ void cache_end_insert(void)
   new_chain = NULL;
 }
 
+/* Send a batch to the parent if we're a child, else to each DNS worker
+   except the one it came from. Never block: a full socket drops it. */
+static void xfer_send(unsigned char *buff, size_t len, int except)
+{
+  int i;
+
+  if (daemon->cache_parentfd != -1)
+    while (send(daemon->cache_parentfd, buff, len, 0) == -1 && errno == EINTR);
+  else if (daemon->workers)
+    for (i = 0; i < daemon->dns_workers; i++)
+      if (daemon->workers[i].fd != -1 && daemon->workers[i].fd != except)
+	while (send(daemon->workers[i].fd, buff, len, 0) == -1 && errno == EINTR);
+}
+
+/* In a TCP child or DNS worker, pass the batch of entries about to be
+   committed to the parent so that they survive the child. A batch goes in one
+   datagram so that CNAMEs can be re-linked to their targets at the
+   other end; if it won't fit or the socket is full, just drop it. */
+static void cache_send_inserts(void)
+{
+  static unsigned char *buff = NULL;
+  struct crec *crecp, *tmp;
+  struct cache_xfer x;
+  size_t len = 0;
+  
+  if (!buff && !(buff = whine_malloc(CACHE_XFER_SIZE)))
+    return;
+
+  for (crecp = new_chain; crecp; crecp = crecp->next)
+    {
+      char *name = cache_get_name(crecp);
+      
+      memset(&x, 0, sizeof(x));
+      x.ttd = crecp->ttd;
+      x.uid = crecp->uid;
+      x.flags = crecp->flags & ~(F_BIGNAME | F_NAMEP);
+      x.namelen = strlen(name) + 1;
+      x.target = -1;
+
+      if (crecp->flags & F_CNAME)
+	{
+	  int i;
+	  
+	  if (crecp->addr.cname.uid == SRC_INTERFACE)
+	    continue;
+	  
+	  for (i = 0, tmp = new_chain; tmp; tmp = tmp->next)
+	    if (tmp == crecp->addr.cname.target.cache)
+	      {
+		x.target = i;
+		break;
+	      }
+	    else if (!(tmp->flags & F_CNAME) || tmp->addr.cname.uid != SRC_INTERFACE)
+	      i++;
+	}
+#ifdef HAVE_DNSSEC
+      else if ((crecp->flags & F_DNSKEY) && !(crecp->flags & F_NEG))
+	{
+	  x.datalen = crecp->addr.key.keylen;
+	  x.u.key.flags = crecp->addr.key.flags;
+	  x.u.key.keytag = crecp->addr.key.keytag;
+	  x.u.key.algo = crecp->addr.key.algo;
+	}
+      else if ((crecp->flags & F_DS) && !(crecp->flags & F_NEG))
+	{
+	  x.datalen = crecp->addr.ds.keylen;
+	  x.u.key.keytag = crecp->addr.ds.keytag;
+	  x.u.key.algo = crecp->addr.ds.algo;
+	  x.u.key.digest = crecp->addr.ds.digest;
+	}
+#endif
+      else if (!(crecp->flags & (F_DS | F_DNSKEY)))
+	x.u.addr = crecp->addr.addr;
+
+      if (len + sizeof(x) + x.namelen + x.datalen > CACHE_XFER_SIZE)
+	return;
+
+      memcpy(buff + len, &x, sizeof(x));
+      memcpy(buff + len + sizeof(x), name, x.namelen);
+#ifdef HAVE_DNSSEC
+      if (x.datalen != 0)
+	blockdata_retrieve(crecp->addr.key.keydata, x.datalen, buff + len + sizeof(x) + x.namelen);
+#endif
+      len += sizeof(x) + x.namelen + x.datalen;
+    }
+  
+  if (len != 0)
+    xfer_send(buff, len, -1);
+}
+
+/* In the parent, insert a batch of entries sent by a TCP child or a DNS
+   worker, and pass it on to the other workers. */
+void cache_recv_inserts(int fd, time_t now)
+{
+  static unsigned char *buff = NULL;
+  struct crec **crecs;
+  struct cache_xfer x;
+  ssize_t len;
+  size_t p;
+  int count, i;
+  
+  if (!buff && !(buff = whine_malloc(CACHE_XFER_SIZE)))
+    return;
+
+  if ((len = recv(fd, buff, CACHE_XFER_SIZE, 0)) <= 0)
+    return;
+  
+  /* count and sanity check entries */
+  for (count = 0, p = 0; p + sizeof(x) <= (size_t)len; count++)
+    {
+      memcpy(&x, buff + p, sizeof(x));
+      p += sizeof(x) + x.namelen + x.datalen;
+      if (x.namelen == 0 || x.namelen > MAXDNAME || p > (size_t)len ||
+	  buff[p - x.datalen - 1] != 0)
+	return;
+    }
+  
+  if (p != (size_t)len)
+    return;
+
+#ifdef HAVE_DHCP
+  memcpy(&x, buff, sizeof(x));
+  if ((x.flags & F_DHCP) && fd == daemon->cache_parentfd)
+    {
+      cache_recv_dhcp(buff, count, now);
+      return;
+    }
+#endif
+
+  if (!(crecs = whine_malloc(count * sizeof(struct crec *))))
+    return;
+
+  if (daemon->workers)
+    xfer_send(buff, len, fd);
+  
+  cache_start_insert();
+  insert_quiet = 1;
+
+  for (i = 0, p = 0; i < count; i++)
+    {
+      struct all_addr addr;
+      char *name = (char *)buff + p + sizeof(x);
+      
+      memcpy(&x, buff + p, sizeof(x));
+      p += sizeof(x) + x.namelen + x.datalen;
+      crecs[i] = NULL;
+      
+      if (difftime(x.ttd, now) <= 0)
+	continue;
+
+      addr = x.u.addr;
+#ifdef HAVE_DNSSEC
+      if (x.flags & (F_DS | F_DNSKEY))
+	{
+	  struct blockdata *key = NULL;
+	  
+	  addr.addr.dnssec.class = x.uid;
+	  
+	  if (x.datalen != 0 && !(key = blockdata_alloc(name + x.namelen, x.datalen)))
+	    continue;
+	  
+	  if (!(crecs[i] = cache_insert(name, &addr, now, x.ttd - now, x.flags)))
+	    {
+	      blockdata_free(key);
+	      continue;
+	    }
+	  
+	  if (key && (x.flags & F_DNSKEY))
+	    {
+	      crecs[i]->addr.key.keydata = key;
+	      crecs[i]->addr.key.keylen = x.datalen;
+	      crecs[i]->addr.key.flags = x.u.key.flags;
+	      crecs[i]->addr.key.keytag = x.u.key.keytag;
+	      crecs[i]->addr.key.algo = x.u.key.algo;
+	    }
+	  else if (key)
+	    {
+	      crecs[i]->addr.ds.keydata = key;
+	      crecs[i]->addr.ds.keylen = x.datalen;
+	      crecs[i]->addr.ds.keytag = x.u.key.keytag;
+	      crecs[i]->addr.ds.algo = x.u.key.algo;
+	      crecs[i]->addr.ds.digest = x.u.key.digest;
+	    }
+	}
+      else
+#endif
+	if (!(x.flags & (F_DS | F_DNSKEY)))
+	  crecs[i] = cache_insert(name, (x.flags & F_CNAME) ? NULL : &addr, now, x.ttd - now, x.flags);
+    }
+
+  /* Now all the entries exist, point CNAMEs at their targets. One whose
+     target didn't come along is left with none, which makes
+     is_outdated_cname_pointer() true, so cache_end_insert() frees it
+     rather than committing it. */
+  for (i = 0, p = 0; i < count; i++)
+    {
+      memcpy(&x, buff + p, sizeof(x));
+      p += sizeof(x) + x.namelen + x.datalen;
+      
+      if (crecs[i] && (x.flags & F_CNAME))
+	{
+	  struct crec *target = (x.target >= 0 && x.target < count) ? crecs[x.target] : NULL;
+	  
+	  crecs[i]->addr.cname.target.cache = target;
+	  crecs[i]->addr.cname.uid = target ? target->uid : 1;
+	}
+    }
+  
+  cache_end_insert();
+  insert_quiet = 0;
+  free(crecs);
+}
+
+#ifdef HAVE_DHCP
+/* A lease's names go to the DNS workers after a record with no name and
+   no address type which carries its key. A lease with no names left is
+   forgotten, and a key of NULL forgets all of them. A lease's records
+   aren't split between batches, so CNAMEs can find their targets. */
+static void dhcp_put(struct cache_xfer *x, char *name)
+{
+  memcpy(dhcp_buff + dhcp_len, x, sizeof(*x));
+  memcpy(dhcp_buff + dhcp_len + sizeof(*x), name, x->namelen);
+  dhcp_len += sizeof(*x) + x->namelen;
+  dhcp_count++;
+}
+
+/* In the main process, queue the names of a lease for the DNS workers. */
+void cache_send_dhcp(void *key, struct crec *chain)
+{
+  struct cache_xfer x;
+  struct crec *crecp, *tmp;
+  size_t need = sizeof(x) + 1;
+  int i, base;
+
+  if (!daemon->workers)
+    return;
+
+  for (crecp = chain; crecp; crecp = crecp->prev)
+    need += sizeof(x) + strlen(cache_get_name(crecp)) + 1;
+
+  if (dhcp_len + need > CACHE_XFER_SIZE)
+    cache_flush_dhcp();
+
+  /* Can't send it, the workers will have to start again. */
+  if (need > CACHE_XFER_SIZE || 
+      (!dhcp_buff && !(dhcp_buff = whine_malloc(CACHE_XFER_SIZE))))
+    {
+      reload_dns_workers(0);
+      return;
+    }
+
+  memset(&x, 0, sizeof(x));
+  x.flags = F_DHCP;
+  x.namelen = 1;
+  x.target = -1;
+  memcpy(&x.u.addr, &key, sizeof(key));
+  dhcp_put(&x, "");
+
+  for (base = dhcp_count, crecp = chain; crecp; crecp = crecp->prev)
+    {
+      char *name = cache_get_name(crecp);
+
+      memset(&x, 0, sizeof(x));
+      x.ttd = crecp->ttd;
+      x.flags = crecp->flags & ~(F_BIGNAME | F_NAMEP);
+      x.namelen = strlen(name) + 1;
+      x.target = -1;
+
+      if (crecp->flags & F_CNAME)
+	{
+	  for (i = base, tmp = chain; tmp; tmp = tmp->prev, i++)
+	    if (tmp == crecp->addr.cname.target.cache)
+	      {
+		x.target = i;
+		break;
+	      }
+	}
+      else
+	x.u.addr = crecp->addr.addr;
+
+      dhcp_put(&x, name);
+    }
+}
+
+/* Send the queued DHCP names to the DNS workers. Never wait for one:
+   a worker whose socket is full misses them, gets no more, and is
+   restarted by start_dns_workers() to catch up. */
+void cache_flush_dhcp(void)
+{
+  ssize_t rc;
+  int i;
+
+  if (dhcp_len != 0 && daemon->workers)
+    for (i = 0; i < daemon->dns_workers; i++)
+      if (daemon->workers[i].fd != -1 && !daemon->workers[i].resync)
+	{
+	  while ((rc = send(daemon->workers[i].fd, dhcp_buff, dhcp_len, 0)) == -1 && errno == EINTR);
+	  if (rc == -1)
+	    daemon->workers[i].resync = 1;
+	}
+
+  dhcp_len = 0;
+  dhcp_count = 0;
+}
+
+static struct dhcp_copy **copy_bucket(void *key)
+{
+  return &copy_hash[((unsigned long)key >> 4) & (copy_hash_size - 1)];
+}
+
+/* In a DNS worker, take over the names of a lease as copied at fork(). */
+void cache_keep_dhcp(void *key, struct crec *chain)
+{
+  struct dhcp_copy *copy, **up;
+
+  if (!copy_hash)
+    {
+      for (copy_hash_size = 64; copy_hash_size < (unsigned int)daemon->dhcp_max && copy_hash_size < (1u << 20); copy_hash_size <<= 1);
+      copy_hash = safe_malloc(copy_hash_size * sizeof(struct dhcp_copy *));
+      memset(copy_hash, 0, copy_hash_size * sizeof(struct dhcp_copy *));
+    }
+  
+  if (!chain || !(copy = whine_malloc(sizeof(struct dhcp_copy))))
+    return;
+
+  up = copy_bucket(key);
+  copy->key = key;
+  copy->chain = chain;
+  copy->names = NULL;
+  copy->next = *up;
+  *up = copy;
+}
+
+static void copy_free(struct dhcp_copy *copy)
+{
+  cache_del_dhcp_entries(&copy->chain);
+  free(copy->names);
+  free(copy);
+}
+
+/* In a DNS worker, apply a batch of changes to the DHCP names. */
+static void cache_recv_dhcp(unsigned char *buff, int count, time_t now)
+{
+  struct crec **crecs, *crecp;
+  struct dhcp_copy *copy = NULL, **up, *tmp;
+  struct cache_xfer x;
+  char *names = NULL;
+  void *key;
+  size_t p, q;
+  unsigned int j;
+  int i;
+
+  if (!copy_hash)
+    cache_keep_dhcp(NULL, NULL); /* makes the table */
+
+  if (!(crecs = whine_malloc(count * sizeof(struct crec *))))
+    return;
+
+  for (i = 0, p = 0; i < count; i++)
+    {
+      memcpy(&x, buff + p, sizeof(x));
+      p += sizeof(x) + x.namelen + x.datalen;
+      crecs[i] = NULL;
+
+      if (!(x.flags & (F_IPV4 | F_IPV6 | F_CNAME)))
+	{
+	  memcpy(&key, &x.u.addr, sizeof(key));
+	  copy = NULL;
+	  
+	  if (!key)
+	    for (j = 0; j < copy_hash_size; j++)
+	      for (; copy_hash[j]; copy_hash[j] = tmp)
+		{
+		  tmp = copy_hash[j]->next;
+		  copy_free(copy_hash[j]);
+		}
+	  else
+	    {
+	      for (up = copy_bucket(key); *up; up = &(*up)->next)
+		if ((*up)->key == key)
+		  {
+		    tmp = *up;
+		    *up = tmp->next;
+		    copy_free(tmp);
+		    break;
+		  }
+	      
+	      /* room for the names which follow */
+	      for (q = p, j = i + 1; (int)j < count; j++)
+		{
+		  memcpy(&x, buff + q, sizeof(x));
+		  if (!(x.flags & (F_IPV4 | F_IPV6 | F_CNAME)))
+		    break;
+		  q += sizeof(x) + x.namelen + x.datalen;
+		}
+	      
+	      if (q != p && (copy = whine_malloc(sizeof(struct dhcp_copy))) &&
+		  !(copy->names = whine_malloc(q - p)))
+		{
+		  free(copy);
+		  copy = NULL;
+		}
+	      
+	      if (copy)
+		{
+		  up = copy_bucket(key);
+		  copy->key = key;
+		  copy->chain = NULL;
+		  copy->next = *up;
+		  *up = copy;
+		  names = copy->names;
+		}
+	    }
+	  continue;
+	}
+      
+      if (!copy)
+	continue;
+
+      if ((crecp = dhcp_spare))
+	dhcp_spare = dhcp_spare->next;
+      else if (!(crecp = whine_malloc(sizeof(struct crec))))
+	continue;
+
+      memcpy(names, buff + p - x.namelen - x.datalen, x.namelen);
+      crecp->name.namep = names;
+      names += x.namelen;
+      
+      /* As in cache_add_dhcp_entry(), the name replaces any answers from upstream. */
+      cache_scan_free(crecp->name.namep, NULL, now, F_FORWARD | (x.flags & (F_IPV4 | F_IPV6 | F_CNAME)));
+      
+      crecp->flags = x.flags | F_NAMEP;
+      crecp->ttd = x.ttd;
+      crecp->uid = next_uid();
+      if (!(x.flags & F_CNAME))
+	crecp->addr.addr = x.u.addr;
+      crecp->prev = copy->chain;
+      copy->chain = crecp;
+      crecs[i] = crecp;
+    }
+  
+  /* Now all the entries exist, point CNAMEs at their targets. */
+  for (i = 0, p = 0; i < count; i++)
+    {
+      memcpy(&x, buff + p, sizeof(x));
+      p += sizeof(x) + x.namelen + x.datalen;
+
+      if (!(crecp = crecs[i]))
+	continue;
+      
+      if (x.flags & F_CNAME)
+	{
+	  if (x.target < 0 || x.target >= count || !crecs[x.target])
+	    continue;
+	  crecp->addr.cname.target.cache = crecs[x.target];
+	  crecp->addr.cname.uid = crecs[x.target]->uid;
+	}
+      
+      cache_hash(crecp);
+    }
+  
+  free(crecs);
+}
+#endif
+
 struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsigned int prot)
 {
   struct crec *ans;
@@ -632,13 +1425,15 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
       struct crec *next, **up, **insert = NULL, **chainp = &ans;
       unsigned short ins_flags = 0;
       
+      rehash_move(REHASH_STEP);
+
       for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
 	{
 	  next = crecp->hash_next;
 	  
 	  if (!is_expired(now, crecp) && !is_outdated_cname_pointer(crecp))
 	    {
-	      if ((crecp->flags & F_FORWARD) && 
+	      if ((crecp->flags & F_FORWARD) && !is_stale(now, crecp) &&
 		  (crecp->flags & prot) &&
 		  hostname_isequal(cache_get_name(crecp), name))
 		{
@@ -648,10 +1443,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 		      chainp = &crecp->next;
 		    }
 		  else
-		    {
-		      cache_unlink(crecp);
-		      cache_link(crecp);
-		    }
+		    cache_promote(crecp);
 	      	      
 		  /* Move all but the first entry up the hash chain
 		     this implements round-robin. 
@@ -676,13 +1468,14 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 		    }
 		}
 	      else
-		/* case : not expired, incorrect entry. */
+		/* case : not expired, incorrect or stale entry. */
 		up = &crecp->hash_next; 
 	    }
 	  else
 	    {
 	      /* expired entry, free it */
 	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{ 
 		  cache_unlink(crecp);
@@ -697,6 +1490,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
   if (ans && 
       (ans->flags & F_FORWARD) &&
       (ans->flags & prot) &&     
+      !is_stale(now, ans) &&
       hostname_isequal(cache_get_name(ans), name))
     return ans;
   
@@ -717,44 +1511,41 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
     ans = crecp->next;
   else
     {  
-      /* first search, look for relevant entries and push to top of list
-	 also free anything which has expired. All the reverse entries are at the
-	 start of the hash chain, so we can give up when we find the first 
-	 non-REVERSE one.  */
-       int i;
-       struct crec **up, **chainp = &ans;
+      /* first search, look for relevant entries in the reverse index and push
+	 to top of list. Expired DHCP entries are unhashed, as
+	 cache_scan_free() does for names: they stay on their lease's
+	 chain until the lease is renewed or pruned. Other expired entries
+	 are skipped here, and left for cache_scan_free() to reclaim. */
+       struct crec **chainp = &ans, **up, *next;
        
-       for (i=0; i<hash_size; i++)
-	 for (crecp = hash_table[i], up = &hash_table[i]; 
-	      crecp && (crecp->flags & F_REVERSE);
-	      crecp = crecp->hash_next)
-	   if (!is_expired(now, crecp))
-	     {      
-	       if ((crecp->flags & prot) &&
-		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
-		 {	    
-		   if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
-		     {
-		       *chainp = crecp;
-		       chainp = &crecp->next;
-		     }
-		   else
-		     {
-		       cache_unlink(crecp);
-		       cache_link(crecp);
-		     }
-		 }
-	       up = &crecp->hash_next;
-	     }
-	   else
+       rehash_move(REHASH_STEP);
+
+       for (up = rev_bucket(addr, prot), crecp = *up; crecp; crecp = next)
+	 {
+	   next = crecp->rev_next;
+	   
+	   if ((crecp->flags & F_DHCP) && is_expired(now, crecp))
 	     {
-	       *up = crecp->hash_next;
-	       if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
+	       *up = next;
+	       cache_unhash(crecp); /* only the name chain left */
+	       continue;
+	     }
+	   
+	   if (!is_expired(now, crecp) && !is_stale(now, crecp) &&
+	       (crecp->flags & prot) &&
+	       memcmp(&crecp->addr.addr, addr, addrlen) == 0)
+	     {	    
+	       if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		 {
-		   cache_unlink(crecp);
-		   cache_free(crecp);
+		   *chainp = crecp;
+		   chainp = &crecp->next;
 		 }
+	       else
+		 cache_promote(crecp);
 	     }
+	   
+	   up = &crecp->rev_next;
+	 }
        
        *chainp = cache_head;
     }
@@ -762,12 +1553,44 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
   if (ans && 
       (ans->flags & F_REVERSE) &&
       (ans->flags & prot) &&
+      !is_expired(now, ans) && !is_stale(now, ans) &&
       memcmp(&ans->addr.addr, addr, addrlen) == 0)
     return ans;
   
   return NULL;
 }
 
+static void *hosts_alloc(size_t size)
+{
+  struct hosts_block *b = hosts_blocks;
+  size_t hdr = HOSTS_ALIGN(sizeof(struct hosts_block));
+
+  size = HOSTS_ALIGN(size);
+  
+  if (!b || b->size - b->used < size)
+    {
+      size_t bsize = b ? b->size * 2 : HOSTS_BLOCK_MIN;
+      
+      if (bsize > HOSTS_BLOCK_MAX)
+	bsize = HOSTS_BLOCK_MAX;
+      if (bsize < hdr + size)
+	bsize = hdr + size;
+      
+      if (!(b = whine_malloc(bsize)))
+	return NULL;
+      
+      b->size = bsize;
+      b->used = hdr;
+      b->next = hosts_blocks;
+      hosts_blocks = b;
+    }
+  
+  hosts_last = (char *)b + b->used;
+  b->used += size;
+  
+  return hosts_last;
+}
+
 static void add_hosts_cname(struct crec *target)
 {
   struct crec *crec;
@@ -775,7 +1598,7 @@ static void add_hosts_cname(struct crec *target)
   
   for (a = daemon->cnames; a; a = a->next)
     if (hostname_isequal(cache_get_name(target), a->target) &&
-	(crec = whine_malloc(sizeof(struct crec))))
+	(crec = hosts_alloc(sizeof(struct crec))))
       {
 	crec->flags = F_FORWARD | F_IMMORTAL | F_NAMEP | F_CONFIG | F_CNAME;
 	crec->name.namep = a->alias;
@@ -790,17 +1613,25 @@ static void add_hosts_cname(struct crec *target)
 static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, 
 			    unsigned int index, struct crec **rhash, int hashsz)
 {
-  struct crec *lookup = cache_find_by_name(NULL, cache_get_name(cache), 0, cache->flags & (F_IPV4 | F_IPV6));
+  struct crec *lookup;
   int i, nameexists = 0;
   unsigned int j; 
 
+  /* Keep moving to the table which read_hostsfile() last grew. */
+  rehash_move(REHASH_STEP);
+  
+  lookup = cache_find_by_name(NULL, cache_get_name(cache), 0, cache->flags & (F_IPV4 | F_IPV6));
+
   /* Remove duplicates in hosts files. */
   if (lookup && (lookup->flags & F_HOSTS))
     {
       nameexists = 1;
       if (memcmp(&lookup->addr.addr, addr, addrlen) == 0)
 	{
-	  free(cache);
+	  /* the last thing allocated, so can be given back */
+	  if (cache == hosts_last)
+	    hosts_blocks->used = (char *)cache - (char *)hosts_blocks;
+	  hosts_last = NULL;
 	  return;
 	}
     }
@@ -974,8 +1805,8 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	    {
 	      /* If set, add a version of the name with a default domain appended */
 	      if (option_bool(OPT_EXPAND) && domain_suffix && !fqdn && 
-		  (cache = whine_malloc(sizeof(struct crec) + 
-					strlen(canon)+2+strlen(domain_suffix)-SMALLDNAME)))
+		  (cache = hosts_alloc(sizeof(struct crec) + 
+				       strlen(canon)+2+strlen(domain_suffix)-SMALLDNAME)))
 		{
 		  strcpy(cache->name.sname, canon);
 		  strcat(cache->name.sname, ".");
@@ -984,7 +1815,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 		  add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
 		  name_count++;
 		}
-	      if ((cache = whine_malloc(sizeof(struct crec) + strlen(canon)+1-SMALLDNAME)))
+	      if ((cache = hosts_alloc(sizeof(struct crec) + strlen(canon)+1-SMALLDNAME)))
 		{
 		  strcpy(cache->name.sname, canon);
 		  cache->flags = flags;
@@ -1023,7 +1854,11 @@ void cache_reload(void)
 #endif
 
   cache_inserted = cache_live_freed = 0;
+  protected_hits = probation_hits = 0;
   
+  /* Normally nothing left to move; we walk every bucket below anyway. */
+  rehash_move(old_size);
+
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
       {
@@ -1031,14 +1866,18 @@ void cache_reload(void)
 	cache_blockdata_free(cache);
 #endif
 	tmp = cache->hash_next;
-	if (cache->flags & (F_HOSTS | F_CONFIG))
+	if (cache->flags & F_DHCP)
+	  up = &cache->hash_next; /* belongs to a lease, see lease_update_dns() */
+	else if (cache->flags & (F_HOSTS | F_CONFIG))
 	  {
+	    /* freed with hosts_blocks, below */
 	    *up = cache->hash_next;
-	    free(cache);
+	    rev_unhash(cache);
 	  }
-	else if (!(cache->flags & F_DHCP))
+	else
 	  {
 	    *up = cache->hash_next;
+	    rev_unhash(cache);
 	    if (cache->flags & F_BIGNAME)
 	      {
 		cache->name.bname->next = big_free;
@@ -1046,15 +1885,30 @@ void cache_reload(void)
 	      }
 	    cache->flags = 0;
 	  }
-	else
-	  up = &cache->hash_next;
       }
+
+  while (hosts_blocks)
+    {
+      struct hosts_block *b = hosts_blocks;
+      hosts_blocks = b->next;
+      free(b);
+    }
+  hosts_last = NULL;
+
+  /* nothing left in the cache is worth protecting */
+  if (daemon->cache_protect)
+    {
+      for (cache = cache_head; cache; cache = cache->next)
+	cache->protect = 0;
+      cache_protected = 0;
+      prob_head = cache_head;
+    }
   
   /* Add CNAMEs to interface_names to the cache */
   for (a = daemon->cnames; a; a = a->next)
     for (intr = daemon->int_names; intr; intr = intr->next)
       if (hostname_isequal(a->target, intr->name) &&
-	  ((cache = whine_malloc(sizeof(struct crec)))))
+	  ((cache = hosts_alloc(sizeof(struct crec)))))
 	{
 	  cache->flags = F_FORWARD | F_NAMEP | F_CNAME | F_IMMORTAL | F_CONFIG;
 	  cache->name.namep = a->alias;
@@ -1067,7 +1921,7 @@ void cache_reload(void)
 
 #ifdef HAVE_DNSSEC
   for (ds = daemon->ds; ds; ds = ds->next)
-    if ((cache = whine_malloc(sizeof(struct crec))) &&
+    if ((cache = hosts_alloc(sizeof(struct crec))) &&
 	(cache->addr.ds.keydata = blockdata_alloc(ds->digest, ds->digestlen)))
       {
 	cache->flags = F_FORWARD | F_IMMORTAL | F_DS | F_CONFIG | F_NAMEP;
@@ -1092,7 +1946,7 @@ void cache_reload(void)
     for (nl = hr->names; nl; nl = nl->next)
       {
 	if (hr->addr.s_addr != 0 &&
-	    (cache = whine_malloc(sizeof(struct crec))))
+	    (cache = hosts_alloc(sizeof(struct crec))))
 	  {
 	    cache->name.namep = nl->name;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4 | F_NAMEP | F_CONFIG;
@@ -1100,7 +1954,7 @@ void cache_reload(void)
 	  }
 #ifdef HAVE_IPV6
 	if (!IN6_IS_ADDR_UNSPECIFIED(&hr->addr6) &&
-	    (cache = whine_malloc(sizeof(struct crec))))
+	    (cache = hosts_alloc(sizeof(struct crec))))
 	  {
 	    cache->name.namep = nl->name;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV6 | F_NAMEP | F_CONFIG;
@@ -1147,24 +2001,26 @@ struct in_addr a_record_from_hosts(char *name, time_t now)
   return ret;
 }
 
-void cache_unhash_dhcp(void)
+/* Take the records on a DHCP lease's chain (linked through ->prev, which
+   is otherwise only used by the LRU list that F_DHCP entries aren't on)
+   out of the cache and keep them for re-use. An entry may already have
+   left its hash chain when it expired. */
+void cache_del_dhcp_entries(struct crec **chain)
 {
-  struct crec *cache, **up;
-  int i;
+  struct crec *crec, *tmp;
 
-  for (i=0; i<hash_size; i++)
-    for (cache = hash_table[i], up = &hash_table[i]; cache; cache = cache->hash_next)
-      if (cache->flags & F_DHCP)
-	{
-	  *up = cache->hash_next;
-	  cache->next = dhcp_spare;
-	  dhcp_spare = cache;
-	}
-      else
-	up = &cache->hash_next;
+  for (crec = *chain; crec; crec = tmp)
+    {
+      tmp = crec->prev;
+      cache_unhash(crec);
+      crec->next = dhcp_spare;
+      dhcp_spare = crec;
+    }
+
+  *chain = NULL;
 }
 
-static void add_dhcp_cname(struct crec *target, time_t ttd)
+static void add_dhcp_cname(struct crec *target, time_t ttd, struct crec **chain)
 {
   struct crec *aliasc;
   struct cname *a;
@@ -1189,13 +2045,15 @@ static void add_dhcp_cname(struct crec *target, time_t ttd)
 	    aliasc->addr.cname.uid = target->uid;
 	    aliasc->uid = next_uid();
 	    cache_hash(aliasc);
-	    add_dhcp_cname(aliasc, ttd);
+	    aliasc->prev = *chain;
+	    *chain = aliasc;
+	    add_dhcp_cname(aliasc, ttd, chain);
 	  }
       }
 }
 
 void cache_add_dhcp_entry(char *host_name, int prot,
-			  struct all_addr *host_address, time_t ttd) 
+			  struct all_addr *host_address, time_t ttd, struct crec **chain) 
 {
   struct crec *crec = NULL, *fail_crec = NULL;
   unsigned short flags = F_IPV4;
@@ -1277,8 +2135,10 @@ void cache_add_dhcp_entry(char *host_name, int prot,
       crec->name.namep = host_name;
       crec->uid = next_uid();
       cache_hash(crec);
+      crec->prev = *chain;
+      *chain = crec;
 
-      add_dhcp_cname(crec, ttd);
+      add_dhcp_cname(crec, ttd, chain);
     }
 }
 #endif
@@ -1324,6 +2184,10 @@ int cache_make_stat(struct txt_record *t)
       break;
 #endif
 
+    case TXT_STAT_PROTECTED:
+      sprintf(buff+1, "%u %u", protected_hits, probation_hits);
+      break;
+
     case TXT_STAT_SERVERS:
       /* sum counts from different records for same server */
       for (serv = daemon->servers; serv; serv = serv->next)
@@ -1403,6 +2267,9 @@ void dump_cache(time_t now)
 	    daemon->cachesize, cache_live_freed, cache_inserted);
   my_syslog(LOG_INFO, _("queries forwarded %u, queries answered locally %u"), 
 	    daemon->queries_forwarded, daemon->local_answer);
+  if (daemon->cache_protect)
+    my_syslog(LOG_INFO, _("%d cache entries protected, cache hits on protected entries %u, on others %u"),
+	      cache_protected, protected_hits, probation_hits);
 #ifdef HAVE_AUTH
   my_syslog(LOG_INFO, _("queries for authoritative zones %u"), daemon->auth_answer);
 #endif
@@ -1418,7 +2285,7 @@ void dump_cache(time_t now)
     if (!(serv->flags & 
 	  (SERV_NO_ADDR | SERV_LITERAL_ADDRESS | SERV_COUNTED | SERV_USE_RESOLV | SERV_NO_REBIND)))
       {
-	int port;
+	int port, srtt = 0, rttvar = 0;
 	unsigned int queries = 0, failed_queries = 0;
 	for (serv1 = serv; serv1; serv1 = serv1->next)
 	  if (!(serv1->flags & 
@@ -1428,9 +2295,15 @@ void dump_cache(time_t now)
 	      serv1->flags |= SERV_COUNTED;
 	      queries += serv1->queries;
 	      failed_queries += serv1->failed_queries;
+	      if (serv1->srtt > srtt)
+		{
+		  srtt = serv1->srtt;
+		  rttvar = serv1->rttvar;
+		}
 	    }
 	port = prettyprint_addr(&serv->addr, daemon->addrbuff);
-	my_syslog(LOG_INFO, _("server %s#%d: queries sent %u, retried or failed %u"), daemon->addrbuff, port, queries, failed_queries);
+	my_syslog(LOG_INFO, _("server %s#%d: queries sent %u, retried or failed %u, round trip %dms +/- %dms"), 
+		  daemon->addrbuff, port, queries, failed_queries, srtt / 1000, rttvar / 1000);
       }
   
   if (option_bool(OPT_DEBUG) || option_bool(OPT_LOG))
@@ -1439,6 +2312,8 @@ void dump_cache(time_t now)
       int i;
       my_syslog(LOG_INFO, "Host                                     Address                        Flags      Expires");
     
+      rehash_move(old_size);
+
       for (i=0; i<hash_size; i++)
 	for (cache = hash_table[i]; cache; cache = cache->hash_next)
 	  {
@@ -1654,7 +2529,7 @@ void log_query(unsigned int flags, char *name, struct all_addr *addr, char *arg)
       verb = daemon->addrbuff;
     }
   else
-    source = "cached";
+    source = serving_stale ? "cached-stale" : "cached";
   
   if (strlen(name) == 0)
     name = ".";
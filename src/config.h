@@ -16,8 +16,15 @@
 
 #define FTABSIZ 150 /* max number of outstanding requests (default) */
 #define MAX_PROCS 20 /* max no children for TCP requests */
+#define DNS_WORKERS_MAX 64 /* max --dns-workers */
+#define WORKER_RETRIES 5 /* give up on a DNS worker which dies this many times in a row */
+#define WORKER_STABLE 60 /* a DNS worker which ran this long before dying starts its count again */
+#define WORKER_SETTLE 2 /* restart stale DNS workers when nothing has changed for 2 seconds */
+#define WORKER_RELOAD 10 /* but no more than every 10 seconds, nor later than 10 seconds after the first change */
 #define CHILD_LIFETIME 150 /* secs 'till terminated (RFC1035 suggests > 120s) */
 #define TCP_MAX_QUERIES 100 /* Maximum number of queries per incoming TCP connection */
+#define UDP_BATCH 32 /* max UDP packets read or written per system call */
+#define CACHE_XFER_SIZE 65536 /* largest batch of cache entries sent from a TCP child to the parent */
 #define EDNS_PKTSZ 4096 /* default max EDNS.0 UDP packet from RFC5625 */
 #define SAFE_PKTSZ 1280 /* "go anywhere" UDP packet size */
 #define KEYBLOCK_LEN 40 /* choose to mininise fragmentation when storing DNSSEC keys */
@@ -25,9 +32,21 @@
 #define TIMEOUT 10 /* drop UDP queries after TIMEOUT seconds */
 #define FORWARD_TEST 50 /* try all servers every 50 queries */
 #define FORWARD_TIME 20 /* or 20 seconds */
+#define SRTT_TIMEOUT 2 /* with --fastest-server, a server not answering in 2 seconds is penalised */
+#define JOIN_TIME 1000 /* clients share a query for the same name during its first 1000ms */
+#define HEDGE_MIN 20 /* with --hedge-queries, wait at least 20ms */
+#define HEDGE_MAX 1000 /* and at most 1 second before asking another server */
 #define RANDOM_SOCKS 64 /* max simultaneous random ports */
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
+#define LEASE_JOURNAL_MAX 1048576 /* default size at which the lease journal is folded into the leasefile */
 #define CACHESIZ 150 /* default cache size */
+#define REHASH_STEP 8 /* hash buckets moved to the new table per cache lookup whilst it grows */
+#define CACHE_PROTECT 80 /* default percentage of the cache kept for names used more than once, --cache-slru */
+#define PREFETCH_HITS 3 /* default cache hits before a name is refreshed ahead of expiry, --prefetch */
+#define PREFETCH_PERCENT 10 /* default part of the TTL left when it is, --prefetch */
+#define STALE_MAX 86400 /* default time expired answers are kept, --serve-stale */
+#define STALE_WAIT 1800 /* default milliseconds to wait for upstream before answering from them */
+#define STALE_TTL 30 /* TTL given to them, from RFC 8767 */
 //#define TTL_FLOOR_LIMIT 3600 /* don't allow --min-cache-ttl to raise TTL above this under any circumstances */
 #define TTL_FLOOR_LIMIT 86400 /* 1 day*/
 #define MAXLEASES 1000 /* maximum number of DHCP leases */
@@ -120,6 +139,16 @@ HAVE_LOOP
 HAVE_INOTIFY
    use the Linux inotify facility to efficiently re-read configuration files.
 
+HAVE_EPOLL
+   use the Linux epoll facility in place of poll(), so that the
+   sockets watched are registered once rather than passed on every
+   turn of the main loop.
+
+HAVE_MMSG
+   use the Linux recvmmsg() and sendmmsg() calls to move several UDP
+   DNS packets per system call. If the running kernel lacks them,
+   dnsmasq falls back to one packet per call.
+
 NO_IPV6
 NO_TFTP
 NO_DHCP
@@ -128,6 +157,8 @@ NO_SCRIPT
 NO_LARGEFILE
 NO_AUTH
 NO_INOTIFY
+NO_EPOLL
+NO_MMSG
    these are avilable to explictly disable compile time options which would 
    otherwise be enabled automatically (HAVE_IPV6, >2Gb file sizes) or 
    which are enabled  by default in the distributed source tree. Building dnsmasq
@@ -364,6 +395,14 @@ HAVE_SOCKADDR_SA_LEN
 #define HAVE_INOTIFY
 #endif
 
+#if defined (HAVE_LINUX_NETWORK) && !defined(NO_EPOLL)
+#define HAVE_EPOLL
+#endif
+
+#if defined (HAVE_LINUX_NETWORK) && !defined(NO_MMSG)
+#define HAVE_MMSG
+#endif
+
 /* Define a string indicating which options are in use.
    DNSMASQP_COMPILE_OPTS is only defined in dnsmasq.c */
 
@@ -295,6 +295,191 @@ static int is_config_in_context(struct dhcp_context *context, struct dhcp_config
   return 0;
 }
 
+/* dhcp-hosts are indexed by client-id, MAC address, name and IPv4
+   address, so that each packet doesn't cost a walk of what may be a
+   very long list. Chains are not in list order, so lookups take the
+   match with the lowest position in the list, which is what the linear
+   search found. Configs with wildcard MAC addresses are just kept on a
+   list. New dhcp-hosts only ever go on the head of the list, so they
+   are indexed as they arrive; anything else calls config_index_reset()
+   or goes through dhcp_update_configs(), which rebuilds the lot. */
+static struct dhcp_config **conf_hash, *conf_hash_one[3], *conf_hash_head, *wild_configs;
+static struct hwaddr_config **hw_hash, *hw_hash_one;
+static unsigned int conf_hash_size, conf_hash_count;
+
+static unsigned int config_hash(const unsigned char *p, int len, unsigned int val)
+{
+  while (len--)
+    val = ((val << 7) | (val >> (32 - 7))) + *p++;
+  
+  return val & (conf_hash_size - 1);
+}
+
+static struct dhcp_config **clid_bucket(const unsigned char *clid, int clid_len)
+{
+  return &conf_hash[config_hash(clid, clid_len, clid_len)];
+}
+
+/* Names compare without case, see hostname_isequal() */
+static struct dhcp_config **name_bucket(const char *name)
+{
+  unsigned int val = 0, c;
+
+  while ((c = (unsigned char)*name++))
+    {
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = ((val << 7) | (val >> (32 - 7))) + c;
+    }
+
+  return &conf_hash[conf_hash_size + (val & (conf_hash_size - 1))];
+}
+
+static struct dhcp_config **addr_bucket(struct in_addr addr)
+{
+  return &conf_hash[2 * conf_hash_size + config_hash((unsigned char *)&addr, INADDRSZ, 0)];
+}
+
+/* hwaddr_type zero matches any type, so the type is not hashed */
+static struct hwaddr_config **hw_bucket(const unsigned char *hwaddr, int hw_len)
+{
+  return &hw_hash[config_hash(hwaddr, hw_len, hw_len)];
+}
+
+static void config_hash_addr(struct dhcp_config *config)
+{
+  struct dhcp_config **up = addr_bucket(config->addr);
+  
+  config->addr_next = *up;
+  *up = config;
+}
+
+static void config_index_one(struct dhcp_config *config)
+{
+  struct dhcp_config **up;
+  struct hwaddr_config *conf_addr, **hup;
+  int wildcard = 0;
+
+  if (config->flags & CONFIG_CLID)
+    {
+      up = clid_bucket(config->clid, config->clid_len);
+      config->clid_next = *up;
+      *up = config;
+    }
+  
+  if (config->flags & CONFIG_NAME)
+    {
+      up = name_bucket(config->hostname);
+      config->name_next = *up;
+      *up = config;
+    }
+  
+  if (config->flags & CONFIG_ADDR)
+    config_hash_addr(config);
+  
+  for (conf_addr = config->hwaddr; conf_addr; conf_addr = conf_addr->next)
+    {
+      conf_addr->config = config;
+      if (conf_addr->wildcard_mask != 0)
+	wildcard = 1;
+      else
+	{
+	  hup = hw_bucket(conf_addr->hwaddr, conf_addr->hwaddr_len);
+	  conf_addr->hash_next = *hup;
+	  *hup = conf_addr;
+	}
+    }
+  
+  if (wildcard)
+    {
+      config->wild_next = wild_configs;
+      wild_configs = config;
+    }
+}
+
+static void config_index(struct dhcp_config *configs)
+{
+  struct dhcp_config *config;
+  unsigned int count, size;
+
+  for (count = 0, config = configs; config; config = config->next)
+    config->order = count++;
+  
+  for (size = 16; size < count && size < (1u << 20); size <<= 1);
+  
+  if (size != conf_hash_size)
+    {
+      if (conf_hash != conf_hash_one)
+	{
+	  free(conf_hash);
+	  free(hw_hash);
+	}
+      
+      conf_hash = whine_malloc(3 * size * sizeof(struct dhcp_config *));
+      hw_hash = whine_malloc(size * sizeof(struct hwaddr_config *));
+      
+      if (!conf_hash || !hw_hash)
+	{
+	  /* A single chain each: slow, but still correct. */
+	  free(conf_hash);
+	  free(hw_hash);
+	  conf_hash = conf_hash_one;
+	  hw_hash = &hw_hash_one;
+	  size = 1;
+	}
+      
+      conf_hash_size = size;
+    }
+  
+  memset(conf_hash, 0, 3 * conf_hash_size * sizeof(struct dhcp_config *));
+  memset(hw_hash, 0, conf_hash_size * sizeof(struct hwaddr_config *));
+  wild_configs = NULL;
+
+  for (config = configs; config; config = config->next)
+    config_index_one(config);
+  
+  conf_hash_head = configs;
+  conf_hash_count = count;
+}
+
+/* Bring the indexes up to date with the list starting at configs. */
+static void config_index_check(struct dhcp_config *configs)
+{
+  struct dhcp_config *config;
+  unsigned int count;
+  int order;
+
+  if (configs == conf_hash_head)
+    return;
+  
+  /* Just new entries at the head? */
+  if (conf_hash_head)
+    for (count = 0, config = configs; config; config = config->next, count++)
+      if (config == conf_hash_head)
+	{
+	  if (conf_hash_count + count > 2 * conf_hash_size)
+	    break;
+	  
+	  for (order = config->order - count, config = configs; config != conf_hash_head; config = config->next)
+	    {
+	      config->order = order++;
+	      config_index_one(config);
+	    }
+	  
+	  conf_hash_head = configs;
+	  conf_hash_count += count;
+	  return;
+	}
+  
+  config_index(configs);
+}
+
+/* Called before dhcp-hosts are changed or freed. */
+void config_index_reset(void)
+{
+  conf_hash_head = NULL;
+}
+
 struct dhcp_config *find_config(struct dhcp_config *configs,
 				struct dhcp_context *context,
 				unsigned char *clid, int clid_len,
@@ -305,50 +490,73 @@ struct dhcp_config *find_config(struct dhcp_config *configs,
   struct dhcp_config *config, *candidate; 
   struct hwaddr_config *conf_addr;
 
+  if (!configs)
+    return NULL;
+
+  config_index_check(configs);
+
   if (clid)
-    for (config = configs; config; config = config->next)
-      if (config->flags & CONFIG_CLID)
-	{
-	  if (config->clid_len == clid_len && 
-	      memcmp(config->clid, clid, clid_len) == 0 &&
-	      is_config_in_context(context, config))
-	    return config;
-	  
-	  /* dhcpcd prefixes ASCII client IDs by zero which is wrong, but we try and
-	     cope with that here. This is IPv4 only. context==NULL implies IPv4, 
-	     see lease_update_from_configs() */
-	  if ((!context || !(context->flags & CONTEXT_V6)) && *clid == 0 && config->clid_len == clid_len-1  &&
+    {
+      for (candidate = NULL, config = *clid_bucket(clid, clid_len); config; config = config->clid_next)
+	if (config->clid_len == clid_len && 
+	    memcmp(config->clid, clid, clid_len) == 0 &&
+	    (!candidate || config->order < candidate->order) &&
+	    is_config_in_context(context, config))
+	  candidate = config;
+      
+      /* dhcpcd prefixes ASCII client IDs by zero which is wrong, but we try and
+	 cope with that here. This is IPv4 only. context==NULL implies IPv4, 
+	 see lease_update_from_configs() */
+      if ((!context || !(context->flags & CONTEXT_V6)) && clid_len != 0 && *clid == 0)
+	for (config = *clid_bucket(clid+1, clid_len-1); config; config = config->clid_next)
+	  if (config->clid_len == clid_len-1  &&
 	      memcmp(config->clid, clid+1, clid_len-1) == 0 &&
+	      (!candidate || config->order < candidate->order) &&
 	      is_config_in_context(context, config))
-	    return config;
-	}
-  
+	    candidate = config;
+      
+      if (candidate)
+	return candidate;
+    }
 
   if (hwaddr)
-    for (config = configs; config; config = config->next)
-      if (config_has_mac(config, hwaddr, hw_len, hw_type) &&
-	  is_config_in_context(context, config))
-	return config;
+    {
+      for (candidate = NULL, conf_addr = *hw_bucket(hwaddr, hw_len); conf_addr; conf_addr = conf_addr->hash_next)
+	if (conf_addr->hwaddr_len == hw_len &&
+	    (conf_addr->hwaddr_type == hw_type || conf_addr->hwaddr_type == 0) &&
+	    memcmp(conf_addr->hwaddr, hwaddr, hw_len) == 0 &&
+	    (!candidate || conf_addr->config->order < candidate->order) &&
+	    is_config_in_context(context, conf_addr->config))
+	  candidate = conf_addr->config;
+      
+      if (candidate)
+	return candidate;
+    }
   
   if (hostname && context)
-    for (config = configs; config; config = config->next)
-      if ((config->flags & CONFIG_NAME) && 
-	  hostname_isequal(config->hostname, hostname) &&
-	  is_config_in_context(context, config))
-	return config;
-
+    {
+      for (candidate = NULL, config = *name_bucket(hostname); config; config = config->name_next)
+	if (hostname_isequal(config->hostname, hostname) &&
+	    (!candidate || config->order < candidate->order) &&
+	    is_config_in_context(context, config))
+	  candidate = config;
+      
+      if (candidate)
+	return candidate;
+    }
   
   if (!hwaddr)
     return NULL;
 
   /* use match with fewest wildcard octets */
-  for (candidate = NULL, count = 0, config = configs; config; config = config->next)
+  for (candidate = NULL, count = 0, config = wild_configs; config; config = config->wild_next)
     if (is_config_in_context(context, config))
       for (conf_addr = config->hwaddr; conf_addr; conf_addr = conf_addr->next)
 	if (conf_addr->wildcard_mask != 0 &&
 	    conf_addr->hwaddr_len == hw_len &&	
 	    (conf_addr->hwaddr_type == hw_type || conf_addr->hwaddr_type == 0) &&
-	    (new = memcmp_masked(conf_addr->hwaddr, hwaddr, hw_len, conf_addr->wildcard_mask)) > count)
+	    ((new = memcmp_masked(conf_addr->hwaddr, hwaddr, hw_len, conf_addr->wildcard_mask)) > count ||
+	     (new == count && candidate && config->order < candidate->order)))
 	  {
 	      count = new;
 	      candidate = config;
@@ -357,6 +565,23 @@ struct dhcp_config *find_config(struct dhcp_config *configs,
   return candidate;
 }
 
+struct dhcp_config *config_find_by_address(struct dhcp_config *configs, struct in_addr addr)
+{
+  struct dhcp_config *config, *candidate = NULL;
+  
+  if (!configs)
+    return NULL;
+
+  config_index_check(configs);
+
+  for (config = *addr_bucket(addr); config; config = config->addr_next)
+    if ((config->flags & CONFIG_ADDR) && config->addr.s_addr == addr.s_addr &&
+	(!candidate || config->order < candidate->order))
+      candidate = config;
+
+  return candidate;
+}
+
 void dhcp_update_configs(struct dhcp_config *configs)
 {
   /* Some people like to keep all static IP addresses in /etc/hosts.
@@ -370,10 +595,16 @@ void dhcp_update_configs(struct dhcp_config *configs)
   struct crec *crec;
   int prot = AF_INET;
 
+  /* Addresses reserved by dhcp-host may have changed. */
+  context_inuse_reset();
+
   for (config = configs; config; config = config->next)
     if (config->flags & CONFIG_ADDR_HOSTS)
       config->flags &= ~(CONFIG_ADDR | CONFIG_ADDR6 | CONFIG_ADDR_HOSTS);
 
+  /* dhcp-hosts may have been added or removed. */
+  config_index(configs);
+
 #ifdef HAVE_DHCP6 
  again:  
 #endif
@@ -413,6 +644,7 @@ void dhcp_update_configs(struct dhcp_config *configs)
 	      {
 		config->addr = crec->addr.addr.addr.addr4;
 		config->flags |= CONFIG_ADDR | CONFIG_ADDR_HOSTS;
+		config_hash_addr(config);
 		continue;
 	      }
 
@@ -624,15 +624,181 @@ struct dhcp_context *narrow_context(struct dhcp_context *context,
   return tmp;
 }
 
-struct dhcp_config *config_find_by_address(struct dhcp_config *configs, struct in_addr addr)
+/* Each DHCPv4 range keeps a bitmap of the addresses in it known to be
+   taken by a lease or dhcp-host, or unusable, so that address_allocate()
+   can skip over them a word at a time. A clear bit is only a hint: the
+   address is checked in full before it's used. The maps are rebuilt
+   when dhcp-hosts change. */
+#define INUSE_BITS (8 * sizeof(unsigned long))
+#define INUSE_MAX (1u << 24) /* larger ranges are searched without a map */
+
+static int inuse_gen = 1;
+
+void context_inuse_reset(void)
+{
+  inuse_gen++;
+}
+
+void context_set_inuse(struct dhcp_context *c, struct in_addr addr, int inuse)
 {
+  unsigned int off = ntohl(addr.s_addr) - ntohl(c->start.s_addr);
+  
+  if (!c->inuse || c->inuse_gen != inuse_gen ||
+      ntohl(addr.s_addr) < ntohl(c->start.s_addr) || 
+      ntohl(addr.s_addr) > ntohl(c->end.s_addr))
+    return;
+  
+  if (inuse)
+    c->inuse[off / INUSE_BITS] |= 1UL << (off % INUSE_BITS);
+  else
+    c->inuse[off / INUSE_BITS] &= ~(1UL << (off % INUSE_BITS));
+}
+
+/* Called by lease.c as leases come and go. */
+void mark_inuse(struct in_addr addr, int inuse)
+{
+  struct dhcp_context *c;
+
+  for (c = daemon->dhcp; c; c = c->next)
+    context_set_inuse(c, addr, inuse);
+}
+
+/* Make sure the bitmap for c is current, returns zero if there isn't one. */
+static int context_map(struct dhcp_context *c)
+{
+  unsigned int i, size = 1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr);
+  size_t words = (size + INUSE_BITS - 1) / INUSE_BITS;
   struct dhcp_config *config;
+
+  if (c->inuse && c->inuse_gen == inuse_gen)
+    return 1;
   
-  for (config = configs; config; config = config->next)
-    if ((config->flags & CONFIG_ADDR) && config->addr.s_addr == addr.s_addr)
-      return config;
+  if (size > INUSE_MAX || 
+      (!c->inuse && !(c->inuse = whine_malloc(words * sizeof(unsigned long)))))
+    return 0;
+  
+  memset(c->inuse, 0, words * sizeof(unsigned long));
+  c->inuse_gen = inuse_gen;
 
-  return NULL;
+  /* See below for .0 and .255 */
+  for (i = 0; i < size; i++)
+    {
+      in_addr_t a = ntohl(c->start.s_addr) + i;
+      
+      if (IN_CLASSC(a) && ((a & 0xff) == 0xff || (a & 0xff) == 0))
+	c->inuse[i / INUSE_BITS] |= 1UL << (i % INUSE_BITS);
+    }
+  
+  for (config = daemon->dhcp_conf; config; config = config->next)
+    if (config->flags & CONFIG_ADDR)
+      context_set_inuse(c, config->addr, 1);
+
+  lease_mark_context(c);
+
+  return 1;
+}
+
+/* Offset of the first clear bit in [from, to), or to if there isn't one. */
+static unsigned int inuse_next_free(unsigned long *map, unsigned int from, unsigned int to)
+{
+  while (from < to)
+    {
+      unsigned int shift = from % INUSE_BITS;
+      unsigned long w = map[from / INUSE_BITS] >> shift;
+
+      if (w == (~0UL >> shift))
+	{
+	  from += INUSE_BITS - shift;
+	  continue;
+	}
+      
+      for (; w & 1; w >>= 1)
+	from++;
+      break;
+    }
+  
+  return from < to ? from : to;
+}
+
+/* Returns 1 if addr can be allocated, 0 if not, -1 if not because 
+   it's taken by a lease or dhcp-host. */
+static int address_usable(struct dhcp_context *context, struct dhcp_context *c,
+			  struct in_addr addr, unsigned int j, time_t now)
+{
+  struct dhcp_context *d;
+  struct ping_result *r, *victim = NULL;
+  int count, max = (int)(0.6 * (((float)PING_CACHE_TIME)/
+				((float)PING_WAIT)));
+
+  /* eliminate addresses in use by the server. */
+  for (d = context; d; d = d->current)
+    if (addr.s_addr == d->router.s_addr)
+      return 0;
+
+  if (lease_find_by_addr(addr) || config_find_by_address(daemon->dhcp_conf, addr))
+    return -1;
+  
+  /* Addresses which end in .255 and .0 are broken in Windows even when using 
+     supernetting. ie dhcp-range=192.168.0.1,192.168.1.254,255,255,254.0
+     then 192.168.0.255 is a valid IP address, but not for Windows as it's
+     in the class C range. See  KB281579. We therefore don't allocate these 
+     addresses to avoid hard-to-diagnose problems. Thanks Bill. */	    
+  if (IN_CLASSC(ntohl(addr.s_addr)) && 
+      ((ntohl(addr.s_addr) & 0xff) == 0xff || ((ntohl(addr.s_addr) & 0xff) == 0x0)))
+    return -1;
+  
+  /* check if we failed to ping addr sometime in the last
+     PING_CACHE_TIME seconds. If so, assume the same situation still exists.
+     This avoids problems when a stupid client bangs
+     on us repeatedly. As a final check, if we did more
+     than 60% of the possible ping checks in the last 
+     PING_CACHE_TIME, we are in high-load mode, so don't do any more. */
+  for (count = 0, r = daemon->ping_results; r; r = r->next)
+    if (difftime(now, r->time) >  (float)PING_CACHE_TIME)
+      victim = r; /* old record */
+    else 
+      {
+	count++;
+	if (r->addr.s_addr == addr.s_addr)
+	  {
+	    /* consec-ip mode: we offered this address for another client
+	       (different hash) recently, don't offer it to this one. */
+	    if (option_bool(OPT_CONSEC_ADDR) && r->hash != j)
+	      return 0;
+	    
+	    return 1;
+	  }
+      }
+  
+  if ((count < max) && !option_bool(OPT_NO_PING) && icmp_ping(addr))
+    {
+      /* address in use: perturb address selection so that we are
+	 less likely to try this address again. */
+      if (!option_bool(OPT_CONSEC_ADDR))
+	c->addr_epoch++;
+      return 0;
+    }
+  
+  /* at this point victim may hold an expired record */
+  if (!victim)
+    {
+      if ((victim = whine_malloc(sizeof(struct ping_result))))
+	{
+	  victim->next = daemon->ping_results;
+	  daemon->ping_results = victim;
+	}
+    }
+  
+  /* record that this address is OK for 30s 
+     without more ping checks */
+  if (victim)
+    {
+      victim->addr = addr;
+      victim->time = now;
+      victim->hash = j;
+    }
+  
+  return 1;
 }
 
 int address_allocate(struct dhcp_context *context,
@@ -644,9 +810,9 @@ int address_allocate(struct dhcp_context *context,
      Try to return from contexts which match netids first. */
 
   struct in_addr start, addr;
-  struct dhcp_context *c, *d;
-  int i, pass;
-  unsigned int j; 
+  struct dhcp_context *c;
+  int i, pass, res;
+  unsigned int j, size, seed, off; 
 
   /* hash hwaddr: use the SDBM hashing algorithm.  Seems to give good
      dispersal even with similarly-valued "strings". */ 
@@ -661,103 +827,59 @@ int address_allocate(struct dhcp_context *context,
 	continue;
       else
 	{
+	  size = 1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr);
+
 	  if (option_bool(OPT_CONSEC_ADDR))
 	    /* seed is largest extant lease addr in this context */
 	    start = lease_find_max_addr(c);
 	  else
 	    /* pick a seed based on hwaddr */
-	    start.s_addr = htonl(ntohl(c->start.s_addr) + 
-				 ((j + c->addr_epoch) % (1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr))));
+	    start.s_addr = htonl(ntohl(c->start.s_addr) + ((j + c->addr_epoch) % size));
 
-	  /* iterate until we find a free address. */
-	  addr = start;
-	  
-	  do {
-	    /* eliminate addresses in use by the server. */
-	    for (d = context; d; d = d->current)
-	      if (addr.s_addr == d->router.s_addr)
-		break;
+	  if ((seed = ntohl(start.s_addr) - ntohl(c->start.s_addr)) >= size)
+	    seed = 0;
 
-	    /* Addresses which end in .255 and .0 are broken in Windows even when using 
-	       supernetting. ie dhcp-range=192.168.0.1,192.168.1.254,255,255,254.0
-	       then 192.168.0.255 is a valid IP address, but not for Windows as it's
-	       in the class C range. See  KB281579. We therefore don't allocate these 
-	       addresses to avoid hard-to-diagnose problems. Thanks Bill. */	    
-	    if (!d &&
-		!lease_find_by_addr(addr) && 
-		!config_find_by_address(daemon->dhcp_conf, addr) &&
-		(!IN_CLASSC(ntohl(addr.s_addr)) || 
-		 ((ntohl(addr.s_addr) & 0xff) != 0xff && ((ntohl(addr.s_addr) & 0xff) != 0x0))))
-	      {
-		struct ping_result *r, *victim = NULL;
-		int count, max = (int)(0.6 * (((float)PING_CACHE_TIME)/
-					      ((float)PING_WAIT)));
-		
-		*addrp = addr;
-
-		/* check if we failed to ping addr sometime in the last
-		   PING_CACHE_TIME seconds. If so, assume the same situation still exists.
-		   This avoids problems when a stupid client bangs
-		   on us repeatedly. As a final check, if we did more
-		   than 60% of the possible ping checks in the last 
-		   PING_CACHE_TIME, we are in high-load mode, so don't do any more. */
-		for (count = 0, r = daemon->ping_results; r; r = r->next)
-		  if (difftime(now, r->time) >  (float)PING_CACHE_TIME)
-		    victim = r; /* old record */
-		  else 
+	  /* iterate until we find a free address, from the seed to the end
+	     of the range, then from the start to the seed. */
+	  if (context_map(c))
+	    {
+	      for (i = 0; i < 2; i++)
+		{
+		  unsigned int to = i ? seed : size;
+		  
+		  for (off = i ? 0 : seed; (off = inuse_next_free(c->inuse, off, to)) < to; off++)
 		    {
-		      count++;
-		      if (r->addr.s_addr == addr.s_addr)
+		      addr.s_addr = htonl(ntohl(c->start.s_addr) + off);
+		      
+		      if ((res = address_usable(context, c, addr, j, now)) == 1)
 			{
-			  /* consec-ip mode: we offered this address for another client
-			     (different hash) recently, don't offer it to this one. */
-			  if (option_bool(OPT_CONSEC_ADDR) && r->hash != j)
-			    break;
-			  
+			  *addrp = addr;
 			  return 1;
 			}
+		      
+		      if (res == -1)
+			context_set_inuse(c, addr, 1);
 		    }
-
-		if (!r) 
+		}
+	    }
+	  else
+	    {
+	      addr = start;
+	      
+	      do {
+		if (address_usable(context, c, addr, j, now) == 1)
 		  {
-		    if ((count < max) && !option_bool(OPT_NO_PING) && icmp_ping(addr))
-		      {
-			/* address in use: perturb address selection so that we are
-			   less likely to try this address again. */
-			if (!option_bool(OPT_CONSEC_ADDR))
-			  c->addr_epoch++;
-		      }
-		    else
-		      {
-			/* at this point victim may hold an expired record */
-			if (!victim)
-			  {
-			    if ((victim = whine_malloc(sizeof(struct ping_result))))
-			      {
-				victim->next = daemon->ping_results;
-				daemon->ping_results = victim;
-			      }
-			  }
-			
-			/* record that this address is OK for 30s 
-			   without more ping checks */
-			if (victim)
-			  {
-			    victim->addr = addr;
-			    victim->time = now;
-			    victim->hash = j;
-			  }
-			return 1;
-		      }
+		    *addrp = addr;
+		    return 1;
 		  }
-	      }
-
-	    addr.s_addr = htonl(ntohl(addr.s_addr) + 1);
-	    
-	    if (addr.s_addr == htonl(ntohl(c->end.s_addr) + 1))
-	      addr = c->start;
-	    
-	  } while (addr.s_addr != start.s_addr);
+		
+		addr.s_addr = htonl(ntohl(addr.s_addr) + 1);
+		
+		if (addr.s_addr == htonl(ntohl(c->end.s_addr) + 1))
+		  addr = c->start;
+		
+	      } while (addr.s_addr != start.s_addr);
+	    }
 	}
 
   return 0;
@@ -784,6 +906,7 @@ void dhcp_read_ethers(void)
     }
 
   /* This can be called again on SIGHUP, so remove entries created last time round. */
+  config_index_reset();
   for (up = &daemon->dhcp_conf, config = daemon->dhcp_conf; config; config = tmp)
     {
       tmp = config->next;
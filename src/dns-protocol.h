@@ -22,6 +22,7 @@
 
 #define PACKETSZ	512		/* maximum packet size */
 #define MAXDNAME	1025		/* maximum presentation domain name */
+#define MAXCDNAME	255		/* maximum wire-format domain name */
 #define RRFIXEDSZ	10		/* #/bytes of fixed data in r record */
 #define MAXLABEL        63              /* maximum length of domain label */
 
@@ -23,6 +23,11 @@ struct daemon *daemon;
 
 static volatile pid_t pid = 0;
 static volatile int pipewrite;
+static int cachewrite;
+#ifndef NO_FORK
+static time_t workers_stale = 0, workers_changed = 0, workers_started = 0;
+static int workers_force = 0;
+#endif
 
 static int set_dns_listeners(time_t now);
 static void check_dns_listeners(time_t now);
@@ -31,6 +36,10 @@ static void async_event(int pipe, time_t now);
 static void fatal_event(struct event_desc *ev, char *msg);
 static int read_event(int fd, struct event_desc *evp, char **msg);
 static void poll_resolv(int force, int do_reload, time_t now);
+#ifndef NO_FORK
+static int start_dns_workers(time_t now);
+static void dns_worker(int index, int fd, time_t now);
+#endif
 
 int main (int argc, char **argv)
 {
@@ -189,6 +198,13 @@ int main (int argc, char **argv)
     die(_("conntrack support not available: set HAVE_CONNTRACK in src/config.h"), NULL, EC_BADCONF);
 #endif
 
+  /* Workers each need their own upstream sockets, so can't share a fixed port. */
+  if (daemon->dns_workers != 0 && (daemon->query_port != 0 || daemon->osport))
+    die(_("cannot use --dns-workers AND --query-port"), NULL, EC_BADCONF);
+  
+  if (daemon->port == 0)
+    daemon->dns_workers = 0;
+
 #ifdef HAVE_SOLARIS_NETWORK
   if (daemon->max_logs != 0)
     die(_("asychronous logging is not available under Solaris"), NULL, EC_BADCONF);
@@ -429,6 +445,35 @@ int main (int argc, char **argv)
   /* prime the pipe to load stuff first time. */
   send_event(pipewrite, EVENT_INIT, 0, NULL); 
 
+  /* TCP children return the answers they cache over this, 
+     so that they're not lost when the child exits. */
+  daemon->cachefd = daemon->cache_parentfd = cachewrite = -1;
+#ifndef NO_FORK
+  if (daemon->port != 0 && !option_bool(OPT_DEBUG))
+    {
+      int cachepair[2];
+      
+      if (socketpair(AF_UNIX, SOCK_DGRAM, 0, cachepair) == -1 ||
+	  !fix_fd(cachepair[0]) || !fix_fd(cachepair[1]))
+	die(_("cannot create cache socket: %s"), NULL, EC_MISC);
+      
+      daemon->cachefd = cachepair[0];
+      cachewrite = cachepair[1];
+    }
+
+  if (daemon->dns_workers != 0)
+    {
+      daemon->workers = safe_malloc(daemon->dns_workers * sizeof(struct dns_worker));
+      for (i = 0; i < daemon->dns_workers; i++)
+	{
+	  daemon->workers[i].pid = 0;
+	  daemon->workers[i].fd = -1;
+	  daemon->workers[i].fails = daemon->workers[i].resync = 0;
+	  daemon->workers[i].restart = 0;
+	}
+    }
+#endif
+
   err_pipe[1] = -1;
   
   if (!option_bool(OPT_DEBUG))   
@@ -760,6 +805,12 @@ int main (int argc, char **argv)
 	my_syslog(LOG_WARNING, _("warning: no upstream servers configured"));
     } 
 
+  if (option_bool(OPT_TCP_NOFORK) && option_bool(OPT_DNSSEC_VALID))
+    {
+      my_syslog(LOG_WARNING, _("warning: no-tcp-fork is not supported with DNSSEC validation"));
+      reset_option_bool(OPT_TCP_NOFORK);
+    }
+
   if (daemon->max_logs != 0)
     my_syslog(LOG_INFO, _("asynchronous logging enabled, queue limit is %d messages"), daemon->max_logs);
   
@@ -860,12 +911,18 @@ int main (int argc, char **argv)
     {
       int t, timeout = -1;
       
+#ifndef NO_FORK
+      /* Wake to restart a DNS worker which died. */
+      if (daemon->workers && start_dns_workers(now))
+	timeout = 1000;
+#endif
+
       poll_reset();
       
       /* if we are out of resources, find how long we have to wait
 	 for some to come free, we'll loop around then and restart
 	 listening for queries */
-      if ((t = set_dns_listeners(now)) != 0)
+      if ((t = set_dns_listeners(now)) != 0 && (timeout == -1 || t * 1000 < timeout))
 	timeout = t * 1000;
 
       /* Whilst polling for the dbus, or doing a tftp transfer, wake every quarter second */
@@ -873,10 +930,19 @@ int main (int argc, char **argv)
 	  (option_bool(OPT_DBUS) && !daemon->dbus))
 	timeout = 250;
 
-      /* Wake every second whilst waiting for DAD to complete */
-      else if (is_dad_listeners())
+      /* Wake every second whilst waiting for DAD to complete,
+	 or to time out TCP connections */
+      else if (is_dad_listeners() || daemon->tcp_conns)
 	timeout = 1000;
 
+      /* Wake when a query is due to go to another server */
+      if ((t = hedge_timeout()) != -1 && (timeout == -1 || t < timeout))
+	timeout = t;
+
+      /* or a client is due an answer from expired data */
+      if ((t = stale_timeout()) != -1 && (timeout == -1 || t < timeout))
+	timeout = t;
+
 #ifdef HAVE_DBUS
       set_dbus_listeners();
 #endif	
@@ -911,6 +977,14 @@ int main (int argc, char **argv)
       
       poll_listen(piperead, POLLIN);
 
+      if (daemon->cachefd != -1)
+	poll_listen(daemon->cachefd, POLLIN);
+
+      if (daemon->workers)
+	for (i = 0; i < daemon->dns_workers; i++)
+	  if (daemon->workers[i].fd != -1)
+	    poll_listen(daemon->workers[i].fd, POLLIN);
+
 #ifdef HAVE_DHCP
 #  ifdef HAVE_SCRIPT
       while (helper_buf_empty() && do_script_run(now));
@@ -987,6 +1061,14 @@ int main (int argc, char **argv)
 
       if (poll_check(piperead, POLLIN))
 	async_event(piperead, now);
+
+      if (daemon->cachefd != -1 && poll_check(daemon->cachefd, POLLIN))
+	cache_recv_inserts(daemon->cachefd, now);
+
+      if (daemon->workers)
+	for (i = 0; i < daemon->dns_workers; i++)
+	  if (daemon->workers[i].fd != -1 && poll_check(daemon->workers[i].fd, POLLIN))
+	    cache_recv_inserts(daemon->workers[i].fd, now);
       
 #ifdef HAVE_DBUS
       /* if we didn't create a DBus connection, retry now. */ 
@@ -1002,6 +1084,8 @@ int main (int argc, char **argv)
 #endif
       
       check_dns_listeners(now);
+      hedge_queries();
+      stale_queries(now);
 
 #ifdef HAVE_TFTP
       check_tftp_listeners(now);
@@ -1181,7 +1265,7 @@ static void async_event(int pipe, time_t now)
 {
   pid_t p;
   struct event_desc ev;
-  int i, check = 0;
+  int i, status, check = 0;
   char *msg;
   
   /* NOTE: the memory used to return msg is leaked: use msgs in events only
@@ -1248,16 +1332,49 @@ static void async_event(int pipe, time_t now)
 		
       case EVENT_CHILD:
 	/* See Stevens 5.10 */
-	while ((p = waitpid(-1, NULL, WNOHANG)) != 0)
+	while ((p = waitpid(-1, &status, WNOHANG)) != 0)
 	  if (p == -1)
 	    {
 	      if (errno != EINTR)
 		break;
 	    }      
 	  else 
-	    for (i = 0 ; i < MAX_PROCS; i++)
-	      if (daemon->tcp_pids[i] == p)
-		daemon->tcp_pids[i] = 0;
+	    {
+	      for (i = 0 ; i < MAX_PROCS; i++)
+		if (daemon->tcp_pids[i] == p)
+		  daemon->tcp_pids[i] = 0;
+#ifndef NO_FORK
+	      if (daemon->workers)
+		for (i = 0; i < daemon->dns_workers; i++)
+		  if (daemon->workers[i].pid == p)
+		    {
+		      struct dns_worker *w = &daemon->workers[i];
+		      
+		      poll_remove(w->fd);
+		      close(w->fd);
+		      w->fd = -1;
+		      
+		      if (difftime(now, w->started) >= WORKER_STABLE)
+			w->fails = 0;
+		      
+		      /* Restart a worker which dies, waiting twice as long each
+			 time. One which keeps dying is given up on, and its
+			 sockets closed so that the others get its queries. */
+		      if (++w->fails >= WORKER_RETRIES)
+			{
+			  my_syslog(LOG_ERR, _("DNS worker %d died %d times, giving up on it"), i, w->fails);
+			  w->pid = -1;
+			  close_worker_socks(i);
+			}
+		      else
+			{
+			  my_syslog(LOG_WARNING, _("DNS worker %d died"), i);
+			  w->pid = 0;
+			  w->restart = now + (1 << (w->fails - 1));
+			}
+		    }
+#endif
+	    }
 	break;
 	
       case EVENT_KILLED:
@@ -1314,6 +1431,7 @@ static void async_event(int pipe, time_t now)
 	    do {
 	      helper_write();
 	    } while (!helper_buf_empty() || do_script_run(now));
+	    poll_remove(daemon->helperfd);
 	    while (retry_send(close(daemon->helperfd)));
 	  }
 #endif
@@ -1414,7 +1532,10 @@ void clear_cache_and_reload(time_t now)
   (void)now;
 
   if (daemon->port != 0)
-    cache_reload();
+    {
+      cache_reload();
+      reload_dns_workers(1);
+    }
   
 #ifdef HAVE_DHCP
   if (daemon->dhcp || daemon->doing_dhcp6)
@@ -1439,6 +1560,259 @@ void clear_cache_and_reload(time_t now)
 #endif
 }
 
+/* Called when something a DNS worker copied from us at fork() changes,
+   beyond what we send it over the cache socket. If force is set, when
+   the whole cache is reloaded, restart them without waiting. */
+void reload_dns_workers(int force)
+{
+#ifndef NO_FORK
+  workers_changed = dnsmasq_time();
+  if (!workers_stale)
+    workers_stale = workers_changed;
+  if (force)
+    workers_force = 1;
+#else
+  (void)force;
+#endif
+}
+
+#ifndef NO_FORK
+/* Start any DNS workers not running, after stopping them all if they
+   are stale. Changes tend to come in bursts, so wait for things to settle
+   first, and don't restart them too often. Returns non-zero if one has
+   to wait before restarting. */
+static int start_dns_workers(time_t now)
+{
+  int i, pair[2], waiting = 0, running = 0;
+  sigset_t mask;
+  pid_t p;
+  
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (daemon->workers[i].pid > 0)
+      running = 1;
+  
+  if (workers_stale && running && !workers_force &&
+      (difftime(now, workers_started) < WORKER_RELOAD ||
+       (difftime(now, workers_changed) < WORKER_SETTLE && difftime(now, workers_stale) < WORKER_RELOAD)))
+    waiting = 1;
+  else if (workers_stale)
+    {
+      workers_stale = 0;
+      workers_force = 0;
+      for (i = 0; i < daemon->dns_workers; i++)
+	{
+	  if (daemon->workers[i].pid == -1)
+	    continue;
+	  
+	  if (daemon->workers[i].pid > 0)
+	    {
+	      kill(daemon->workers[i].pid, SIGTERM);
+	      poll_remove(daemon->workers[i].fd);
+	      close(daemon->workers[i].fd);
+	      daemon->workers[i].fd = -1;
+	    }
+	  daemon->workers[i].pid = 0;
+	  daemon->workers[i].restart = 0;
+	}
+    }
+
+  /* One which missed some DHCP names starts again from a fresh copy,
+     without waiting: the others carry on as they are. */
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (daemon->workers[i].resync)
+      {
+	daemon->workers[i].resync = 0;
+	if (daemon->workers[i].pid > 0)
+	  {
+	    kill(daemon->workers[i].pid, SIGTERM);
+	    poll_remove(daemon->workers[i].fd);
+	    close(daemon->workers[i].fd);
+	    daemon->workers[i].fd = -1;
+	    daemon->workers[i].pid = 0;
+	  }
+      }
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (daemon->workers[i].pid == 0)
+      {
+	/* Don't spin if a worker keeps crashing. */
+	if (difftime(daemon->workers[i].restart, now) > 0)
+	  {
+	    waiting = 1;
+	    continue;
+	  }
+	
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair) == -1)
+	  {
+	    waiting = 1;
+	    continue;
+	  }
+	
+	if (!fix_fd(pair[0]) || !fix_fd(pair[1]))
+	  {
+	    close(pair[0]);
+	    close(pair[1]);
+	    waiting = 1;
+	    continue;
+	  }
+
+	/* Make sure the worker's copy of the interfaces is fresh:
+	   it never enumerates them itself. */
+	enumerate_interfaces(0);
+	
+	/* Hold off SIGTERM until the worker can act on it, our handler ignores it. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	
+	if ((p = fork()) == 0)
+	  {
+	    signal(SIGTERM, SIG_DFL);
+	    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	    close(pair[0]);
+	    dns_worker(i, pair[1], now);
+	  }
+
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	
+	if (p == -1)
+	  {
+	    close(pair[0]);
+	    close(pair[1]);
+	    waiting = 1;
+	    continue;
+	  }
+	
+	close(pair[1]);
+	daemon->workers[i].pid = p;
+	daemon->workers[i].fd = pair[0];
+	daemon->workers[i].started = workers_started = now;
+      }
+
+  return waiting;
+}
+
+/* The main loop of a DNS worker: UDP queries only, on the listener
+   sockets made for this worker. Never returns. */
+static void dns_worker(int index, int fd, time_t now)
+{
+  struct listener *l;
+  struct tcp_conn *conn;
+  int i;
+
+#ifdef HAVE_LINUX_NETWORK
+  prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0);
+#endif
+
+  /* Keep only our own sockets: the main process's and the other workers'
+     copies would hold the ports, and the other workers' keep their share
+     of queries, after they've gone. */
+  for (l = daemon->listeners; l; l = l->next)
+    {
+      if (l->fd != -1)
+	close(l->fd);
+      if (l->tcpfd != -1)
+	close(l->tcpfd);
+      if (l->tftpfd != -1)
+	close(l->tftpfd);
+      l->fd = l->tcpfd = l->tftpfd = -1;
+      
+      if (l->workerfds)
+	{
+	  for (i = 0; i < daemon->dns_workers; i++)
+	    if (i == index)
+	      l->fd = l->workerfds[i];
+	    else if (l->workerfds[i] != -1)
+	      close(l->workerfds[i]);
+	  free(l->workerfds);
+	  l->workerfds = NULL;
+	}
+    }
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (daemon->workers[i].fd != -1)
+      close(daemon->workers[i].fd);
+
+  /* Don't keep the main process's TCP connections open. */
+  for (conn = daemon->tcp_conns; conn; conn = conn->next)
+    {
+      close(conn->fd);
+      if (conn->upfd != -1)
+	close(conn->upfd);
+    }
+
+  daemon->tcp_conns = NULL;
+  daemon->tcp_conn_count = 0;
+#ifdef HAVE_TFTP
+  daemon->tftp_trans = NULL;
+#endif
+  for (i = 0; i < MAX_PROCS; i++)
+    daemon->tcp_pids[i] = 0;
+
+  daemon->workers = NULL;
+  daemon->cachefd = -1;
+  daemon->cache_parentfd = fd;
+#ifdef HAVE_DHCP
+  lease_keep_dns();
+#endif
+
+  forward_reset();
+#ifdef HAVE_LINUX_NETWORK
+  netlink_worker_init();
+#endif
+  if (!renew_sfds())
+    {
+      my_syslog(LOG_ERR, _("DNS worker %d cannot create upstream socket: %s"), index, strerror(errno));
+      flush_log();
+      _exit(EC_BADNET);
+    }
+
+  while (1)
+    {
+      int t, timeout = -1;
+
+      poll_reset();
+
+      if ((t = set_dns_listeners(now)) != 0)
+	timeout = t * 1000;
+
+      if ((t = hedge_timeout()) != -1 && (timeout == -1 || t < timeout))
+	timeout = t;
+
+      /* or a client is due an answer from expired data */
+      if ((t = stale_timeout()) != -1 && (timeout == -1 || t < timeout))
+	timeout = t;
+
+      poll_listen(fd, POLLIN);
+#ifdef HAVE_LINUX_NETWORK
+      if (daemon->netlinkfd != -1)
+	poll_listen(daemon->netlinkfd, POLLIN);
+#endif
+
+      set_log_writer();
+
+      if (do_poll(timeout) < 0)
+	continue;
+
+      now = dnsmasq_time();
+
+      check_log_writer(0);
+
+#ifdef HAVE_LINUX_NETWORK
+      if (daemon->netlinkfd != -1 && poll_check(daemon->netlinkfd, POLLIN))
+	netlink_multicast();
+#endif
+
+      if (poll_check(fd, POLLIN))
+	cache_recv_inserts(fd, now);
+
+      check_dns_listeners(now);
+      hedge_queries();
+      stale_queries(now);
+    }
+}
+#endif
+
 static int set_dns_listeners(time_t now)
 {
   struct serverfd *serverfdp;
@@ -1475,7 +1849,12 @@ static int set_dns_listeners(time_t now)
 	
       /* death of a child goes through the select loop, so
 	 we don't need to explicitly arrange to wake up here */
-      if  (listener->tcpfd != -1)
+      if (listener->tcpfd != -1 && option_bool(OPT_TCP_NOFORK))
+	{
+	  if (daemon->tcp_conn_count < daemon->ftabsize)
+	    poll_listen(listener->tcpfd, POLLIN);
+	}
+      else if (listener->tcpfd != -1)
 	for (i = 0; i < MAX_PROCS; i++)
 	  if (daemon->tcp_pids[i] == 0)
 	    {
@@ -1490,6 +1869,8 @@ static int set_dns_listeners(time_t now)
 
     }
   
+  set_tcp_conn_listeners();
+
   return wait;
 }
 
@@ -1499,20 +1880,38 @@ static void check_dns_listeners(time_t now)
   struct listener *listener;
   int i;
 
+  /* Handle up to UDP_BATCH packets from each ready socket, and send 
+     the replies to clients together. */
+  udp_send_start();
+
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     if (poll_check(serverfdp->fd, POLLIN))
-      reply_query(serverfdp->fd, serverfdp->source_addr.sa.sa_family, now);
+      do
+	reply_query(serverfdp->fd, serverfdp->source_addr.sa.sa_family, now);
+      while (udp_pending(serverfdp->fd));
   
   if (daemon->port != 0 && !daemon->osport)
     for (i = 0; i < RANDOM_SOCKS; i++)
       if (daemon->randomsocks[i].refcount != 0 && 
 	  poll_check(daemon->randomsocks[i].fd, POLLIN))
-	reply_query(daemon->randomsocks[i].fd, daemon->randomsocks[i].family, now);
+	do
+	  reply_query(daemon->randomsocks[i].fd, daemon->randomsocks[i].family, now);
+	while (udp_pending(daemon->randomsocks[i].fd));
+  
+  udp_send_flush();
   
+  check_tcp_conns(now);
+
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
       if (listener->fd != -1 && poll_check(listener->fd, POLLIN))
-	receive_query(listener, now); 
+	{
+	  udp_send_start();
+	  do
+	    receive_query(listener, now); 
+	  while (udp_pending(listener->fd));
+	  udp_send_flush();
+	}
       
 #ifdef HAVE_TFTP     
       if (listener->tftpfd != -1 && poll_check(listener->tftpfd, POLLIN))
@@ -1601,6 +2000,16 @@ static void check_dns_listeners(time_t now)
 	      shutdown(confd, SHUT_RDWR);
 	      while (retry_send(close(confd)));
 	    }
+	  else if (option_bool(OPT_TCP_NOFORK))
+	    {
+	      struct in_addr netmask;
+	      
+	      netmask.s_addr = 0;
+	      if (iface)
+		netmask = iface->netmask;
+
+	      tcp_conn_new(confd, now, &tcp_addr, netmask, iface ? iface->dns_auth : 0);
+	    }
 #ifndef NO_FORK
 	  else if (!option_bool(OPT_DEBUG) && (p = fork()) != 0)
 	    {
@@ -1643,7 +2052,13 @@ static void check_dns_listeners(time_t now)
 	      /* Arrange for SIGALARM after CHILD_LIFETIME seconds to
 		 terminate the process. */
 	      if (!option_bool(OPT_DEBUG))
-		alarm(CHILD_LIFETIME);
+		{
+		  alarm(CHILD_LIFETIME);
+		  daemon->cache_parentfd = cachewrite;
+#ifdef HAVE_LINUX_NETWORK
+		  netlink_child_init();
+#endif
+		}
 #endif
 
 	      /* start with no upstream connections. */
@@ -1808,6 +2223,7 @@ int icmp_ping(struct in_addr addr)
     }
   
 #if defined(HAVE_LINUX_NETWORK) || defined(HAVE_SOLARIS_NETWORK)
+  poll_remove(fd);
   while (retry_send(close(fd)));
 #else
   opt = 1;
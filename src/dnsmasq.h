@@ -242,7 +242,10 @@ struct event_desc {
 #define OPT_LOOP_DETECT    50
 #define OPT_EXTRALOG       51
 #define OPT_TFTP_NO_FAIL   52
-#define OPT_LAST           53
+#define OPT_FASTEST_SERVER 53
+#define OPT_HEDGE          54
+#define OPT_TCP_NOFORK     55
+#define OPT_LAST           56
 
 /* extra flags for my_syslog, we use a couple of facilities since they are known 
    not to occupy the same bits as priorities, no matter how syslog.h is set up. */
@@ -295,6 +298,7 @@ struct naptr {
 #define TXT_STAT_HITS          5
 #define TXT_STAT_AUTH          6
 #define TXT_STAT_SERVERS       7
+#define TXT_STAT_PROTECTED     8
 
 struct txt_record {
   char *name;
@@ -376,7 +380,8 @@ struct blockdata {
 };
 
 struct crec { 
-  struct crec *next, *prev, *hash_next;
+  struct crec *next, *prev, *hash_next; /* prev chains a lease's records for F_DHCP */
+  struct crec *rev_next; /* chain in by-address index, F_REVERSE entries only */
   /* union is 16 bytes when doing IPv6, 8 bytes on 32 bit machines without IPv6 */
   union {
     struct all_addr addr;
@@ -402,7 +407,10 @@ struct crec {
   time_t ttd; /* time to die */
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
+  unsigned int ttl; /* as inserted, for --prefetch */
   unsigned short flags;
+  unsigned char protect; /* in the protected segment of the LRU list, --cache-slru only */
+  unsigned char hits; /* since inserted, or last prefetched, up to 255 */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -501,9 +509,12 @@ struct server {
   char *domain; /* set if this server only handles a domain. */ 
   int flags, tcpfd, edns_pktsz;
   unsigned int queries, failed_queries;
+  int srtt, rttvar; /* smoothed round trip time and variation, in microseconds */
 #ifdef HAVE_LOOP
   u32 uid;
 #endif
+  int serial; /* position in list, set by index_servers() */
+  struct server *domain_next; /* chain in domain index */
   struct server *next; 
 };
 
@@ -523,6 +534,7 @@ struct irec {
 
 struct listener {
   int fd, tcpfd, tftpfd, family;
+  int *workerfds; /* UDP socket for each of --dns-workers */
   struct irec *iface; /* only sometimes valid for non-wildcard */
   struct listener *next;
 };
@@ -592,6 +604,7 @@ struct hostsfile {
 #define FREC_DO_QUESTION       64
 #define FREC_ADDED_PHEADER    128
 #define FREC_TEST_PKTSZ       256
+#define FREC_HASHED           512
 
 #ifdef HAVE_DNSSEC
 #define HASH_SIZE 20 /* SHA-1 digest size */
@@ -599,6 +612,18 @@ struct hostsfile {
 #define HASH_SIZE sizeof(int)
 #endif
 
+/* Another client waiting for the answer to the same query. */
+struct frec_src {
+  union mysockaddr source;
+  struct all_addr dest;
+  unsigned int iface;
+  unsigned short orig_id;
+  int fd;
+  size_t qlen;
+  unsigned char question[MAXCDNAME + 4]; /* as sent, to restore case in reply */
+  struct frec_src *next;
+};
+
 struct frec {
   union mysockaddr source;
   struct all_addr dest;
@@ -609,9 +634,16 @@ struct frec {
 #endif
   unsigned int iface;
   unsigned short orig_id, new_id;
+  unsigned short pktsz; /* EDNS0 UDP size of query, zero if none */
   int log_id, fd, forwardall, flags;
   time_t time;
+  struct timeval sent; /* for round trip time, zero if sent more than once */
+  struct timeval join_by; /* other clients may share it until then */
+  struct timeval hedge_at; /* when to try another server, zero if not waiting */
+  unsigned char *hedge_packet; /* copy of query for that, kept for re-use */
+  size_t hedge_len, hedge_size;
   unsigned char *hash[HASH_SIZE];
+  struct frec_src *extra_src;
 #ifdef HAVE_DNSSEC 
   int class, work_counter;
   struct blockdata *stash; /* Saved reply, whilst we validate */
@@ -620,6 +652,13 @@ struct frec {
   struct frec *blocking_query; /* Query which is blocking us. */
 #endif
   struct frec *next;
+  struct frec *id_next, *sender_next, *query_next; /* hash chains, valid when FREC_HASHED set */
+  struct frec *queue_prev, *queue_next; /* age-ordered in-use queue, queue_next also chains free list */
+  struct frec *hedge_prev, *hedge_next; /* deadline-ordered, when hedge_at set */
+  struct timeval stale_at; /* when to answer from expired data, zero if not waiting */
+  unsigned char *stale_query; /* copy of the client's query for that */
+  size_t stale_len, stale_size;
+  struct frec *stale_prev, *stale_next;
 };
 
 /* flags in top of length field for DHCP-option tables */
@@ -646,6 +685,9 @@ struct frec {
 #define LEASE_NA            32  /* IPv6 no-temporary lease */
 #define LEASE_TA            64  /* IPv6 temporary lease */
 #define LEASE_HAVE_HWADDR  128  /* Have set hwaddress */
+#define LEASE_JOURNAL      256  /* changed since last written to the lease journal */
+#define LEASE_REPLACED     512  /* superseded while reading the lease journal */
+#define LEASE_DNS_DIRTY   1024  /* DNS records need to be added again */
 
 struct dhcp_lease {
   int clid_len;          /* length of client identifier */
@@ -677,6 +719,12 @@ struct dhcp_lease {
   int vendorclass_count;
 #endif
   struct dhcp_lease *next;
+  struct dhcp_lease *addr_next, *clid_next, *hw_next; /* DHCPv4 hash chains in lease.c */
+  struct dhcp_lease *journal_next;
+  struct dhcp_lease *prev; /* leases list is doubly linked */
+  int expiry_pos;          /* place in the expiry heap in lease.c, zero if none */
+  struct crec *dns;        /* DNS records for this lease, chained through ->prev */
+  struct dhcp_lease *dns_next;
 };
 
 struct dhcp_netid {
@@ -700,6 +748,8 @@ struct hwaddr_config {
   unsigned char hwaddr[DHCP_CHADDR_MAX];
   unsigned int wildcard_mask;
   struct hwaddr_config *next;
+  struct hwaddr_config *hash_next; /* hash chain in dhcp-common.c */
+  struct dhcp_config *config;
 };
 
 struct dhcp_config {
@@ -716,6 +766,8 @@ struct dhcp_config {
   unsigned int lease_time;
   struct hwaddr_config *hwaddr;
   struct dhcp_config *next;
+  struct dhcp_config *clid_next, *name_next, *addr_next, *wild_next; /* indexes in dhcp-common.c */
+  int order;
 };
 
 #define have_config(config, mask) ((config) && ((config)->flags & (mask))) 
@@ -842,6 +894,8 @@ struct dhcp_context {
 #endif
   int flags;
   struct dhcp_netid netid, *filter;
+  unsigned long *inuse; /* DHCPv4 map of taken addresses, see dhcp.c */
+  int inuse_gen;
   struct dhcp_context *next, *current;
 };
 
@@ -892,6 +946,41 @@ struct tftp_transfer {
   struct tftp_transfer *next;
 };
 
+/* TCP connection served from the main loop, with --no-tcp-fork */
+#define TCP_CONN_READ      1 /* reading query from client */
+#define TCP_CONN_CONNECT   2 /* connecting to upstream server */
+#define TCP_CONN_SEND      3 /* sending query upstream */
+#define TCP_CONN_REPLY     4 /* reading reply from upstream */
+#define TCP_CONN_WRITE     5 /* writing answer to client */
+
+struct tcp_conn {
+  int fd, upfd, state, query_count, log_id;
+  union mysockaddr peer, local;
+  struct in_addr netmask;
+  int auth_dns;
+  time_t start, time; /* connection opened, last progress */
+  unsigned char *packet; /* length-prefixed, as on the wire */
+  size_t len, done; /* bytes to transfer, and transferred, in packet */
+  /* state of forwarded query */
+  unsigned char *query;
+  size_t query_len;
+  struct server *server, *first, *upserver; /* trying, started at, connected to */
+  int reused; /* query sent on a pooled connection to upserver */
+  int type, norebind, checking_disabled, ad_reqd, do_bit, added_pheader, check_subnet;
+  char *domain;
+  unsigned char hash[HASH_SIZE];
+  struct tcp_conn *next;
+};
+
+/* --dns-workers: pid is 0 when the worker needs (re)starting and -1 when it
+   has been given up on. fd carries cache entries to and from it. */
+struct dns_worker {
+  pid_t pid;
+  int fd, fails; /* deaths in a row */
+  int resync; /* missed some DHCP names, to be restarted */
+  time_t started, restart; /* last started, not to be restarted before */
+};
+
 struct addr_list {
   struct in_addr addr;
   struct addr_list *next;
@@ -950,6 +1039,9 @@ extern struct daemon {
   char *log_file; /* optional log file */
   int max_logs;  /* queue limit */
   int cachesize, ftabsize;
+  int cache_protect; /* percentage in the protected segment, zero for a plain LRU cache */
+  int prefetch_hits, prefetch_percent; /* zero hits if not prefetching */
+  int stale_max, stale_wait; /* --serve-stale seconds and milliseconds, zero if not */
   int port, query_port, min_port;
   unsigned long local_ttl, neg_ttl, max_ttl, min_cache_ttl, max_cache_ttl, auth_ttl;
   struct hostsfile *addn_hosts;
@@ -971,6 +1063,7 @@ extern struct daemon {
   struct dhcp_netid_list *force_broadcast, *bootp_dynamic;
   struct hostsfile *dhcp_hosts_file, *dhcp_opts_file, *dynamic_dirs;
   int dhcp_max, tftp_max;
+  int lease_journal_max;
   int dhcp_server_port, dhcp_client_port;
   int start_tftp_port, end_tftp_port; 
   unsigned int min_leasetime;
@@ -1011,6 +1104,11 @@ extern struct daemon {
   size_t packet_len;       /*      "        "        */
   struct randfd *rfd_save; /*      "        "        */
   pid_t tcp_pids[MAX_PROCS];
+  int cachefd, cache_parentfd; /* TCP children pass cache entries back on these */
+  int dns_workers;
+  struct dns_worker *workers;
+  struct tcp_conn *tcp_conns;
+  int tcp_conn_count;
   struct randfd randomsocks[RANDOM_SOCKS];
   int v6pktinfo; 
   struct addrlist *interface_addrs; /* list of all addresses/prefix lengths associated with all local interfaces */
@@ -1066,12 +1164,19 @@ struct crec *cache_find_by_name(struct crec *crecp,
 				char *name, time_t now, unsigned int prot);
 void cache_end_insert(void);
 void cache_start_insert(void);
+void cache_recv_inserts(int fd, time_t now);
 struct crec *cache_insert(char *name, struct all_addr *addr,
 			  time_t now, unsigned long ttl, unsigned short flags);
 void cache_reload(void);
-void cache_add_dhcp_entry(char *host_name, int prot, struct all_addr *host_address, time_t ttd);
+void cache_add_dhcp_entry(char *host_name, int prot, struct all_addr *host_address,
+			  time_t ttd, struct crec **chain);
 struct in_addr a_record_from_hosts(char *name, time_t now);
-void cache_unhash_dhcp(void);
+void cache_del_dhcp_entries(struct crec **chain);
+void cache_send_dhcp(void *key, struct crec *chain);
+void cache_flush_dhcp(void);
+void cache_keep_dhcp(void *key, struct crec *chain);
+int cache_prefetch_due(struct crec *crecp, time_t now);
+void cache_serve_stale(int on);
 void dump_cache(time_t now);
 int cache_make_stat(struct txt_record *t);
 char *cache_get_name(struct crec *crecp);
@@ -1113,7 +1218,7 @@ int extract_addresses(struct dns_header *header, size_t qlen, char *namebuff,
 		      int no_cache, int secure, int *doctored);
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,  
 		      struct in_addr local_addr, struct in_addr local_netmask, 
-		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader);
+		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader, int *prefetch);
 int check_for_bogus_wildcard(struct dns_header *header, size_t qlen, char *name, 
 			     struct bogus_addr *addr, time_t now);
 int check_for_ignored_address(struct dns_header *header, size_t qlen, struct bogus_addr *baddr);
@@ -1222,8 +1327,20 @@ void reply_query(int fd, int family, time_t now);
 void receive_query(struct listener *listen, time_t now);
 unsigned char *tcp_request(int confd, time_t now,
 			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
+void tcp_conn_new(int confd, time_t now,
+		  union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
+void set_tcp_conn_listeners(void);
+void check_tcp_conns(time_t now);
 void server_gone(struct server *server);
+void forward_reset(void);
+int hedge_timeout(void);
+void hedge_queries(void);
+int stale_timeout(void);
+void stale_queries(time_t now);
 struct frec *get_new_frec(time_t now, int *wait, int force);
+int udp_pending(int fd);
+void udp_send_start(void);
+void udp_send_flush(void);
 int send_from(int fd, int nowild, char *packet, size_t len, 
 	       union mysockaddr *to, struct all_addr *source,
 	       unsigned int iface);
@@ -1236,9 +1353,14 @@ int indextoname(int fd, int index, char *name);
 int local_bind(int fd, union mysockaddr *addr, char *intname, int is_tcp);
 int random_sock(int family);
 void pre_allocate_sfds(void);
+int renew_sfds(void);
+void close_worker_socks(int index);
 int reload_servers(char *fname);
 void mark_servers(int flag);
 void cleanup_servers(void);
+void index_servers(void);
+struct server **domain_servers(char *name, int *count);
+struct server *default_servers(void);
 void add_update_server(int flags,
 		       union mysockaddr *addr,
 		       union mysockaddr *source_addr,
@@ -1281,7 +1403,9 @@ int address_allocate(struct dhcp_context *context,
 		     struct in_addr *addrp, unsigned char *hwaddr, int hw_len,
 		     struct dhcp_netid *netids, time_t now);
 void dhcp_read_ethers(void);
-struct dhcp_config *config_find_by_address(struct dhcp_config *configs, struct in_addr addr);
+void context_inuse_reset(void);
+void context_set_inuse(struct dhcp_context *c, struct in_addr addr, int inuse);
+void mark_inuse(struct in_addr addr, int inuse);
 char *host_from_dns(struct in_addr addr);
 #endif
 
@@ -1289,6 +1413,7 @@ char *host_from_dns(struct in_addr addr);
 #ifdef HAVE_DHCP
 void lease_update_file(time_t now);
 void lease_update_dns(int force);
+void lease_keep_dns(void);
 void lease_init(time_t now);
 struct dhcp_lease *lease4_allocate(struct in_addr addr);
 #ifdef HAVE_DHCP6
@@ -1314,6 +1439,7 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
 					unsigned char *clid, int clid_len);
 struct dhcp_lease *lease_find_by_addr(struct in_addr addr);
 struct in_addr lease_find_max_addr(struct dhcp_context *context);
+void lease_mark_context(struct dhcp_context *context);
 void lease_prune(struct dhcp_lease *target, time_t now);
 void lease_update_from_configs(void);
 int do_script_run(time_t now);
@@ -1342,11 +1468,15 @@ void queue_event(int event);
 void send_alarm(time_t event, time_t now);
 void send_event(int fd, int event, int data, char *msg);
 void clear_cache_and_reload(time_t now);
+void reload_dns_workers(int force);
 
 /* netlink.c */
 #ifdef HAVE_LINUX_NETWORK
 void netlink_init(void);
 void netlink_multicast(void);
+void netlink_child_init(void);
+void netlink_worker_init(void);
+size_t neigh_mac(union mysockaddr *addr, unsigned char **mac);
 #endif
 
 /* bpf.c */
@@ -1458,6 +1588,8 @@ struct dhcp_config *find_config(struct dhcp_config *configs,
 				unsigned char *hwaddr, int hw_len, 
 				int hw_type, char *hostname);
 int config_has_mac(struct dhcp_config *config, unsigned char *hwaddr, int len, int type);
+struct dhcp_config *config_find_by_address(struct dhcp_config *configs, struct in_addr addr);
+void config_index_reset(void);
 #ifdef HAVE_LINUX_NETWORK
 char *whichdevice(void);
 void bindtodevice(char *device, int fd);
@@ -1514,6 +1646,7 @@ void set_dynamic_inotify(int flag, int total_size, struct crec **rhash, int revh
 void poll_reset(void);
 int poll_check(int fd, short event);
 void poll_listen(int fd, short event);
+void poll_remove(int fd);
 int do_poll(int timeout);
 
 /* rrfilter.c */
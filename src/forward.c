@@ -20,8 +20,273 @@ static struct frec *lookup_frec(unsigned short id, void *hash);
 static struct frec *lookup_frec_by_sender(unsigned short id,
 					  union mysockaddr *addr,
 					  void *hash);
+static struct frec *lookup_frec_by_query(void *hash, int flags, unsigned short pktsz);
+static struct frec *lookup_frec_by_joined(unsigned short id, union mysockaddr *addr, void *hash);
 static unsigned short get_id(void);
 static void free_frec(struct frec *f);
+static void frec_link(struct frec *f);
+static void frec_unlink(struct frec *f);
+static void frec_dequeue(struct frec *f);
+static int frec_spare(void);
+
+/* In-use frecs are hashed by new_id, for matching replies, by
+   (orig_id, source, question) for spotting retries from clients and
+   by question alone, for joining clients asking the same thing. */
+static struct frec **frec_id_hash = NULL, **frec_sender_hash = NULL, **frec_query_hash = NULL;
+static int frec_hash_size;
+
+/* Spare records for clients waiting on another client's query. */
+static struct frec_src *frec_src_free = NULL;
+static int frec_src_count = 0;
+
+/* Records handed out by get_new_frec() are queued oldest-first, except
+   DNSSEC sub-queries which go when their "real" query is freed. Free
+   records are kept on a separate list. */
+static struct frec *frec_queue_head = NULL, *frec_queue_tail = NULL, *frec_free = NULL;
+static int frec_count = 0, frec_free_count = 0;
+
+/* With --hedge-queries, records for queries sent to a single server,
+   soonest hedge_at first. */
+static struct frec *hedge_head = NULL, *hedge_tail = NULL;
+static void hedge_unlink(struct frec *f);
+static void hedge_arm(struct frec *f, struct dns_header *header, size_t plen);
+
+/* With --serve-stale, records for queries with a client waiting, in
+   stale_at order, which is the order they were armed, and a buffer
+   for answers from expired data. */
+static struct frec *stale_head = NULL, *stale_tail = NULL;
+static unsigned char *stale_packet = NULL;
+static void stale_unlink(struct frec *f);
+static void stale_arm(struct frec *f, struct dns_header *header, size_t plen);
+static size_t stale_reply(struct dns_header *query, size_t plen, time_t now, int ad_reqd, int do_bit);
+static int stale_answer(struct frec *f, time_t now);
+static void frec_src_release(struct frec *f);
+
+#ifdef HAVE_MMSG
+/* UDP packets read ahead by recvmmsg() and waiting to be handed out,
+   or replies waiting to go with sendmmsg(). */
+struct mmsg_batch {
+  int fd, count, next;
+  unsigned char *buff;
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  union mysockaddr addr[UDP_BATCH];
+  union {
+    struct cmsghdr align; /* this ensures alignment */
+    char control[CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct in_pktinfo))];
+  } control_u[UDP_BATCH];
+};
+
+static struct mmsg_batch *recv_batch = NULL, *send_batch = NULL;
+static int mmsg_broken = 0, send_batching = 0;
+
+static struct mmsg_batch *mmsg_alloc(struct mmsg_batch **batchp)
+{
+  struct mmsg_batch *b = *batchp;
+
+  if (!b && (b = whine_malloc(sizeof(struct mmsg_batch))))
+    {
+      if (!(b->buff = whine_malloc(UDP_BATCH * daemon->packet_buff_sz)))
+	{
+	  free(b);
+	  return NULL;
+	}
+      b->fd = -1;
+      b->count = b->next = 0;
+      *batchp = b;
+    }
+
+  return b;
+}
+
+static void mmsg_slot(struct mmsg_batch *b, int i)
+{
+  struct msghdr *msg = &b->msgs[i].msg_hdr;
+
+  b->iov[i].iov_base = b->buff + (i * daemon->packet_buff_sz);
+  b->iov[i].iov_len = daemon->packet_buff_sz;
+  msg->msg_iov = &b->iov[i];
+  msg->msg_iovlen = 1;
+  msg->msg_name = &b->addr[i];
+  msg->msg_namelen = sizeof(union mysockaddr);
+  msg->msg_control = &b->control_u[i];
+  msg->msg_controllen = sizeof(b->control_u[i]);
+  msg->msg_flags = 0;
+}
+#endif
+
+/* Like recvmsg(), but where possible read a batch of up to max packets 
+   from fd in one go and return them one per call. udp_pending() is true 
+   whilst some of a batch remain. */
+static ssize_t udp_recvmsg(int fd, struct msghdr *msg, int max)
+{
+#ifdef HAVE_MMSG
+  struct mmsg_batch *b;
+  
+  if (!mmsg_broken && (b = mmsg_alloc(&recv_batch)))
+    {
+      if (b->next == b->count)
+	{
+	  int i, r;
+	  
+	  if (max > UDP_BATCH)
+	    max = UDP_BATCH;
+	  else if (max < 1)
+	    max = 1;
+	  
+	  for (i = 0; i < max; i++)
+	    mmsg_slot(b, i);
+	  
+	  while ((r = recvmmsg(fd, b->msgs, max, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR);
+	  
+	  if (r == -1 && errno != ENOSYS)
+	    return -1;
+	  
+	  if (r == -1)
+	    mmsg_broken = 1;
+	  else
+	    {
+	      b->fd = fd;
+	      b->count = r;
+	      b->next = 0;
+	    }
+	}
+      
+      if (b->next != b->count && b->fd == fd)
+	{
+	  struct msghdr *m = &b->msgs[b->next].msg_hdr;
+	  size_t len = b->msgs[b->next++].msg_len;
+	  
+	  msg->msg_flags = m->msg_flags;
+	  
+	  if (len > msg->msg_iov[0].iov_len)
+	    {
+	      len = msg->msg_iov[0].iov_len;
+	      msg->msg_flags |= MSG_TRUNC;
+	    }
+	  memcpy(msg->msg_iov[0].iov_base, m->msg_iov[0].iov_base, len);
+	  
+	  if (msg->msg_name)
+	    {
+	      if (msg->msg_namelen > m->msg_namelen)
+		msg->msg_namelen = m->msg_namelen;
+	      memcpy(msg->msg_name, m->msg_name, msg->msg_namelen);
+	    }
+	  
+	  if (msg->msg_controllen < m->msg_controllen)
+	    msg->msg_flags |= MSG_CTRUNC;
+	  else
+	    msg->msg_controllen = m->msg_controllen;
+	  if (msg->msg_controllen != 0)
+	    memcpy(msg->msg_control, m->msg_control, msg->msg_controllen);
+
+	  return len;
+	}
+    }
+#endif
+  
+  return recvmsg(fd, msg, 0);
+}
+
+int udp_pending(int fd)
+{
+#ifdef HAVE_MMSG
+  return recv_batch && recv_batch->fd == fd && recv_batch->next != recv_batch->count;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+static int send_msg(int fd, struct msghdr *msg)
+{
+  while (retry_send(sendmsg(fd, msg, 0)));
+
+  /* If interface is still in DAD, EINVAL results - ignore that. */
+  if (errno != 0 && errno != EINVAL)
+    {
+      my_syslog(LOG_ERR, _("failed to send packet: %s"), strerror(errno));
+      return 0;
+    }
+  
+  return 1;
+}
+
+#ifdef HAVE_MMSG
+static void mmsg_send(struct mmsg_batch *b)
+{
+  int i = 0, r;
+  
+  while (i < b->count)
+    {
+      if (!mmsg_broken)
+	{
+	  if ((r = sendmmsg(b->fd, &b->msgs[i], b->count - i, 0)) > 0)
+	    {
+	      i += r;
+	      continue;
+	    }
+	  
+	  if (r == -1 && errno == EINTR)
+	    continue;
+	  
+	  if (r == -1 && errno == ENOSYS)
+	    mmsg_broken = 1;
+	}
+      
+      /* Send the one which failed by itself, to get the usual handling of errors. */
+      send_msg(b->fd, &b->msgs[i++].msg_hdr);
+    }
+  
+  b->count = 0;
+}
+
+/* Copy a packet built by send_from() into the batch for sendmmsg(). */
+static int mmsg_queue(int fd, struct msghdr *msg)
+{
+  struct mmsg_batch *b;
+  struct msghdr *m;
+
+  if (mmsg_broken || msg->msg_iov[0].iov_len > (size_t)daemon->packet_buff_sz ||
+      !(b = mmsg_alloc(&send_batch)))
+    return 0;
+  
+  if (b->count != 0 && (b->fd != fd || b->count == UDP_BATCH))
+    mmsg_send(b);
+  
+  mmsg_slot(b, b->count);
+  m = &b->msgs[b->count++].msg_hdr;
+  b->fd = fd;
+
+  b->iov[b->count - 1].iov_len = msg->msg_iov[0].iov_len;
+  memcpy(m->msg_iov[0].iov_base, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+  memcpy(m->msg_name, msg->msg_name, m->msg_namelen = msg->msg_namelen);
+  if ((m->msg_controllen = msg->msg_controllen) != 0)
+    memcpy(m->msg_control, msg->msg_control, msg->msg_controllen);
+  else
+    m->msg_control = NULL;
+  
+  return 1;
+}
+#endif
+
+/* Between these, replies from send_from() are held back and sent
+   together with sendmmsg(). */
+void udp_send_start(void)
+{
+#ifdef HAVE_MMSG
+  send_batching = 1;
+#endif
+}
+
+void udp_send_flush(void)
+{
+#ifdef HAVE_MMSG
+  send_batching = 0;
+  if (send_batch && send_batch->count != 0)
+    mmsg_send(send_batch);
+#endif
+}
 
 /* Send a UDP packet with its source address set as "source" 
    unless nowild is true, when we just send it with the kernel default */
@@ -94,16 +359,12 @@ int send_from(int fd, int nowild, char *packet, size_t len,
 #endif
     }
   
-  while (retry_send(sendmsg(fd, &msg, 0)));
+#ifdef HAVE_MMSG
+  if (send_batching && mmsg_queue(fd, &msg))
+    return 1;
+#endif
 
-  /* If interface is still in DAD, EINVAL results - ignore that. */
-  if (errno != 0 && errno != EINVAL)
-    {
-      my_syslog(LOG_ERR, _("failed to send packet: %s"), strerror(errno));
-      return 0;
-    }
-  
-  return 1;
+  return send_msg(fd, &msg);
 }
           
 static unsigned int search_servers(time_t now, struct all_addr **addrpp, 
@@ -116,12 +377,17 @@ static unsigned int search_servers(time_t now, struct all_addr **addrpp,
   
   unsigned int namelen = strlen(qdomain);
   unsigned int matchlen = 0;
-  struct server *serv;
+  struct server *serv, **servers;
   unsigned int flags = 0;
+  int i, count;
+
+  /* Only the servers which can match, but in list order, since that
+     decides between servers for the same domain. */
+  servers = domain_servers(qdomain, &count);
   
-  for (serv = daemon->servers; serv; serv=serv->next)
+  for (i = 0; i < count; i++)
     /* domain matches take priority over NODOTS matches */
-    if ((serv->flags & SERV_FOR_NODOTS) && *type != SERV_HAS_DOMAIN && !strchr(qdomain, '.') && namelen != 0)
+    if (((serv = servers[i])->flags & SERV_FOR_NODOTS) && *type != SERV_HAS_DOMAIN && !strchr(qdomain, '.') && namelen != 0)
       {
 	unsigned int sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6; 
 	*type = SERV_FOR_NODOTS;
@@ -227,6 +493,96 @@ static unsigned int search_servers(time_t now, struct all_addr **addrpp,
   return  flags;
 }
 
+/* Microseconds since tv, or -1 if the clock has jumped. */
+static int rtt_since(struct timeval *tv)
+{
+  struct timeval now;
+  long usec;
+
+  gettimeofday(&now, NULL);
+  usec = (now.tv_sec - tv->tv_sec) * 1000000L + (now.tv_usec - tv->tv_usec);
+
+  if (usec < 0 || usec > TIMEOUT * 1000000L)
+    return -1;
+
+  return usec ? (int)usec : 1;
+}
+
+/* Fold a round trip time into the server's average, as TCP does (RFC 6298). */
+static void server_rtt(struct server *serv, int rtt)
+{
+  if (serv->srtt == 0)
+    {
+      serv->srtt = rtt;
+      serv->rttvar = rtt / 2;
+    }
+  else
+    {
+      int err = rtt - serv->srtt;
+      
+      serv->srtt += err / 8;
+      if (err < 0)
+	err = -err;
+      serv->rttvar += (err - serv->rttvar) / 4;
+    }
+}
+
+/* Count queries which have gone unanswered for a while against the
+   server they were sent to. Only needs doing once a second. */
+static void penalise_servers(time_t now)
+{
+  static time_t last = 0;
+  struct frec *f;
+
+  if (now == last)
+    return;
+  last = now;
+
+  for (f = frec_queue_head; f && difftime(now, f->time) >= SRTT_TIMEOUT; f = f->queue_next)
+    if (f->sentto && f->sent.tv_sec != 0)
+      {
+	server_rtt(f->sentto, TIMEOUT * 1000000);
+	f->sent.tv_sec = 0;
+      }
+}
+
+/* The default server with the lowest round trip time. Every FORWARD_TEST
+   queries or FORWARD_TIME seconds, one of the others instead, in turn, 
+   to keep its time current. Servers not yet timed go first. */
+static struct server *fastest_server(time_t now)
+{
+  static int next_probe = 0;
+  struct server *serv, *best = NULL;
+  int count = 0;
+
+  penalise_servers(now);
+
+  for (serv = default_servers(); serv; serv = serv->domain_next)
+    if (!(serv->flags & SERV_LOOP))
+      {
+	count++;
+	if (!best || serv->srtt < best->srtt ||
+	    (serv->srtt == best->srtt && serv->serial < best->serial))
+	  best = serv;
+      }
+
+  if (count > 1 && 
+      (daemon->forwardcount++ > FORWARD_TEST ||
+       difftime(now, daemon->forwardtime) > FORWARD_TIME))
+    {
+      int probe = next_probe++ % (count - 1);
+
+      daemon->forwardcount = 0;
+      daemon->forwardtime = now;
+
+      for (serv = default_servers(); serv; serv = serv->domain_next)
+	if (!(serv->flags & SERV_LOOP) && serv != best && probe-- == 0)
+	  return serv;
+    }
+
+  return best;
+}
+
 static int forward_query(int udpfd, union mysockaddr *udpaddr,
 			 struct all_addr *dst_addr, unsigned int dst_iface,
 			 struct dns_header *header, size_t plen, time_t now, 
@@ -244,13 +600,17 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
   void *hash = &crc;
 #endif
  unsigned int gotname = extract_request(header, plen, daemon->namebuff, NULL);
+ unsigned short client_id = ntohs(header->id);
 
  (void)do_bit;
 
-  /* may be no servers available. */
+  /* may be no servers available. A retry from a client which joined
+     another's query is a retry of that query. */
   if (!daemon->servers)
     forward = NULL;
-  else if (forward || (hash && (forward = lookup_frec_by_sender(ntohs(header->id), udpaddr, hash))))
+  else if (forward || 
+	   (hash && ((forward = lookup_frec_by_sender(client_id, udpaddr, hash)) ||
+		     (forward = lookup_frec_by_joined(client_id, udpaddr, hash)))))
     {
       /* If we didn't get an answer advertising a maximal packet in EDNS,
 	 fall back to 1280, which should work everywhere on IPv6.
@@ -309,6 +669,14 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
       /* retry on existing query, send to all available servers  */
       domain = forward->sentto->domain;
       forward->sentto->failed_queries++;
+      if (forward->sent.tv_sec != 0)
+	{
+	  /* Not answered in time. */
+	  if (option_bool(OPT_FASTEST_SERVER))
+	    server_rtt(forward->sentto, TIMEOUT * 1000000);
+	  /* Can't tell which send the reply is to, so don't time it. */
+	  forward->sent.tv_sec = 0;
+	}
       if (!option_bool(OPT_ORDER))
 	{
 	  forward->forwardall = 1;
@@ -321,9 +689,67 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
     }
   else 
     {
+      int fwd_flags = 0;
+      unsigned short pktsz = 0;
+      unsigned char *pheader;
+
+      if (find_pseudoheader(header, plen, NULL, &pheader, NULL))
+	GETSHORT(pktsz, pheader);
+      if (header->hb4 & HB4_CD)
+	fwd_flags |= FREC_CHECKING_DISABLED;
+      if (ad_reqd)
+	fwd_flags |= FREC_AD_QUESTION;
+#ifdef HAVE_DNSSEC
+      if (do_bit)
+	fwd_flags |= FREC_DO_QUESTION;
+#endif
+
       if (gotname)
 	flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain, &norebind);
       
+      /* If the same question is already in flight for another client, just
+	 wait for that answer. Not possible if we add client-specific data
+	 to the query. */
+      if (!flags && hash && ntohs(header->qdcount) == 1 &&
+	  !option_bool(OPT_ADD_MAC) && !option_bool(OPT_CLIENT_SUBNET) &&
+	  (forward = lookup_frec_by_query(hash, fwd_flags, pktsz)))
+	{
+	  struct frec_src *src;
+	  unsigned char *p = skip_questions(header, plen);
+
+	  /* a prefetch has no client to add */
+	  if (udpfd == -1)
+	    return 1;
+
+	  if (!frec_src_free && frec_src_count < daemon->ftabsize &&
+	      (frec_src_free = whine_malloc(sizeof(struct frec_src))))
+	    {
+	      frec_src_count++;
+	      frec_src_free->next = NULL;
+	    }
+	  
+	  /* If we've been spammed with many duplicates, just drop the query. */
+	  if (p && (size_t)(p - (unsigned char *)(header+1)) <= MAXCDNAME + 4 && (src = frec_src_free))
+	    {
+	      frec_src_free = src->next;
+	      src->source = *udpaddr;
+	      src->dest = *dst_addr;
+	      src->iface = dst_iface;
+	      src->orig_id = ntohs(header->id);
+	      src->fd = udpfd;
+	      src->qlen = p - (unsigned char *)(header+1);
+	      memcpy(src->question, header+1, src->qlen);
+	      src->next = forward->extra_src;
+	      forward->extra_src = src;
+
+	      /* The first client may have had its answer, or be a prefetch. */
+	      if (daemon->stale_max && forward->stale_at.tv_sec == 0)
+		stale_arm(forward, header, plen);
+	    }
+	  
+	  return 1;
+	}
+
       if (!flags && !(forward = get_new_frec(now, NULL, 0)))
 	/* table full - server failure. */
 	flags = F_NEG;
@@ -337,20 +763,19 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	  forward->new_id = get_id();
 	  forward->fd = udpfd;
 	  memcpy(forward->hash, hash, HASH_SIZE);
+	  forward->pktsz = pktsz;
 	  forward->forwardall = 0;
-	  forward->flags = 0;
+	  forward->flags = fwd_flags;
 	  if (norebind)
 	    forward->flags |= FREC_NOREBIND;
-	  if (header->hb4 & HB4_CD)
-	    forward->flags |= FREC_CHECKING_DISABLED;
-	  if (ad_reqd)
-	    forward->flags |= FREC_AD_QUESTION;
 #ifdef HAVE_DNSSEC
 	  forward->work_counter = DNSSEC_WORK;
-	  if (do_bit)
-	    forward->flags |= FREC_DO_QUESTION;
 #endif
+	  frec_link(forward);
 	  
+	  if (daemon->stale_max && udpfd != -1)
+	    stale_arm(forward, header, plen);
+
 	  header->id = htons(forward->new_id);
 	  
 	  /* In strict_order mode, always try servers in the order 
@@ -362,6 +787,9 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	    {
 	      if (option_bool(OPT_ORDER))
 		start = daemon->servers;
+	      else if (option_bool(OPT_FASTEST_SERVER) && !option_bool(OPT_ALL_SERVERS) &&
+		       (start = fastest_server(now)))
+		;
 	      else if (!(start = daemon->last_server) ||
 		       daemon->forwardcount++ > FORWARD_TEST ||
 		       difftime(now, daemon->forwardtime) > FORWARD_TIME)
@@ -393,6 +821,15 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
       /* If a query is retried, use the log_id for the retry when logging the answer. */
       forward->log_id = daemon->log_id;
       
+      if (!forward->sentto)
+	{
+	  gettimeofday(&forward->sent, NULL);
+	  forward->join_by = forward->sent;
+	  forward->join_by.tv_usec += JOIN_TIME * 1000L;
+	  forward->join_by.tv_sec += forward->join_by.tv_usec / 1000000;
+	  forward->join_by.tv_usec %= 1000000;
+	}
+      
       if (option_bool(OPT_ADD_MAC))
 	{
 	  size_t new = add_mac(header, plen, ((char *) header) + daemon->packet_buff_sz, &forward->source);
@@ -532,23 +969,82 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	}
       
       if (forwarded)
-	return 1;
+	{
+	  if (option_bool(OPT_HEDGE) && !forward->forwardall)
+	    hedge_arm(forward, header, plen);
+	  return 1;
+	}
       
       /* could not send on, prepare to return */ 
-      header->id = htons(forward->orig_id);
+      header->id = htons(client_id);
       free_frec(forward); /* cancel */
     }	  
   
-  /* could not send on, return empty answer or address if known for whole domain */
+  /* could not send on, return empty answer or address if known for whole domain,
+     or with --serve-stale, an expired one if nothing is known */
   if (udpfd != -1)
     {
-      plen = setup_reply(header, plen, addrp, flags, daemon->local_ttl);
-      send_from(udpfd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)header, plen, udpaddr, dst_addr, dst_iface);
+      size_t m = 0;
+
+      if (daemon->stale_max && (!flags || flags == F_NEG))
+	m = stale_reply(header, plen, now, ad_reqd, do_bit);
+
+      if (m)
+	send_from(udpfd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)stale_packet, m, udpaddr, dst_addr, dst_iface);
+      else
+	{
+	  plen = setup_reply(header, plen, addrp, flags, daemon->local_ttl);
+	  send_from(udpfd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)header, plen, udpaddr, dst_addr, dst_iface);
+	}
     }
 
   return 0;
 }
 
+/* Ask upstream again for the question in an answer just given from the
+   cache, with no client waiting, so that the reply refreshes the cache.
+   Clients asking the same question meanwhile get the reply too. */
+static void prefetch_query(struct dns_header *header, size_t plen, time_t now)
+{
+  union mysockaddr no_client;
+  struct all_addr no_dest;
+  unsigned char *p;
+  void *hash;
+#ifndef HAVE_DNSSEC
+  unsigned int crc;
+#endif
+
+  /* Not if the answer can depend on who asked. */
+  if (option_bool(OPT_ADD_MAC) || option_bool(OPT_CLIENT_SUBNET) ||
+      ntohs(header->qdcount) != 1 || !(p = skip_questions(header, plen)))
+    return;
+  
+  /* Turn the answer back into a query. */
+  header->id = 0;
+  header->hb3 = HB3_RD;
+  header->hb4 = 0;
+  header->ancount = header->nscount = header->arcount = htons(0);
+  plen = add_pseudoheader(header, p - (unsigned char *)header, (unsigned char *)header + daemon->packet_buff_sz,
+			  daemon->edns_pktsz, 0, NULL, 0, 0);
+
+  memset(&no_client, 0, sizeof(no_client));
+  no_client.sa.sa_family = AF_INET;
+  memset(&no_dest, 0, sizeof(no_dest));
+
+#ifdef HAVE_DNSSEC
+  hash = hash_questions(header, plen, daemon->namebuff);
+#else
+  hash = &crc;
+  crc = questions_crc(header, plen, daemon->namebuff);
+#endif
+
+  /* Already on its way. */
+  if (!hash || lookup_frec_by_sender(0, &no_client, hash))
+    return;
+  
+  forward_query(-1, &no_client, &no_dest, 0, header, plen, now, NULL, 0, 0);
+}
+
 static size_t process_reply(struct dns_header *header, time_t now, struct server *server, size_t n, int check_rebind, 
 			    int no_cache, int cache_secure, int bogusanswer, int ad_reqd, int do_bit, int added_pheader, 
 			    int check_subnet, union mysockaddr *query_source)
@@ -709,6 +1205,31 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
   return resize_packet(header, n, pheader, plen);
 }
 
+/* Compare single questions in wire format, ignoring case in the name.
+   Label lengths are all below 'A', so can be compared in the same way. */
+static int question_isequal(unsigned char *a, unsigned char *b, size_t len)
+{
+  size_t i;
+  
+  if (len < 4)
+    return 0;
+
+  for (i = 0; i < len - 4; i++)
+    {
+      unsigned int c1 = a[i], c2 = b[i];
+      
+      if (c1 >= 'A' && c1 <= 'Z')
+	c1 += 'a' - 'A';
+      if (c2 >= 'A' && c2 <= 'Z')
+	c2 += 'a' - 'A';
+
+      if (c1 != c2)
+	return 0;
+    }
+
+  return memcmp(a + len - 4, b + len - 4, 4) == 0;
+}
+
 /* sets new last_server */
 void reply_query(int fd, int family, time_t now)
 {
@@ -717,15 +1238,30 @@ void reply_query(int fd, int family, time_t now)
   struct dns_header *header;
   union mysockaddr serveraddr;
   struct frec *forward;
-  socklen_t addrlen = sizeof(serveraddr);
-  ssize_t n = recvfrom(fd, daemon->packet, daemon->packet_buff_sz, 0, &serveraddr.sa, &addrlen);
+  struct msghdr msg;
+  struct iovec iov[1];
+  ssize_t n;
   size_t nn;
+  int rtt;
   struct server *server;
   void *hash;
 #ifndef HAVE_DNSSEC
   unsigned int crc;
 #endif
 
+  iov[0].iov_base = daemon->packet;
+  iov[0].iov_len = daemon->packet_buff_sz;
+
+  msg.msg_control = NULL;
+  msg.msg_controllen = 0;
+  msg.msg_flags = 0;
+  msg.msg_name = &serveraddr;
+  msg.msg_namelen = sizeof(serveraddr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+
+  n = udp_recvmsg(fd, &msg, UDP_BATCH);
+
   /* packet buffer overwritten */
   daemon->srv_save = NULL;
   
@@ -760,6 +1296,22 @@ void reply_query(int fd, int family, time_t now)
   if (!(forward = lookup_frec(ntohs(header->id), hash)))
     return;
   
+  if (forward->sent.tv_sec != 0 && (rtt = rtt_since(&forward->sent)) != -1)
+    {
+      /* Time the server the reply came from, which may not be the
+	 last one the query went to. */
+      struct server *timed = forward->sentto;
+      
+      if (!sockaddr_isequal(&timed->addr, &serveraddr))
+	for (timed = daemon->servers; timed; timed = timed->next)
+	  if ((timed->flags & SERV_TYPE) == (forward->sentto->flags & SERV_TYPE) &&
+	      !(timed->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR)) &&
+	      sockaddr_isequal(&timed->addr, &serveraddr))
+	    break;
+      
+      server_rtt(timed ? timed : server, rtt);
+    }
+  
   /* log_query gets called indirectly all over the place, so 
      pass these in global variables - sorry. */
   daemon->log_display_id = forward->log_id;
@@ -903,15 +1455,30 @@ void reply_query(int fd, int family, time_t now)
 		    {
 		      int fd;
 		      struct frec *next = new->next;
+		      unsigned char *hedge_packet = new->hedge_packet;
+		      size_t hedge_size = new->hedge_size;
+		      unsigned char *stale_query = new->stale_query;
+		      size_t stale_size = new->stale_size;
+		      frec_dequeue(new);
 		      *new = *forward; /* copy everything, then overwrite */
 		      new->next = next;
+		      new->queue_prev = new->queue_next = NULL;
+		      new->extra_src = NULL;
+		      new->hedge_at.tv_sec = 0;
+		      new->hedge_packet = hedge_packet; /* kept by free_frec() for re-use */
+		      new->hedge_size = hedge_size;
+		      new->hedge_prev = new->hedge_next = NULL;
+		      new->stale_at.tv_sec = 0;
+		      new->stale_query = stale_query;
+		      new->stale_size = stale_size;
+		      new->stale_prev = new->stale_next = NULL;
 		      new->blocking_query = NULL;
 		      new->sentto = server;
 		      new->rfd4 = NULL;
 #ifdef HAVE_IPV6
 		      new->rfd6 = NULL;
 #endif
-		      new->flags &= ~(FREC_DNSKEY_QUERY | FREC_DS_QUERY);
+		      new->flags &= ~(FREC_DNSKEY_QUERY | FREC_DS_QUERY | FREC_HASHED);
 		      
 		      new->dependent = forward; /* to find query awaiting new one. */
 		      forward->blocking_query = new; /* for garbage cleaning */
@@ -931,6 +1498,7 @@ void reply_query(int fd, int family, time_t now)
 		      if ((hash = hash_questions(header, nn, daemon->namebuff)))
 			memcpy(new->hash, hash, HASH_SIZE);
 		      new->new_id = get_id();
+		      frec_link(new);
 		      header->id = htons(new->new_id);
 		      /* Save query for retransmission */
 		      new->stash = blockdata_alloc((char *)header, nn);
@@ -960,6 +1528,7 @@ void reply_query(int fd, int family, time_t now)
 		      
 		      if (fd != -1)
 			{
+			  gettimeofday(&new->sent, NULL);
 			  while (retry_send(sendto(fd, (char *)header, nn, 0, 
 						   &server->addr.sa, 
 						   sa_len(&server->addr)))); 
@@ -1024,12 +1593,30 @@ void reply_query(int fd, int family, time_t now)
       
       if ((nn = process_reply(header, now, server, (size_t)n, check_rebind, no_cache_dnssec, cache_secure, bogusanswer, 
 			      forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION, 
-			      forward->flags & FREC_ADDED_PHEADER, forward->flags & FREC_HAS_SUBNET, &forward->source)))
+			      forward->flags & FREC_ADDED_PHEADER, forward->flags & FREC_HAS_SUBNET, &forward->source)) &&
+	  !((RCODE(header) == SERVFAIL || RCODE(header) == REFUSED) && stale_answer(forward, now)))
 	{
+	  struct frec_src *src;
+	  unsigned char *p = skip_questions(header, nn);
+	  size_t qlen = p ? (size_t)(p - (unsigned char *)(header+1)) : 0;
+
 	  header->id = htons(forward->orig_id);
 	  header->hb4 |= HB4_RA; /* recursion if available */
-	  send_from(forward->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
-		    &forward->source, &forward->dest, forward->iface);
+	  if (forward->fd != -1) /* else a prefetch */
+	    send_from(forward->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
+		      &forward->source, &forward->dest, forward->iface);
+
+	  /* Same answer to the other clients that asked, with their ID and
+	     their capitalisation of the question. Only the hash of the question
+	     has been checked so far, so check the whole thing here. */
+	  for (src = forward->extra_src; src; src = src->next)
+	    if (src->qlen == qlen && question_isequal(src->question, (unsigned char *)(header+1), qlen))
+	      {
+		memcpy(header+1, src->question, qlen);
+		header->id = htons(src->orig_id);
+		send_from(src->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
+			  &src->source, &src->dest, src->iface);
+	      }
 	}
       free_frec(forward); /* cancel */
     }
@@ -1103,7 +1690,8 @@ void receive_query(struct listener *listen, time_t now)
   msg.msg_iov = iov;
   msg.msg_iovlen = 1;
   
-  if ((n = recvmsg(listen->fd, &msg, 0)) == -1)
+  /* Don't read more queries than we can forward. */
+  if ((n = udp_recvmsg(listen->fd, &msg, frec_spare())) == -1)
     return;
   
   if (n < (int)sizeof(struct dns_header) || 
@@ -1347,19 +1935,21 @@ void receive_query(struct listener *listen, time_t now)
   else
 #endif
     {
-      int ad_reqd = do_bit;
+      int ad_reqd = do_bit, prefetch;
        /* RFC 6840 5.7 */
       if (header->hb4 & HB4_AD)
 	ad_reqd = 1;
 
       m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
-			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader);
+			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &prefetch);
       
       if (m >= 1)
 	{
 	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
 		    (char *)header, m, &source_addr, &dst_addr, if_index);
 	  daemon->local_answer++;
+	  if (prefetch)
+	    prefetch_query(header, m, now);
 	}
       else if (forward_query(listen->fd, &source_addr, &dst_addr, if_index,
 			     header, (size_t)n, now, NULL, ad_reqd, do_bit))
@@ -1447,6 +2037,44 @@ static int tcp_key_recurse(time_t now, int status, struct dns_header *header, si
    blocking as neccessary, and then return. Note, need to be a bit careful
    about resources for debug mode, when the fork is suppressed: that's
    done by the caller. */
+/* We can be configured to only accept queries from at-most-one-hop-away addresses. */
+static int tcp_peer_ok(union mysockaddr *peer_addr)
+{
+  struct addrlist *addr;
+
+  if (!option_bool(OPT_LOCAL_SERVICE))
+    return 1;
+
+#ifdef HAVE_IPV6
+  if (peer_addr->sa.sa_family == AF_INET6) 
+    {
+      for (addr = daemon->interface_addrs; addr; addr = addr->next)
+	if ((addr->flags & ADDRLIST_IPV6) &&
+	    is_same_net6(&addr->addr.addr.addr6, &peer_addr->in6.sin6_addr, addr->prefixlen))
+	  break;
+    }
+  else
+#endif
+    {
+      struct in_addr netmask;
+      for (addr = daemon->interface_addrs; addr; addr = addr->next)
+	{
+	  netmask.s_addr = htonl(~(in_addr_t)0 << (32 - addr->prefixlen));
+	  if (!(addr->flags & ADDRLIST_IPV6) && 
+	      is_same_net(addr->addr.addr.addr4, peer_addr->in.sin_addr, netmask))
+	    break;
+	}
+    }
+
+  if (!addr)
+    {
+      my_syslog(LOG_WARNING, _("Ignoring query from non-local network"));
+      return 0;
+    }
+
+  return 1;
+}
+
 unsigned char *tcp_request(int confd, time_t now,
 			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns)
 {
@@ -1474,41 +2102,11 @@ unsigned char *tcp_request(int confd, time_t now,
   int query_count = 0;
   unsigned char *pheader;
 
-  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1)
+  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1 ||
+      !tcp_peer_ok(&peer_addr))
     return packet;
-  
-  /* We can be configured to only accept queries from at-most-one-hop-away addresses. */
-  if (option_bool(OPT_LOCAL_SERVICE))
-    {
-      struct addrlist *addr;
-#ifdef HAVE_IPV6
-      if (peer_addr.sa.sa_family == AF_INET6) 
-	{
-	  for (addr = daemon->interface_addrs; addr; addr = addr->next)
-	    if ((addr->flags & ADDRLIST_IPV6) &&
-		is_same_net6(&addr->addr.addr.addr6, &peer_addr.in6.sin6_addr, addr->prefixlen))
-	      break;
-	}
-      else
-#endif
-	{
-	  struct in_addr netmask;
-	  for (addr = daemon->interface_addrs; addr; addr = addr->next)
-	    {
-	      netmask.s_addr = htonl(~(in_addr_t)0 << (32 - addr->prefixlen));
-	      if (!(addr->flags & ADDRLIST_IPV6) && 
-		  is_same_net(addr->addr.addr.addr4, peer_addr.in.sin_addr, netmask))
-		break;
-	    }
-	}
-      if (!addr)
-	{
-	  my_syslog(LOG_WARNING, _("Ignoring query from non-local network"));
-	  return packet;
-	}
-    }
-
-  while (1)
+
+  while (1)
     {
       if (query_count == TCP_MAX_QUERIES ||
 	  !packet ||
@@ -1595,7 +2193,7 @@ unsigned char *tcp_request(int confd, time_t now,
 	   
 	   /* m > 0 if answered from cache */
 	   m = answer_request(header, ((char *) header) + 65536, (size_t)size, 
-			      dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader);
+			      dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, NULL);
 	  
 	  /* Do this by steam now we're not in the select() loop */
 	  check_log_writer(1); 
@@ -1820,247 +2418,1430 @@ unsigned char *tcp_request(int confd, time_t now,
     }
 }
 
-static struct frec *allocate_frec(time_t now)
+/* With --no-tcp-fork, TCP connections are served from the main loop.
+   Each is a state machine which reads a query, answers it locally or 
+   sends it upstream over TCP, and writes the answer, without blocking.
+   Answers from upstream go into the cache, as UDP ones do. Validating
+   DNSSEC needs blocking queries for keys, so isn't supported here. */
+
+static void tcp_conn_close_upstream(struct tcp_conn *conn)
 {
-  struct frec *f;
-  
-  if ((f = (struct frec *)whine_malloc(sizeof(struct frec))))
+  if (conn->upfd != -1)
     {
-      f->next = daemon->frec_list;
-      f->time = now;
-      f->sentto = NULL;
-      f->rfd4 = NULL;
-      f->flags = 0;
-#ifdef HAVE_IPV6
-      f->rfd6 = NULL;
-#endif
-#ifdef HAVE_DNSSEC
-      f->dependent = NULL;
-      f->blocking_query = NULL;
-      f->stash = NULL;
-#endif
-      daemon->frec_list = f;
+      poll_remove(conn->upfd);
+      shutdown(conn->upfd, SHUT_RDWR);
+      while (retry_send(close(conn->upfd)));
+      conn->upfd = -1;
     }
-
-  return f;
+  conn->upserver = NULL;
 }
 
-struct randfd *allocate_rfd(int family)
+static void tcp_conn_free(struct tcp_conn *conn)
 {
-  static int finger = 0;
-  int i;
+  struct tcp_conn **up;
 
-  /* limit the number of sockets we have open to avoid starvation of 
-     (eg) TFTP. Once we have a reasonable number, randomness should be OK */
-
-  for (i = 0; i < RANDOM_SOCKS; i++)
-    if (daemon->randomsocks[i].refcount == 0)
+  for (up = &daemon->tcp_conns; *up; up = &(*up)->next)
+    if (*up == conn)
       {
-	if ((daemon->randomsocks[i].fd = random_sock(family)) == -1)
-	  break;
-      
-	daemon->randomsocks[i].refcount = 1;
-	daemon->randomsocks[i].family = family;
-	return &daemon->randomsocks[i];
+	*up = conn->next;
+	break;
       }
+  
+  daemon->tcp_conn_count--;
 
-  /* No free ones or cannot get new socket, grab an existing one */
-  for (i = 0; i < RANDOM_SOCKS; i++)
+  tcp_conn_close_upstream(conn);
+  poll_remove(conn->fd);
+  shutdown(conn->fd, SHUT_RDWR);
+  while (retry_send(close(conn->fd)));
+  
+  free(conn->packet);
+  free(conn->query);
+  free(conn);
+}
+
+void tcp_conn_new(int confd, time_t now,
+		  union mysockaddr *local_addr, struct in_addr netmask, int auth_dns)
+{
+  struct tcp_conn *conn;
+  socklen_t peer_len = sizeof(union mysockaddr);
+  
+  if (!(conn = whine_malloc(sizeof(struct tcp_conn))) ||
+      !(conn->packet = whine_malloc(65536 + MAXDNAME + RRFIXEDSZ + sizeof(u16))) ||
+      getpeername(confd, (struct sockaddr *)&conn->peer, &peer_len) == -1 ||
+      !tcp_peer_ok(&conn->peer) ||
+      !fix_fd(confd))
     {
-      int j = (i+finger) % RANDOM_SOCKS;
-      if (daemon->randomsocks[j].refcount != 0 &&
-	  daemon->randomsocks[j].family == family && 
-	  daemon->randomsocks[j].refcount != 0xffff)
+      if (conn)
 	{
-	  finger = j;
-	  daemon->randomsocks[j].refcount++;
-	  return &daemon->randomsocks[j];
+	  free(conn->packet);
+	  free(conn);
 	}
+      shutdown(confd, SHUT_RDWR);
+      while (retry_send(close(confd)));
+      return;
     }
 
-  return NULL; /* doom */
+  conn->fd = confd;
+  conn->upfd = -1;
+  conn->upserver = NULL;
+  conn->reused = 0;
+  conn->state = TCP_CONN_READ;
+  conn->query_count = 0;
+  conn->local = *local_addr;
+  conn->netmask = netmask;
+  conn->auth_dns = auth_dns;
+  conn->start = conn->time = now;
+  conn->len = sizeof(u16);
+  conn->done = 0;
+  conn->query = NULL;
+  conn->query_len = 0;
+  conn->next = daemon->tcp_conns;
+  daemon->tcp_conns = conn;
+  daemon->tcp_conn_count++;
 }
 
-void free_rfd(struct randfd *rfd)
+/* Move data between the packet and fd. Returns 1 when the transfer is 
+   complete, 0 if the socket would block, -1 on error or end-of-file. */
+static int tcp_conn_io(int fd, struct tcp_conn *conn, int rw)
 {
-  if (rfd && --(rfd->refcount) == 0)
-    close(rfd->fd);
+  ssize_t n;
+
+  do {
+    if (rw)
+      n = read(fd, conn->packet + conn->done, conn->len - conn->done);
+    else
+      n = write(fd, conn->packet + conn->done, conn->len - conn->done);
+  } while (n == -1 && errno == EINTR);
+  
+  if (n == 0)
+    return -1;
+
+  if (n == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  
+  conn->done += n;
+  
+  return conn->done == conn->len;
 }
 
-static void free_frec(struct frec *f)
+/* As above, for a message with a two-byte length prefix. */
+static int tcp_conn_read(int fd, struct tcp_conn *conn)
 {
-  free_rfd(f->rfd4);
-  f->rfd4 = NULL;
-  f->sentto = NULL;
-  f->flags = 0;
+  int rc;
+
+  while ((rc = tcp_conn_io(fd, conn, 1)) == 1 && conn->len == sizeof(u16))
+    {
+      size_t size = (conn->packet[0] << 8) | conn->packet[1];
+      
+      if (size == 0)
+	return -1;
+
+      conn->len += size;
+    }
   
-#ifdef HAVE_IPV6
-  free_rfd(f->rfd6);
-  f->rfd6 = NULL;
-#endif
+  return rc;
+}
 
-#ifdef HAVE_DNSSEC
-  if (f->stash)
+static void tcp_conn_answer(struct tcp_conn *conn, size_t m)
+{
+  /* Zero-length answer: give up on the connection. */
+  if (m == 0)
     {
-      blockdata_free(f->stash);
-      f->stash = NULL;
+      conn->state = 0;
+      return;
     }
 
-  /* Anything we're waiting on is pointless now, too */
-  if (f->blocking_query)
-    free_frec(f->blocking_query);
-  f->blocking_query = NULL;
-  f->dependent = NULL;
-#endif
+  conn->packet[0] = m >> 8;
+  conn->packet[1] = m & 0xff;
+  conn->len = m + sizeof(u16);
+  conn->done = 0;
+  conn->state = TCP_CONN_WRITE;
 }
 
-/* if wait==NULL return a free or older than TIMEOUT record.
-   else return *wait zero if one available, or *wait is delay to
-   when the oldest in-use record will expire. Impose an absolute
-   limit of 4*TIMEOUT before we wipe things (for random sockets).
-   If force is set, always return a result, even if we have
-   to allocate above the limit. */
-struct frec *get_new_frec(time_t now, int *wait, int force)
+/* No upstream answer, send SERVFAIL or REFUSED. */
+static void tcp_conn_fail(struct tcp_conn *conn, unsigned int flags)
 {
-  struct frec *f, *oldest, *target;
-  int count;
-  
-  if (wait)
-    *wait = 0;
+  tcp_conn_close_upstream(conn);
+  memcpy(conn->packet, conn->query, conn->query_len);
+  tcp_conn_answer(conn, setup_reply((struct dns_header *)&conn->packet[sizeof(u16)],
+				    conn->query_len - sizeof(u16), NULL, flags, daemon->local_ttl));
+}
 
-  for (f = daemon->frec_list, oldest = NULL, target =  NULL, count = 0; f; f = f->next, count++)
-    if (!f->sentto)
-      target = f;
-    else 
-      {
-#ifdef HAVE_DNSSEC
-	    /* Don't free DNSSEC sub-queries here, as we may end up with
-	       dangling references to them. They'll go when their "real" query 
-	       is freed. */
-	    if (!f->dependent)
-#endif
-	      {
-		if (difftime(now, f->time) >= 4*TIMEOUT)
-		  {
-		    free_frec(f);
-		    target = f;
-		  }
-	     
-	    
-		if (!oldest || difftime(f->time, oldest->time) <= 0)
-		  oldest = f;
-	      }
-      }
+/* Send the saved query to the next server which will take it, 
+   starting at conn->server, or at the same one again if again is set. */
+static void tcp_conn_forward(struct tcp_conn *conn, int again)
+{
+  struct server *serv;
 
-  if (target)
+  while (1)
     {
-      target->time = now;
-      return target;
-    }
-  
-  /* can't find empty one, use oldest if there is one
-     and it's older than timeout */
-  if (oldest && ((int)difftime(now, oldest->time)) >= TIMEOUT)
-    { 
-      /* keep stuff for twice timeout if we can by allocating a new
-	 record instead */
-      if (difftime(now, oldest->time) < 2*TIMEOUT && 
-	  count <= daemon->ftabsize &&
-	  (f = allocate_frec(now)))
-	return f;
-
-      if (!wait)
+      if (!conn->first)
+	conn->first = conn->server;
+      else if (again)
+	again = 0;
+      else
 	{
-	  free_frec(oldest);
-	  oldest->time = now;
+	  if (!(conn->server = conn->server->next))
+	    conn->server = daemon->servers;
+
+	  if (conn->server == conn->first)
+	    break;
 	}
-      return oldest;
-    }
-  
-  /* none available, calculate time 'till oldest record expires */
-  if (!force && count > daemon->ftabsize)
-    {
-      static time_t last_log = 0;
       
-      if (oldest && wait)
-	*wait = oldest->time + (time_t)TIMEOUT - now;
+      serv = conn->server;
       
-      if ((int)difftime(now, last_log) > 5)
+      /* server for wrong domain */
+      if (conn->type != (serv->flags & SERV_TYPE) ||
+	  (conn->type == SERV_HAS_DOMAIN && !hostname_isequal(conn->domain, serv->domain)) ||
+	  (serv->flags & (SERV_LITERAL_ADDRESS | SERV_LOOP)))
+	continue;
+
+      /* Re-use the connection for consecutive queries to the same server. */
+      if (conn->upserver == serv)
+	{
+	  conn->state = TCP_CONN_SEND;
+	  conn->reused = 1;
+	}
+      else
 	{
-	  last_log = now;
-	  my_syslog(LOG_WARNING, _("Maximum number of concurrent DNS queries reached (max: %d)"), daemon->ftabsize);
+	  tcp_conn_close_upstream(conn);
+	  conn->reused = 0;
+	  
+	  if ((conn->upfd = socket(serv->addr.sa.sa_family, SOCK_STREAM, 0)) == -1)
+	    continue;
+	  
+#ifdef HAVE_CONNTRACK
+	  /* Copy connection mark of incoming query to outgoing connection. */
+	  if (option_bool(OPT_CONNTRACK))
+	    {
+	      unsigned int mark;
+	      struct all_addr local;
+#ifdef HAVE_IPV6		      
+	      if (conn->local.sa.sa_family == AF_INET6)
+		local.addr.addr6 = conn->local.in6.sin6_addr;
+	      else
+#endif
+		local.addr.addr4 = conn->local.in.sin_addr;
+	      
+	      if (get_incoming_mark(&conn->peer, &local, 1, &mark))
+		setsockopt(conn->upfd, SOL_SOCKET, SO_MARK, &mark, sizeof(unsigned int));
+	    }
+#endif	
+
+	  if (!fix_fd(conn->upfd) ||
+	      !local_bind(conn->upfd, &serv->source_addr, serv->interface, 1) ||
+	      (connect(conn->upfd, &serv->addr.sa, sa_len(&serv->addr)) == -1 && errno != EINPROGRESS))
+	    {
+	      tcp_conn_close_upstream(conn);
+	      continue;
+	    }
+	  
+	  conn->upserver = serv;
+	  conn->state = TCP_CONN_CONNECT;
 	}
 
-      return NULL;
+      /* get query name again for logging */
+      memcpy(conn->packet, conn->query, conn->query_len);
+      if (!extract_request((struct dns_header *)&conn->packet[sizeof(u16)], 
+			   (unsigned int)(conn->query_len - sizeof(u16)), daemon->namebuff, NULL))
+	strcpy(daemon->namebuff, "query");
+
+      daemon->log_display_id = conn->log_id;
+      daemon->log_source_addr = &conn->peer;
+      if (serv->addr.sa.sa_family == AF_INET)
+	log_query(F_SERVER | F_IPV4 | F_FORWARD, daemon->namebuff, 
+		  (struct all_addr *)&serv->addr.in.sin_addr, NULL); 
+#ifdef HAVE_IPV6
+      else
+	log_query(F_SERVER | F_IPV6 | F_FORWARD, daemon->namebuff, 
+		  (struct all_addr *)&serv->addr.in6.sin6_addr, NULL);
+#endif 
+      
+      serv->queries++;
+      conn->len = conn->query_len;
+      conn->done = 0;
+      return;
     }
   
-  if (!(f = allocate_frec(now)) && wait)
-    /* wait one second on malloc failure */
-    *wait = 1;
-
-  return f; /* OK if malloc fails and this is NULL */
+  /* Nowhere to send it. */
+  tcp_conn_fail(conn, 0);
 }
- 
-/* crc is all-ones if not known. */
-static struct frec *lookup_frec(unsigned short id, void *hash)
+
+/* A complete query has been read into the packet. */
+static void tcp_conn_query(struct tcp_conn *conn, time_t now)
 {
-  struct frec *f;
+  struct dns_header *header = (struct dns_header *)&conn->packet[sizeof(u16)];
+  size_t size = conn->len - sizeof(u16), m;
+  unsigned short qtype;
+  unsigned int gotname, flags = 0;
+  int auth_dns = conn->auth_dns, have_pseudoheader = 0;
+#ifdef HAVE_AUTH
+  int local_auth = 0;
+#endif
+  struct all_addr *addrp = NULL;
+  struct in_addr dst_addr_4;
+  unsigned char *pheader;
 
-  for(f = daemon->frec_list; f; f = f->next)
-    if (f->sentto && f->new_id == id && 
-	(!hash || memcmp(hash, f->hash, HASH_SIZE) == 0))
-      return f;
-      
-  return NULL;
-}
+  if (size < sizeof(struct dns_header))
+    {
+      conn->len = sizeof(u16);
+      conn->done = 0;
+      return;
+    }
+  
+  conn->query_count++;
 
-static struct frec *lookup_frec_by_sender(unsigned short id,
-					  union mysockaddr *addr,
-					  void *hash)
-{
-  struct frec *f;
+  /* log_query gets called indirectly all over the place, so 
+     pass these in global variables - sorry. */
+  daemon->log_display_id = conn->log_id = ++daemon->log_id;
+  daemon->log_source_addr = &conn->peer;
+
+  conn->checking_disabled = header->hb4 & HB4_CD;
+  conn->check_subnet = conn->added_pheader = conn->do_bit = 0;
   
-  for(f = daemon->frec_list; f; f = f->next)
-    if (f->sentto &&
-	f->orig_id == id && 
-	memcmp(hash, f->hash, HASH_SIZE) == 0 &&
-	sockaddr_isequal(&f->source, addr))
-      return f;
-   
-  return NULL;
-}
- 
-/* Send query packet again, if we can. */
-void resend_query()
-{
-  if (daemon->srv_save)
+  if ((gotname = extract_request(header, (unsigned int)size, daemon->namebuff, &qtype)))
     {
-      int fd;
+#ifdef HAVE_AUTH
+      struct auth_zone *zone;
+#endif
+      char *types = querystr(auth_dns ? "auth" : "query", qtype);
       
-      if (daemon->srv_save->sfd)
-	fd = daemon->srv_save->sfd->fd;
-      else if (daemon->rfd_save && daemon->rfd_save->refcount != 0)
-	fd = daemon->rfd_save->fd;
+      if (conn->peer.sa.sa_family == AF_INET) 
+	log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff, 
+		  (struct all_addr *)&conn->peer.in.sin_addr, types);
+#ifdef HAVE_IPV6
       else
-	return;
+	log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff, 
+		  (struct all_addr *)&conn->peer.in6.sin6_addr, types);
+#endif
       
-      while(retry_send(sendto(fd, daemon->packet, daemon->packet_len, 0,
-			      &daemon->srv_save->addr.sa, 
-			      sa_len(&daemon->srv_save->addr)))); 
+#ifdef HAVE_AUTH
+      /* find queries for zones we're authoritative for, and answer them directly */
+      if (!auth_dns && !option_bool(OPT_LOCALISE))
+	for (zone = daemon->auth_zones; zone; zone = zone->next)
+	  if (in_zone(zone, daemon->namebuff, NULL))
+	    {
+	      auth_dns = 1;
+	      local_auth = 1;
+	      break;
+	    }
+#endif
     }
-}
-
-/* A server record is going away, remove references to it */
-void server_gone(struct server *server)
-{
-  struct frec *f;
   
-  for (f = daemon->frec_list; f; f = f->next)
-    if (f->sentto && f->sentto == server)
-      free_frec(f);
+  if (conn->local.sa.sa_family == AF_INET)
+    dst_addr_4 = conn->local.in.sin_addr;
+  else
+    dst_addr_4.s_addr = 0;
   
-  if (daemon->last_server == server)
-    daemon->last_server = NULL;
+  if (find_pseudoheader(header, size, NULL, &pheader, NULL))
+    { 
+      unsigned short edns_flags;
+      
+      have_pseudoheader = 1;
+      pheader += 4; /* udp_size, ext_rcode */
+      GETSHORT(edns_flags, pheader);
+      
+      if (edns_flags & 0x8000)
+	conn->do_bit = 1;/* do bit */ 
+    }
+  
+#ifdef HAVE_AUTH
+  if (auth_dns)
+    m = answer_auth(header, ((char *) header) + 65536, size, now, &conn->peer, 
+		    local_auth, conn->do_bit, have_pseudoheader);
+  else
+#endif
+    {
+      /* RFC 6840 5.7 */
+      conn->ad_reqd = conn->do_bit || (header->hb4 & HB4_AD);
+      
+      /* m > 0 if answered from cache */
+      m = answer_request(header, ((char *) header) + 65536, size, 
+			 dst_addr_4, conn->netmask, now, conn->ad_reqd, conn->do_bit, have_pseudoheader, NULL);
+      
+      if (m == 0)
+	{
+	  if (option_bool(OPT_ADD_MAC))
+	    size = add_mac(header, size, ((char *) header) + 65536, &conn->peer);
+	  
+	  if (option_bool(OPT_CLIENT_SUBNET))
+	    {
+	      size_t new = add_source_addr(header, size, ((char *) header) + 65536, &conn->peer);
+	      if (size != new)
+		{
+		  size = new;
+		  conn->check_subnet = 1;
+		}
+	    }
+	  
+	  conn->type = conn->norebind = 0;
+	  conn->domain = NULL;
+	  if (gotname)
+	    flags = search_servers(now, &addrp, gotname, daemon->namebuff, &conn->type, &conn->domain, &conn->norebind);
+	  
+	  if (conn->type != 0 || option_bool(OPT_ORDER) || !daemon->last_server)
+	    conn->server = daemon->servers;
+	  else
+	    conn->server = daemon->last_server;
+
+	  if (!flags && conn->server)
+	    {
+#ifdef HAVE_DNSSEC
+	      unsigned char *hash = hash_questions(header, (unsigned int)size, daemon->namebuff);
+	      if (hash)
+		memcpy(conn->hash, hash, HASH_SIZE);
+	      else
+		memset(conn->hash, 0, HASH_SIZE);
+#else
+	      unsigned int crc = questions_crc(header, (unsigned int)size, daemon->namebuff);
+	      memcpy(conn->hash, &crc, HASH_SIZE);
+#endif
+	      /* Keep the query, the packet buffer is needed for the reply. */
+	      free(conn->query);
+	      if (!(conn->query = whine_malloc(size + sizeof(u16))))
+		flags = F_NEG;
+	      else
+		{
+		  conn->packet[0] = size >> 8;
+		  conn->packet[1] = size & 0xff;
+		  conn->query_len = size + sizeof(u16);
+		  memcpy(conn->query, conn->packet, conn->query_len);
+		  conn->first = NULL;
+		  tcp_conn_forward(conn, 0);
+		  return;
+		}
+	    }
+	  
+	  /* In case of local answer or no server. */
+	  m = setup_reply(header, (unsigned int)size, addrp, flags, daemon->local_ttl);
+	}
+    }
+
+  tcp_conn_answer(conn, m);
+}
+
+/* The upstream reply is in the packet. */
+static void tcp_conn_reply(struct tcp_conn *conn, time_t now)
+{
+  struct dns_header *header = (struct dns_header *)&conn->packet[sizeof(u16)];
+  size_t m = conn->len - sizeof(u16);
+#ifdef HAVE_DNSSEC
+  unsigned char *hash = hash_questions(header, (unsigned int)m, daemon->namebuff);
+#else
+  unsigned int crc = questions_crc(header, (unsigned int)m, daemon->namebuff);
+  unsigned char *hash = (unsigned char *)&crc;
+#endif
+  
+  daemon->log_display_id = conn->log_id;
+  daemon->log_source_addr = &conn->peer;
+  
+  /* If the question section doesn't match the one we sent, then
+     someone might be attempting to insert bogus values into the cache by 
+     sending replies containing questions and bogus answers. */
+  if (!hash || memcmp(hash, conn->hash, HASH_SIZE) != 0)
+    m = 0;
+  else
+    {
+      /* restore CD bit to the value in the query */
+      if (conn->checking_disabled)
+	header->hb4 |= HB4_CD;
+      else
+	header->hb4 &= ~HB4_CD;
+      
+      m = process_reply(header, now, conn->server, m, 
+			option_bool(OPT_NO_REBIND) && !conn->norebind, conn->checking_disabled, 0, 0,
+			conn->ad_reqd, conn->do_bit, conn->added_pheader, conn->check_subnet, &conn->peer); 
+    }
+  
+  if (m == 0)
+    tcp_conn_fail(conn, F_NEG);
+  else
+    tcp_conn_answer(conn, m);
+}
+
+/* Upstream connection failed, try the next server. If it was a pooled
+   connection which died (the server may have closed it whilst idle), try
+   once more on a new connection to the same server first. */
+static void tcp_conn_retry(struct tcp_conn *conn, int dead)
+{
+  int again = dead && conn->reused;
+
+  tcp_conn_close_upstream(conn);
+  conn->reused = 0;
+  tcp_conn_forward(conn, again);
+}
+
+static void tcp_conn_event(struct tcp_conn *conn, time_t now)
+{
+  int rc, err;
+  socklen_t len = sizeof(err);
+  
+  switch (conn->state)
+    {
+    case TCP_CONN_READ:
+      if ((rc = tcp_conn_read(conn->fd, conn)) == -1)
+	conn->state = 0;
+      else if (rc == 1)
+	tcp_conn_query(conn, now);
+      break;
+
+    case TCP_CONN_CONNECT:
+      if (getsockopt(conn->upfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+	{
+	  tcp_conn_retry(conn, 0);
+	  break;
+	}
+      conn->state = TCP_CONN_SEND;
+      /* fall through */
+
+    case TCP_CONN_SEND:
+      if ((rc = tcp_conn_io(conn->upfd, conn, 0)) == -1)
+	tcp_conn_retry(conn, 1);
+      else if (rc == 1)
+	{
+	  conn->state = TCP_CONN_REPLY;
+	  conn->len = sizeof(u16);
+	  conn->done = 0;
+	}
+      break;
+
+    case TCP_CONN_REPLY:
+      if ((rc = tcp_conn_read(conn->upfd, conn)) == -1)
+	tcp_conn_retry(conn, 1);
+      else if (rc == 1)
+	tcp_conn_reply(conn, now);
+      break;
+
+    case TCP_CONN_WRITE:
+      if ((rc = tcp_conn_io(conn->fd, conn, 0)) == -1 ||
+	  (rc == 1 && conn->query_count == TCP_MAX_QUERIES))
+	conn->state = 0;
+      else if (rc == 1)
+	{
+	  conn->state = TCP_CONN_READ;
+	  conn->len = sizeof(u16);
+	  conn->done = 0;
+	}
+      break;
+    }
+}
+
+static int tcp_conn_fd(struct tcp_conn *conn, short *event)
+{
+  switch (conn->state)
+    {
+    case TCP_CONN_READ:
+      *event = POLLIN;
+      return conn->fd;
+    case TCP_CONN_WRITE:
+      *event = POLLOUT;
+      return conn->fd;
+    case TCP_CONN_REPLY:
+      *event = POLLIN;
+      return conn->upfd;
+    default:
+      *event = POLLOUT;
+      return conn->upfd;
+    }
+}
+
+void set_tcp_conn_listeners(void)
+{
+  struct tcp_conn *conn;
+  short event;
+  int fd;
+
+  for (conn = daemon->tcp_conns; conn; conn = conn->next)
+    {
+      fd = tcp_conn_fd(conn, &event);
+      poll_listen(fd, event);
+    }
+}
+
+void check_tcp_conns(time_t now)
+{
+  struct tcp_conn *conn, *tmp;
+  short event;
+  int fd;
+  
+  for (conn = daemon->tcp_conns; conn; conn = tmp)
+    {
+      tmp = conn->next;
+      fd = tcp_conn_fd(conn, &event);
+      
+      if (poll_check(fd, event | POLLERR | POLLHUP))
+	{
+	  conn->time = now;
+	  tcp_conn_event(conn, now);
+	}
+      else if (difftime(now, conn->start) > CHILD_LIFETIME)
+	conn->state = 0;
+      else if (difftime(now, conn->time) > TIMEOUT)
+	{
+	  conn->time = now;
+	  /* Slow server, try another. Slow client, drop it. */
+	  if (conn->state == TCP_CONN_READ || conn->state == TCP_CONN_WRITE)
+	    conn->state = 0;
+	  else
+	    tcp_conn_retry(conn, 0);
+	}
+      
+      if (conn->state == 0)
+	tcp_conn_free(conn);
+    }
+}
+
+static struct frec *allocate_frec(time_t now)
+{
+  struct frec *f;
+  
+  if (!frec_id_hash)
+    {
+      int i;
+      
+      for (frec_hash_size = 64; frec_hash_size < daemon->ftabsize; frec_hash_size = frec_hash_size << 1);
+      frec_id_hash = safe_malloc(frec_hash_size * sizeof(struct frec *));
+      frec_sender_hash = safe_malloc(frec_hash_size * sizeof(struct frec *));
+      frec_query_hash = safe_malloc(frec_hash_size * sizeof(struct frec *));
+      for (i = 0; i < frec_hash_size; i++)
+	frec_id_hash[i] = frec_sender_hash[i] = frec_query_hash[i] = NULL;
+    }
+
+  if ((f = (struct frec *)whine_malloc(sizeof(struct frec))))
+    {
+      f->next = daemon->frec_list;
+      f->queue_prev = NULL;
+      f->queue_next = frec_free;
+      frec_free = f;
+      frec_free_count++;
+      frec_count++;
+      f->time = now;
+      f->sentto = NULL;
+      f->rfd4 = NULL;
+      f->extra_src = NULL;
+      f->hedge_at.tv_sec = 0;
+      f->hedge_packet = NULL;
+      f->hedge_size = 0;
+      f->stale_at.tv_sec = 0;
+      f->stale_query = NULL;
+      f->stale_size = 0;
+      f->flags = 0;
+#ifdef HAVE_IPV6
+      f->rfd6 = NULL;
+#endif
+#ifdef HAVE_DNSSEC
+      f->dependent = NULL;
+      f->blocking_query = NULL;
+      f->stash = NULL;
+#endif
+      daemon->frec_list = f;
+    }
+
+  return f;
+}
+
+struct randfd *allocate_rfd(int family)
+{
+  static int finger = 0;
+  int i;
+
+  /* limit the number of sockets we have open to avoid starvation of 
+     (eg) TFTP. Once we have a reasonable number, randomness should be OK */
+
+  for (i = 0; i < RANDOM_SOCKS; i++)
+    if (daemon->randomsocks[i].refcount == 0)
+      {
+	if ((daemon->randomsocks[i].fd = random_sock(family)) == -1)
+	  break;
+      
+	daemon->randomsocks[i].refcount = 1;
+	daemon->randomsocks[i].family = family;
+	return &daemon->randomsocks[i];
+      }
+
+  /* No free ones or cannot get new socket, grab an existing one */
+  for (i = 0; i < RANDOM_SOCKS; i++)
+    {
+      int j = (i+finger) % RANDOM_SOCKS;
+      if (daemon->randomsocks[j].refcount != 0 &&
+	  daemon->randomsocks[j].family == family && 
+	  daemon->randomsocks[j].refcount != 0xffff)
+	{
+	  finger = j;
+	  daemon->randomsocks[j].refcount++;
+	  return &daemon->randomsocks[j];
+	}
+    }
+
+  return NULL; /* doom */
+}
+
+void free_rfd(struct randfd *rfd)
+{
+  if (rfd && --(rfd->refcount) == 0)
+    {
+      poll_remove(rfd->fd);
+      close(rfd->fd);
+    }
+}
+
+static int frec_queued(struct frec *f)
+{
+  return f->queue_prev || frec_queue_head == f;
+}
+
+static void frec_enqueue(struct frec *f)
+{
+  f->queue_next = NULL;
+  if ((f->queue_prev = frec_queue_tail))
+    frec_queue_tail->queue_next = f;
+  else
+    frec_queue_head = f;
+  frec_queue_tail = f;
+}
+
+static void frec_dequeue(struct frec *f)
+{
+  if (!frec_queued(f))
+    return;
+  
+  if (f->queue_prev)
+    f->queue_prev->queue_next = f->queue_next;
+  else
+    frec_queue_head = f->queue_next;
+  
+  if (f->queue_next)
+    f->queue_next->queue_prev = f->queue_prev;
+  else
+    frec_queue_tail = f->queue_prev;
+
+  f->queue_prev = f->queue_next = NULL;
+}
+
+static void free_frec(struct frec *f)
+{
+  /* Already on the free list. */
+  if (!f->sentto && !frec_queued(f))
+    return;
+  
+  frec_dequeue(f);
+  f->queue_next = frec_free;
+  frec_free = f;
+  frec_free_count++;
+  
+  frec_src_release(f);
+  frec_unlink(f);
+  hedge_unlink(f);
+  stale_unlink(f);
+  free_rfd(f->rfd4);
+  f->rfd4 = NULL;
+  f->sentto = NULL;
+  f->flags = 0;
+  
+#ifdef HAVE_IPV6
+  free_rfd(f->rfd6);
+  f->rfd6 = NULL;
+#endif
+
+#ifdef HAVE_DNSSEC
+  if (f->stash)
+    {
+      blockdata_free(f->stash);
+      f->stash = NULL;
+    }
+
+  /* Anything we're waiting on is pointless now, too */
+  if (f->blocking_query)
+    free_frec(f->blocking_query);
+  f->blocking_query = NULL;
+  f->dependent = NULL;
+#endif
+}
+
+static void hedge_unlink(struct frec *f)
+{
+  if (f->hedge_at.tv_sec == 0)
+    return;
+
+  if (f->hedge_prev)
+    f->hedge_prev->hedge_next = f->hedge_next;
+  else
+    hedge_head = f->hedge_next;
+
+  if (f->hedge_next)
+    f->hedge_next->hedge_prev = f->hedge_prev;
+  else
+    hedge_tail = f->hedge_prev;
+
+  f->hedge_at.tv_sec = 0;
+  f->hedge_prev = f->hedge_next = NULL;
+}
+
+static int hedge_before(struct timeval *a, struct timeval *b)
+{
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Keep a copy of the query just sent, and arrange to send it to another
+   server if the answer takes longer than the round trip time plus four
+   times its variation, which few answers do. */
+static void hedge_arm(struct frec *f, struct dns_header *header, size_t plen)
+{
+  struct server *serv = f->sentto;
+  struct frec *p;
+  long delay;
+
+  hedge_unlink(f);
+
+  if (f->hedge_size < plen)
+    {
+      unsigned char *new = whine_malloc(plen);
+
+      if (!new)
+	return;
+      free(f->hedge_packet);
+      f->hedge_packet = new;
+      f->hedge_size = plen;
+    }
+
+  memcpy(f->hedge_packet, header, plen);
+  f->hedge_len = plen;
+
+  /* Not timed yet, assume the worst. */
+  delay = serv->srtt ? serv->srtt + 4L * serv->rttvar : HEDGE_MAX * 1000L;
+  if (delay < HEDGE_MIN * 1000L)
+    delay = HEDGE_MIN * 1000L;
+  else if (delay > HEDGE_MAX * 1000L)
+    delay = HEDGE_MAX * 1000L;
+
+  gettimeofday(&f->hedge_at, NULL);
+  f->hedge_at.tv_usec += delay;
+  f->hedge_at.tv_sec += f->hedge_at.tv_usec / 1000000;
+  f->hedge_at.tv_usec %= 1000000;
+
+  /* Deadlines mostly arrive in order, so search from the end. */
+  for (p = hedge_tail; p && hedge_before(&f->hedge_at, &p->hedge_at); p = p->hedge_prev);
+  
+  f->hedge_prev = p;
+  if (p)
+    {
+      f->hedge_next = p->hedge_next;
+      p->hedge_next = f;
+    }
+  else
+    {
+      f->hedge_next = hedge_head;
+      hedge_head = f;
+    }
+
+  if (f->hedge_next)
+    f->hedge_next->hedge_prev = f;
+  else
+    hedge_tail = f;
+}
+
+/* Milliseconds until a query is due to go to another server, -1 if none. */
+int hedge_timeout(void)
+{
+  struct timeval now;
+  long usec;
+
+  if (!hedge_head)
+    return -1;
+
+  gettimeofday(&now, NULL);
+  usec = (hedge_head->hedge_at.tv_sec - now.tv_sec) * 1000000L + (hedge_head->hedge_at.tv_usec - now.tv_usec);
+  
+  if (usec <= 0)
+    return 0;
+
+  /* Clock gone backwards, don't sleep for long. */
+  if (usec > HEDGE_MAX * 1000L)
+    return HEDGE_MAX;
+
+  return (int)((usec + 999) / 1000);
+}
+
+/* Called from the main loop: send queries which have waited too long to 
+   another server. Either answer will do. Each query is only hedged once. */
+void hedge_queries(void)
+{
+  struct timeval tv;
+  struct frec *f;
+
+  gettimeofday(&tv, NULL);
+
+  while ((f = hedge_head) && !hedge_before(&tv, &f->hedge_at))
+    {
+      struct server *start, *serv = f->sentto;
+      int type = serv->flags & SERV_TYPE, fd, rtt;
+      
+      hedge_unlink(f);
+
+      /* retried by the client meanwhile, and sent to all servers. */
+      if (f->forwardall)
+	continue;
+
+      /* At least this slow, and we can't tell which send any reply answers. */
+      if (f->sent.tv_sec != 0 && (rtt = rtt_since(&f->sent)) != -1)
+	server_rtt(serv, rtt);
+      f->sent.tv_sec = 0;
+
+      if (type == 0)
+	{
+	  /* Fastest of the others. */
+	  struct server *s;
+	  
+	  for (start = NULL, s = default_servers(); s; s = s->domain_next)
+	    if (s != serv && !(s->flags & SERV_LOOP) && !sockaddr_isequal(&s->addr, &serv->addr) &&
+		(!start || s->srtt < start->srtt || (s->srtt == start->srtt && s->serial < start->serial)))
+	      start = s;
+	}
+      else
+	{
+	  /* Next in order, as forward_query() does. */
+	  for (start = serv->next ? serv->next : daemon->servers; 
+	       start != serv;
+	       start = start->next ? start->next : daemon->servers)
+	    if ((start->flags & SERV_TYPE) == type &&
+		(type != SERV_HAS_DOMAIN || hostname_isequal(serv->domain, start->domain)) &&
+		!(start->flags & (SERV_LITERAL_ADDRESS | SERV_LOOP)) &&
+		!sockaddr_isequal(&start->addr, &serv->addr))
+	      break;
+
+	  if (start == serv)
+	    start = NULL;
+	}
+      
+      if (!start)
+	continue;
+
+      if (start->sfd)
+	fd = start->sfd->fd;
+#ifdef HAVE_IPV6
+      else if (start->addr.sa.sa_family == AF_INET6)
+	{
+	  if (!f->rfd6 && !(f->rfd6 = allocate_rfd(AF_INET6)))
+	    continue;
+	  fd = f->rfd6->fd;
+	}
+#endif
+      else
+	{
+	  if (!f->rfd4 && !(f->rfd4 = allocate_rfd(AF_INET)))
+	    continue;
+	  fd = f->rfd4->fd;
+	}
+      
+      while (retry_send(sendto(fd, (char *)f->hedge_packet, f->hedge_len, 0, &start->addr.sa, sa_len(&start->addr))));
+      
+      if (errno == 0)
+	{
+	  start->queries++;
+	  f->sentto = start;
+	}
+    }
+}
+
+static void frec_src_release(struct frec *f)
+{
+  struct frec_src *last;
+
+  if (!f->extra_src)
+    return;
+
+  for (last = f->extra_src; last->next; last = last->next);
+  last->next = frec_src_free;
+  frec_src_free = f->extra_src;
+  f->extra_src = NULL;
+}
+
+static void stale_unlink(struct frec *f)
+{
+  if (f->stale_at.tv_sec == 0)
+    return;
+
+  if (f->stale_prev)
+    f->stale_prev->stale_next = f->stale_next;
+  else
+    stale_head = f->stale_next;
+
+  if (f->stale_next)
+    f->stale_next->stale_prev = f->stale_prev;
+  else
+    stale_tail = f->stale_prev;
+
+  f->stale_at.tv_sec = 0;
+  f->stale_prev = f->stale_next = NULL;
+}
+
+/* Keep a copy of the query from a client, to answer it from expired
+   cache entries if upstream takes too long. The wait is always the same,
+   so the new deadline is the latest. */
+static void stale_arm(struct frec *f, struct dns_header *header, size_t plen)
+{
+  if (f->stale_size < plen)
+    {
+      unsigned char *new = whine_malloc(plen);
+
+      if (!new)
+	return;
+      free(f->stale_query);
+      f->stale_query = new;
+      f->stale_size = plen;
+    }
+
+  memcpy(f->stale_query, header, plen);
+  f->stale_len = plen;
+
+  gettimeofday(&f->stale_at, NULL);
+  f->stale_at.tv_usec += daemon->stale_wait * 1000L;
+  f->stale_at.tv_sec += f->stale_at.tv_usec / 1000000;
+  f->stale_at.tv_usec %= 1000000;
+
+  f->stale_next = NULL;
+  if ((f->stale_prev = stale_tail))
+    stale_tail->stale_next = f;
+  else
+    stale_head = f;
+  stale_tail = f;
+}
+
+/* Answer a query from the cache, allowing expired entries. The answer
+   is left in stale_packet, returns zero if there's nothing for it. */
+static size_t stale_reply(struct dns_header *query, size_t plen, time_t now, int ad_reqd, int do_bit)
+{
+  struct dns_header *header;
+  unsigned short udp_size = PACKETSZ;
+  unsigned char *pheader;
+  struct in_addr no_addr;
+  int have_pseudoheader = 0;
+  size_t m;
+
+  if (!stale_packet && !(stale_packet = whine_malloc(daemon->packet_buff_sz)))
+    return 0;
+
+  header = (struct dns_header *)stale_packet;
+  memcpy(header, query, plen);
+
+  if (find_pseudoheader(header, plen, NULL, &pheader, NULL))
+    {
+      have_pseudoheader = 1;
+      GETSHORT(udp_size, pheader);
+      if (udp_size > daemon->edns_pktsz)
+	udp_size = daemon->edns_pktsz;
+    }
+
+  /* no --localise-queries */
+  no_addr.s_addr = 0;
+
+  cache_serve_stale(1);
+  m = answer_request(header, ((char *) header) + udp_size, plen, 
+		     no_addr, no_addr, now, ad_reqd, do_bit, have_pseudoheader, NULL);
+  cache_serve_stale(0);
+
+  return m;
+}
+
+/* Send the clients waiting on a query an answer from expired data, if
+   there is any. The query stays in flight, so that a reply still
+   refreshes the cache, but only for the cache: the clients have gone. */
+static int stale_answer(struct frec *f, time_t now)
+{
+  struct dns_header *header;
+  struct frec_src *src;
+  unsigned char *p;
+  size_t m, qlen;
+
+  stale_unlink(f);
+
+  if (!f->stale_query || (f->fd == -1 && !f->extra_src))
+    return 0;
+
+  daemon->log_display_id = f->log_id;
+  daemon->log_source_addr = &f->source;
+
+  if (!(m = stale_reply((struct dns_header *)f->stale_query, f->stale_len, now, 
+			f->flags & FREC_AD_QUESTION, f->flags & FREC_DO_QUESTION)))
+    return 0;
+
+  header = (struct dns_header *)stale_packet;
+
+  p = skip_questions(header, m);
+  qlen = p ? (size_t)(p - (unsigned char *)(header+1)) : 0;
+
+  if (f->fd != -1)
+    {
+      header->id = htons(f->orig_id);
+      send_from(f->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)stale_packet, m, 
+		&f->source, &f->dest, f->iface);
+      f->fd = -1;
+    }
+  
+  for (src = f->extra_src; src; src = src->next)
+    if (src->qlen == qlen && question_isequal(src->question, (unsigned char *)(header+1), qlen))
+      {
+	memcpy(header+1, src->question, qlen);
+	header->id = htons(src->orig_id);
+	send_from(src->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)stale_packet, m, 
+		  &src->source, &src->dest, src->iface);
+      }
+  
+  frec_src_release(f);
+  
+  return 1;
+}
+
+/* Milliseconds until a client is due an answer from expired data, -1 if none. */
+int stale_timeout(void)
+{
+  struct timeval now;
+  long usec;
+
+  if (!stale_head)
+    return -1;
+
+  gettimeofday(&now, NULL);
+  usec = (stale_head->stale_at.tv_sec - now.tv_sec) * 1000000L + (stale_head->stale_at.tv_usec - now.tv_usec);
+  
+  if (usec <= 0)
+    return 0;
+
+  /* Clock gone backwards, don't sleep for long. */
+  if (usec > daemon->stale_wait * 1000L)
+    return daemon->stale_wait;
+
+  return (int)((usec + 999) / 1000);
+}
+
+/* Called from the main loop: with --serve-stale, answer clients which have
+   waited too long for upstream from expired data. */
+void stale_queries(time_t now)
+{
+  struct timeval tv;
+  struct frec *f;
+
+  gettimeofday(&tv, NULL);
+
+  while ((f = stale_head) && !hedge_before(&tv, &f->stale_at))
+    stale_answer(f, now);
+}
+
+/* if wait==NULL return a free or older than TIMEOUT record.
+   else return *wait zero if one available, or *wait is delay to
+   when the oldest in-use record will expire. Impose an absolute
+   limit of 4*TIMEOUT before we wipe things (for random sockets).
+   If force is set, always return a result, even if we have
+   to allocate above the limit. */
+struct frec *get_new_frec(time_t now, int *wait, int force)
+{
+  struct frec *f, *oldest;
+  
+  if (wait)
+    *wait = 0;
+
+  /* The queue is in order of age, so only its head can be past the limit. */
+  while ((oldest = frec_queue_head) && difftime(now, oldest->time) >= 4*TIMEOUT)
+    free_frec(oldest);
+
+  if (!frec_free)
+    {
+      /* can't find empty one, use oldest if there is one
+	 and it's older than timeout */
+      if (oldest && ((int)difftime(now, oldest->time)) >= TIMEOUT)
+	{ 
+	  /* keep stuff for twice timeout if we can by allocating a new
+	     record instead */
+	  if (difftime(now, oldest->time) >= 2*TIMEOUT || 
+	      frec_count > daemon->ftabsize ||
+	      !allocate_frec(now))
+	    {
+	      if (wait)
+		return oldest;
+	      free_frec(oldest);
+	    }
+	}
+      else if (!force && frec_count > daemon->ftabsize)
+	{
+	  /* none available, calculate time 'till oldest record expires */
+	  static time_t last_log = 0;
+	  
+	  if (oldest && wait)
+	    *wait = oldest->time + (time_t)TIMEOUT - now;
+	  
+	  if ((int)difftime(now, last_log) > 5)
+	    {
+	      last_log = now;
+	      my_syslog(LOG_WARNING, _("Maximum number of concurrent DNS queries reached (max: %d)"), daemon->ftabsize);
+	    }
+	  
+	  return NULL;
+	}
+      else if (!allocate_frec(now))
+	{
+	  /* wait one second on malloc failure */
+	  if (wait)
+	    *wait = 1;
+	  return NULL;
+	}
+    }
+
+  f = frec_free;
+  
+  /* Just checking that we can get one, leave it free. */
+  if (!wait)
+    {
+      frec_free = f->queue_next;
+      frec_free_count--;
+      f->time = now;
+      frec_enqueue(f);
+    }
+  
+  return f;
+}
+ 
+/* Number of queries which could be forwarded now without waiting. */
+static int frec_spare(void)
+{
+  int spare = frec_free_count;
+  
+  if (frec_count <= daemon->ftabsize)
+    spare += daemon->ftabsize + 1 - frec_count;
+  
+  return spare;
+}
+
+static struct frec **frec_id_bucket(unsigned short id)
+{
+  /* new_id is random, so the low bits will do. */
+  return frec_id_hash + (id & (frec_hash_size - 1));
+}
+
+static struct frec **frec_sender_bucket(unsigned short id, union mysockaddr *addr, void *hash)
+{
+  unsigned int i, val = id;
+  unsigned char *p = hash;
+
+  for (i = 0; i < HASH_SIZE; i++)
+    val = (val * 31) + p[i];
+
+#ifdef HAVE_IPV6
+  if (addr->sa.sa_family == AF_INET6)
+    {
+      p = addr->in6.sin6_addr.s6_addr;
+      for (i = 0; i < IN6ADDRSZ; i++)
+	val = (val * 31) + p[i];
+      val ^= addr->in6.sin6_port;
+    }
+  else
+#endif
+    val ^= addr->in.sin_addr.s_addr ^ addr->in.sin_port;
+
+  return frec_sender_hash + ((val ^ (val >> 16)) & (frec_hash_size - 1));
+}
+
+static struct frec **frec_query_bucket(void *hash)
+{
+  unsigned int i, val = 0;
+  unsigned char *p = hash;
+
+  for (i = 0; i < HASH_SIZE; i++)
+    val = (val * 31) + p[i];
+
+  return frec_query_hash + ((val ^ (val >> 16)) & (frec_hash_size - 1));
+}
+
+/* Call once new_id, orig_id, source and hash are set. */
+static void frec_link(struct frec *f)
+{
+  struct frec **up = frec_id_bucket(f->new_id);
+
+  f->id_next = *up;
+  *up = f;
+
+  up = frec_sender_bucket(f->orig_id, &f->source, f->hash);
+  f->sender_next = *up;
+  *up = f;
+
+  up = frec_query_bucket(f->hash);
+  f->query_next = *up;
+  *up = f;
+  
+  f->flags |= FREC_HASHED;
+}
+
+static void frec_unlink(struct frec *f)
+{
+  struct frec **up;
+
+  if (!(f->flags & FREC_HASHED))
+    return;
+
+  for (up = frec_id_bucket(f->new_id); *up; up = &((*up)->id_next))
+    if (*up == f)
+      {
+	*up = f->id_next;
+	break;
+      }
+  
+  for (up = frec_sender_bucket(f->orig_id, &f->source, f->hash); *up; up = &((*up)->sender_next))
+    if (*up == f)
+      {
+	*up = f->sender_next;
+	break;
+      }
+
+  for (up = frec_query_bucket(f->hash); *up; up = &((*up)->query_next))
+    if (*up == f)
+      {
+	*up = f->query_next;
+	break;
+      }
+
+  f->flags &= ~FREC_HASHED;
+}
+
+/* crc is all-ones if not known. */
+static struct frec *lookup_frec(unsigned short id, void *hash)
+{
+  struct frec *f;
+
+  if (!frec_id_hash)
+    return NULL;
+
+  for (f = *frec_id_bucket(id); f; f = f->id_next)
+    if (f->sentto && f->new_id == id && 
+	(!hash || memcmp(hash, f->hash, HASH_SIZE) == 0))
+      return f;
+      
+  return NULL;
+}
+
+static struct frec *lookup_frec_by_sender(unsigned short id,
+					  union mysockaddr *addr,
+					  void *hash)
+{
+  struct frec *f;
+  
+  if (!frec_id_hash)
+    return NULL;
+
+  for (f = *frec_sender_bucket(id, addr, hash); f; f = f->sender_next)
+    if (f->sentto &&
+	f->orig_id == id && 
+	memcmp(hash, f->hash, HASH_SIZE) == 0 &&
+	sockaddr_isequal(&f->source, addr))
+      return f;
+   
+  return NULL;
+}
+
+/* An in-flight query for the same question, from any client, which
+   a new client can share. DNSSEC sub-queries are internal, so don't count,
+   nor do queries old enough that the packet may have been lost: the new
+   client is better off with a query of its own. */
+static struct frec *lookup_frec_by_query(void *hash, int flags, unsigned short pktsz)
+{
+  struct frec *f;
+  struct timeval tv;
+  int mask = FREC_CHECKING_DISABLED | FREC_AD_QUESTION | FREC_DO_QUESTION;
+
+  if (!frec_query_hash)
+    return NULL;
+
+  gettimeofday(&tv, NULL);
+
+  for (f = *frec_query_bucket(hash); f; f = f->query_next)
+    if (f->sentto &&
+	(f->flags & mask) == flags &&
+	!(f->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY)) &&
+	f->pktsz == pktsz &&
+	hedge_before(&tv, &f->join_by) &&
+	memcmp(hash, f->hash, HASH_SIZE) == 0)
+      return f;
+  
+  return NULL;
+}
+
+/* The query a client joined, if it's a retry from that client. */
+static struct frec *lookup_frec_by_joined(unsigned short id, union mysockaddr *addr, void *hash)
+{
+  struct frec *f;
+  struct frec_src *src;
+
+  if (!frec_query_hash)
+    return NULL;
+
+  for (f = *frec_query_bucket(hash); f; f = f->query_next)
+    if (f->sentto && f->extra_src && memcmp(hash, f->hash, HASH_SIZE) == 0)
+      for (src = f->extra_src; src; src = src->next)
+	if (src->orig_id == id && sockaddr_isequal(&src->source, addr))
+	  return f;
+
+  return NULL;
+}
+ 
+/* Send query packet again, if we can. */
+void resend_query()
+{
+  if (daemon->srv_save)
+    {
+      int fd;
+      
+      if (daemon->srv_save->sfd)
+	fd = daemon->srv_save->sfd->fd;
+      else if (daemon->rfd_save && daemon->rfd_save->refcount != 0)
+	fd = daemon->rfd_save->fd;
+      else
+	return;
+      
+      while(retry_send(sendto(fd, daemon->packet, daemon->packet_len, 0,
+			      &daemon->srv_save->addr.sa, 
+			      sa_len(&daemon->srv_save->addr)))); 
+    }
+}
+
+/* In a new DNS worker, forget queries in flight for the main process
+   and close the sockets they were using. */
+void forward_reset(void)
+{
+  struct frec *f;
+  int i;
+  
+  for (f = daemon->frec_list; f; f = f->next)
+    free_frec(f);
+
+  for (i = 0; i < RANDOM_SOCKS; i++)
+    if (daemon->randomsocks[i].refcount != 0)
+      {
+	poll_remove(daemon->randomsocks[i].fd);
+	close(daemon->randomsocks[i].fd);
+	daemon->randomsocks[i].refcount = 0;
+      }
+  
+  daemon->srv_save = NULL;
+  daemon->rfd_save = NULL;
+}
+
+/* A server record is going away, remove references to it */
+void server_gone(struct server *server)
+{
+  struct frec *f;
+  struct tcp_conn *conn;
+  
+  for (f = daemon->frec_list; f; f = f->next)
+    if (f->sentto && f->sentto == server)
+      free_frec(f);
+  
+  if (daemon->last_server == server)
+    daemon->last_server = NULL;
+
+  /* TCP connections waiting on upstream may refer to it, or its domain. */
+  for (conn = daemon->tcp_conns; conn; conn = conn->next)
+    if (conn->state == TCP_CONN_CONNECT || conn->state == TCP_CONN_SEND || conn->state == TCP_CONN_REPLY)
+      tcp_conn_fail(conn, F_NEG);
+    else if (conn->upserver == server)
+      tcp_conn_close_upstream(conn);
 
   if (daemon->srv_save == server)
     daemon->srv_save = NULL;
@@ -21,15 +21,65 @@
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
+/* DHCPv4 leases are also hashed by address, client-id and hardware address,
+   so that finding one doesn't mean walking them all. */
+static struct dhcp_lease **addr_hash, **clid_hash, **hw_hash;
+static unsigned int lease_hash_size;
+
+static void lease_hash_link(struct dhcp_lease *lease);
+static void lease_hash_unlink(struct dhcp_lease *lease);
+
+/* Leases with a finite expiry time are also in a binary heap, earliest
+   first, so that pruning and finding the next expiry don't mean walking
+   them all. expiry_heap[0] is unused. */
+static struct dhcp_lease **expiry_heap;
+static int expiry_count;
+
+static void expiry_update(struct dhcp_lease *lease);
+static void expiry_remove(struct dhcp_lease *lease);
+static void lease_unlink(struct dhcp_lease *lease);
+
+/* With --leasefile-journal, changed leases are appended to
+   <leasefile>.journal, along with "del <address>" lines for leases
+   which go away, and the leasefile itself is only rewritten once the
+   journal grows past the limit. Changed leases wait on journal_leases
+   until lease_update_file() runs.
+   When the journal is folded in, the new leasefile is written to
+   <leasefile>.new and renamed over the old one. Both files start with a
+   "journal <generation>" line, and on startup a journal is only replayed
+   if its generation matches the leasefile's, so a journal which was
+   already folded in, but not yet emptied, is ignored. */
+static FILE *journal_stream;
+static struct dhcp_lease *journal_leases;
+static long journal_size;
+static int journal_err, journal_compact;
+static unsigned int journal_gen;
+static char *journal_tmp;
+
+/* Each lease keeps the DNS records made for it, so that when one changes
+   lease_update_dns() only has to redo that lease. Changed leases wait on
+   dns_leases, and until the first update after startup they all do. */
+static struct dhcp_lease *dns_leases;
+static int dns_all;
+
+static void read_leases(FILE *leasestream, time_t now, int journal);
+static void ourprintf(FILE *stream, int *errp, char *format, ...);
+
 void lease_init(time_t now)
 {
-  unsigned long ei;
-  struct all_addr addr;
-  struct dhcp_lease *lease;
-  int clid_len, hw_len, hw_type;
   FILE *leasestream;
   
   leases_left = daemon->dhcp_max;
+  dns_all = 1;
+
+  for (lease_hash_size = 64; lease_hash_size < (unsigned int)daemon->dhcp_max && lease_hash_size < (1u << 20); lease_hash_size <<= 1);
+  addr_hash = safe_malloc(lease_hash_size * sizeof(struct dhcp_lease *));
+  clid_hash = safe_malloc(lease_hash_size * sizeof(struct dhcp_lease *));
+  hw_hash = safe_malloc(lease_hash_size * sizeof(struct dhcp_lease *));
+  memset(addr_hash, 0, lease_hash_size * sizeof(struct dhcp_lease *));
+  memset(clid_hash, 0, lease_hash_size * sizeof(struct dhcp_lease *));
+  memset(hw_hash, 0, lease_hash_size * sizeof(struct dhcp_lease *));
+  expiry_heap = safe_malloc((daemon->dhcp_max + 1) * sizeof(struct dhcp_lease *));
   
   if (option_bool(OPT_LEASE_RO))
     {
@@ -64,91 +114,31 @@ void lease_init(time_t now)
       rewind(leasestream);
     }
   
-  /* client-id max length is 255 which is 255*2 digits + 254 colons 
-     borrow DNS packet buffer which is always larger than 1000 bytes */
   if (leasestream)
-    while (fscanf(leasestream, "%255s %255s", daemon->dhcp_buff3, daemon->dhcp_buff2) == 2)
-      {
-#ifdef HAVE_DHCP6
-	if (strcmp(daemon->dhcp_buff3, "duid") == 0)
-	  {
-	    daemon->duid_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, 130, NULL, NULL);
-	    daemon->duid = safe_malloc(daemon->duid_len);
-	    memcpy(daemon->duid, daemon->dhcp_buff2, daemon->duid_len);
-	    continue;
-	  }
-#endif
-
-	ei = atol(daemon->dhcp_buff3);
-	
-	if (fscanf(leasestream, " %64s %255s %764s",
-		   daemon->namebuff, daemon->dhcp_buff, daemon->packet) != 3)
-	  break;
-	
-	clid_len = 0;
-	if (strcmp(daemon->packet, "*") != 0)
-	  clid_len = parse_hex(daemon->packet, (unsigned char *)daemon->packet, 255, NULL, NULL);
-	
-	if (inet_pton(AF_INET, daemon->namebuff, &addr.addr.addr4) &&
-	    (lease = lease4_allocate(addr.addr.addr4)))
-	  {
-	    hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
-	    /* For backwards compatibility, no explict MAC address type means ether. */
-	    if (hw_type == 0 && hw_len != 0)
-	      hw_type = ARPHRD_ETHER; 
+    read_leases(leasestream, now, 0);
 
-	    lease_set_hwaddr(lease, (unsigned char *)daemon->dhcp_buff2, (unsigned char *)daemon->packet, 
-			     hw_len, hw_type, clid_len, now, 0);
-	    
-	    if (strcmp(daemon->dhcp_buff, "*") !=  0)
-	      lease_set_hostname(lease, daemon->dhcp_buff, 0, get_domain(lease->addr), NULL);
-	  }
-#ifdef HAVE_DHCP6
-	else if (inet_pton(AF_INET6, daemon->namebuff, &addr.addr.addr6))
-	  {
-	    char *s = daemon->dhcp_buff2;
-	    int lease_type = LEASE_NA;
-	    int iaid;
-
-	    if (s[0] == 'T')
-	      {
-		lease_type = LEASE_TA;
-		s++;
-	      }
-	    
-	    iaid = strtoul(s, NULL, 10);
-	    
-	    if ((lease = lease6_allocate(&addr.addr.addr6, lease_type)))
-	      {
-		lease_set_hwaddr(lease, NULL, (unsigned char *)daemon->packet, 0, 0, clid_len, now, 0);
-		lease_set_iaid(lease, iaid);
-		if (strcmp(daemon->dhcp_buff, "*") !=  0)
-		  lease_set_hostname(lease, daemon->dhcp_buff, 0, get_domain6((struct in6_addr *)lease->hwaddr), NULL);
-	      }
-	  }
-#endif
-	else
-	  break;
+  if (daemon->lease_stream && daemon->lease_journal_max != 0)
+    {
+      char *name = safe_malloc(strlen(daemon->lease_file) + sizeof(".journal"));
+      FILE *journal;
 
-	if (!lease)
-	  die (_("too many stored leases"), NULL, EC_MISC);
-       	
-#ifdef HAVE_BROKEN_RTC
-	if (ei != 0)
-	  lease->expires = (time_t)ei + now;
-	else
-	  lease->expires = (time_t)0;
-	lease->length = ei;
-#else
-	/* strictly time_t is opaque, but this hack should work on all sane systems,
-	   even when sizeof(time_t) == 8 */
-	lease->expires = (time_t)ei;
-#endif
-	
-	/* set these correctly: the "old" events are generated later from
-	   the startup synthesised SIGHUP. */
-	lease->flags &= ~(LEASE_NEW | LEASE_CHANGED);
-      }
+      strcpy(name, daemon->lease_file);
+      strcat(name, ".journal");
+      
+      if (!(journal = fopen(name, "a+")))
+	die(_("cannot open or create lease file %s: %s"), name, EC_FILE);
+      
+      strcpy(name, daemon->lease_file);
+      strcat(name, ".new");
+      journal_tmp = name;
+      
+      rewind(journal);
+      read_leases(journal, now, 1);
+      
+      fseek(journal, 0, SEEK_END);
+      journal_size = ftell(journal);
+      journal_stream = journal;
+    }
   
 #ifdef HAVE_SCRIPT
   if (!daemon->lease_stream)
@@ -175,10 +165,199 @@ void lease_init(time_t now)
 
   /* Some leases may have expired */
   file_dirty = 0;
+
+  /* Fold a journal left from last time into the leasefile. */
+  if (journal_size != 0)
+    file_dirty = journal_compact = 1;
+
   lease_prune(NULL, now);
   dns_dirty = 1;
 }
 
+/* While reading the journal, take any lease for address out of
+   service; read_leases() frees it at the end. */
+static void lease_replace(char *address)
+{
+  struct all_addr addr;
+  struct dhcp_lease *lease = NULL;
+
+  if (inet_pton(AF_INET, address, &addr.addr.addr4))
+    {
+      if ((lease = lease_find_by_addr(addr.addr.addr4)))
+	{
+	  lease_hash_unlink(lease);
+	  mark_inuse(lease->addr, 0);
+	}
+    }
+#ifdef HAVE_DHCP6
+  else if (inet_pton(AF_INET6, address, &addr.addr.addr6))
+    for (lease = leases; lease; lease = lease->next)
+      if ((lease->flags & (LEASE_TA | LEASE_NA)) && !(lease->flags & LEASE_REPLACED) &&
+	  IN6_ARE_ADDR_EQUAL(&lease->addr6, &addr.addr.addr6))
+	break;
+#endif
+
+  if (lease)
+    {
+      /* keep its name out of the way of the lease replacing it */
+      free(lease->hostname);
+      free(lease->fqdn);
+      lease->hostname = lease->fqdn = NULL;
+      lease->flags |= LEASE_REPLACED;
+      expiry_remove(lease);
+      leases_left++;
+    }
+}
+
+/* Read leases in leasefile format. The journal may also have "del <address>"
+   lines, and an entry there replaces any earlier one for the same address. */
+static void read_leases(FILE *leasestream, time_t now, int journal)
+{
+  unsigned long ei;
+  struct all_addr addr;
+  struct dhcp_lease *lease, *tmp;
+  int clid_len, hw_len, hw_type, first = 1;
+
+  /* client-id max length is 255 which is 255*2 digits + 254 colons 
+     borrow DNS packet buffer which is always larger than 1000 bytes */
+  while (fscanf(leasestream, "%255s %255s", daemon->dhcp_buff3, daemon->dhcp_buff2) == 2)
+    {
+#ifdef HAVE_DHCP6
+      if (strcmp(daemon->dhcp_buff3, "duid") == 0)
+	{
+	  daemon->duid_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, 130, NULL, NULL);
+	  daemon->duid = safe_malloc(daemon->duid_len);
+	  memcpy(daemon->duid, daemon->dhcp_buff2, daemon->duid_len);
+	  continue;
+	}
+#endif
+
+      if (strcmp(daemon->dhcp_buff3, "journal") == 0)
+	{
+	  if (!journal)
+	    journal_gen = strtoul(daemon->dhcp_buff2, NULL, 10);
+	  else if (!first || strtoul(daemon->dhcp_buff2, NULL, 10) != journal_gen)
+	    break; /* already in the leasefile */
+	  first = 0;
+	  continue;
+	}
+      
+      /* A journal with no generation goes with a leasefile with none. */
+      if (journal && first && journal_gen != 0)
+	break;
+      first = 0;
+
+      if (journal && strcmp(daemon->dhcp_buff3, "del") == 0)
+	{
+	  lease_replace(daemon->dhcp_buff2);
+	  continue;
+	}
+
+      ei = atol(daemon->dhcp_buff3);
+	
+      if (fscanf(leasestream, " %64s %255s %764s",
+		 daemon->namebuff, daemon->dhcp_buff, daemon->packet) != 3)
+	break;
+	
+      clid_len = 0;
+      if (strcmp(daemon->packet, "*") != 0)
+	clid_len = parse_hex(daemon->packet, (unsigned char *)daemon->packet, 255, NULL, NULL);
+	
+      if (journal)
+	lease_replace(daemon->namebuff);
+
+      if (inet_pton(AF_INET, daemon->namebuff, &addr.addr.addr4) &&
+	  (lease = lease4_allocate(addr.addr.addr4)))
+	{
+	  hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
+	  /* For backwards compatibility, no explict MAC address type means ether. */
+	  if (hw_type == 0 && hw_len != 0)
+	    hw_type = ARPHRD_ETHER; 
+
+	  lease_set_hwaddr(lease, (unsigned char *)daemon->dhcp_buff2, (unsigned char *)daemon->packet, 
+			   hw_len, hw_type, clid_len, now, 0);
+	    
+	  if (strcmp(daemon->dhcp_buff, "*") !=  0)
+	    lease_set_hostname(lease, daemon->dhcp_buff, 0, get_domain(lease->addr), NULL);
+	}
+#ifdef HAVE_DHCP6
+      else if (inet_pton(AF_INET6, daemon->namebuff, &addr.addr.addr6))
+	{
+	  char *s = daemon->dhcp_buff2;
+	  int lease_type = LEASE_NA;
+	  int iaid;
+
+	  if (s[0] == 'T')
+	    {
+	      lease_type = LEASE_TA;
+	      s++;
+	    }
+	    
+	  iaid = strtoul(s, NULL, 10);
+	    
+	  if ((lease = lease6_allocate(&addr.addr.addr6, lease_type)))
+	    {
+	      lease_set_hwaddr(lease, NULL, (unsigned char *)daemon->packet, 0, 0, clid_len, now, 0);
+	      lease_set_iaid(lease, iaid);
+	      if (strcmp(daemon->dhcp_buff, "*") !=  0)
+		lease_set_hostname(lease, daemon->dhcp_buff, 0, get_domain6((struct in6_addr *)lease->hwaddr), NULL);
+	    }
+	}
+#endif
+      else
+	break;
+
+      if (!lease)
+	die (_("too many stored leases"), NULL, EC_MISC);
+       	
+#ifdef HAVE_BROKEN_RTC
+      if (ei != 0)
+	lease->expires = (time_t)ei + now;
+      else
+	lease->expires = (time_t)0;
+      lease->length = ei;
+#else
+      /* strictly time_t is opaque, but this hack should work on all sane systems,
+	 even when sizeof(time_t) == 8 */
+      lease->expires = (time_t)ei;
+#endif
+      expiry_update(lease);
+	
+      /* set these correctly: the "old" events are generated later from
+	 the startup synthesised SIGHUP. */
+      lease->flags &= ~(LEASE_NEW | LEASE_CHANGED);
+    }
+
+  /* Free leases replaced by the journal. They were never seen by the
+     outside world, so this is not a deletion. */
+  if (!journal)
+    return;
+
+  for (lease = leases; lease; lease = tmp)
+    {
+      tmp = lease->next;
+      
+      if (lease->flags & LEASE_REPLACED)
+	{
+#ifdef HAVE_DHCP6
+	  struct slaac_address *slaac, *stmp;
+	  for (slaac = lease->slaac_address; slaac; slaac = stmp)
+	    {
+	      stmp = slaac->next;
+	      free(slaac);
+	    }
+#endif
+	  lease_unlink(lease);
+	  free(lease->hostname);
+	  free(lease->fqdn);
+	  free(lease->old_hostname);
+	  free(lease->clid);
+	  free(lease->extradata);
+	  free(lease);
+	}
+    }
+}
+
 void lease_update_from_configs(void)
 {
   /* changes to the config may change current leases. */
@@ -199,104 +378,281 @@ void lease_update_from_configs(void)
       lease_set_hostname(lease, name, 1, get_domain(lease->addr), NULL); /* updates auth flag only */
 }
  
-static void ourprintf(int *errp, char *format, ...)
+static void ourprintf(FILE *stream, int *errp, char *format, ...)
 {
   va_list ap;
   
   va_start(ap, format);
-  if (!(*errp) && vfprintf(daemon->lease_stream, format, ap) < 0)
+  if (!(*errp) && vfprintf(stream, format, ap) < 0)
     *errp = errno;
   va_end(ap);
 }
 
-void lease_update_file(time_t now)
+static void write_lease(FILE *stream, int *errp, struct dhcp_lease *lease)
 {
-  struct dhcp_lease *lease;
-  time_t next_event;
-  int i, err = 0;
+  int i;
+
+#ifdef HAVE_BROKEN_RTC
+  ourprintf(stream, errp, "%u ", lease->length);
+#else
+  ourprintf(stream, errp, "%lu ", (unsigned long)lease->expires);
+#endif
 
-  if (file_dirty != 0 && daemon->lease_stream)
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
     {
-      errno = 0;
-      rewind(daemon->lease_stream);
-      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
-	err = errno;
+      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
       
-      for (lease = leases; lease; lease = lease->next)
+      ourprintf(stream, errp, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
+		lease->iaid, daemon->addrbuff);
+    }
+  else
+#endif
+    {
+      if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
+	ourprintf(stream, errp, "%.2x-", lease->hwaddr_type);
+      for (i = 0; i < lease->hwaddr_len; i++)
 	{
+	  ourprintf(stream, errp, "%.2x", lease->hwaddr[i]);
+	  if (i != lease->hwaddr_len - 1)
+	    ourprintf(stream, errp, ":");
+	}
+      
+      inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
+      
+      ourprintf(stream, errp, " %s ", daemon->addrbuff);
+    }
+
+  ourprintf(stream, errp, "%s ", lease->hostname ? lease->hostname : "*");
+  
+  if (lease->clid && lease->clid_len != 0)
+    {
+      for (i = 0; i < lease->clid_len - 1; i++)
+	ourprintf(stream, errp, "%.2x:", lease->clid[i]);
+      ourprintf(stream, errp, "%.2x\n", lease->clid[i]);
+    }
+  else
+    ourprintf(stream, errp, "*\n");	  
+}
+
+/* Note that lease must be written out. */
+static void lease_dirty(struct dhcp_lease *lease)
+{
+  file_dirty = 1;
+
+  if (journal_stream && !(lease->flags & LEASE_JOURNAL))
+    {
+      lease->flags |= LEASE_JOURNAL;
+      lease->journal_next = journal_leases;
+      journal_leases = lease;
+    }
+}
+
+/* Note that lease is gone. */
+static void journal_del(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+  char addrbuff[ADDRSTRLEN];
+
+  if (!journal_stream)
+    return;
+
+  if (lease->flags & LEASE_JOURNAL)
+    for (up = &journal_leases; *up; up = &(*up)->journal_next)
+      if (*up == lease)
+	{
+	  *up = lease->journal_next;
+	  lease->flags &= ~LEASE_JOURNAL;
+	  break;
+	}
 
 #ifdef HAVE_DHCP6
-	  if (lease->flags & (LEASE_TA | LEASE_NA))
-	    continue;
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    inet_ntop(AF_INET6, &lease->addr6, addrbuff, ADDRSTRLEN);
+  else
 #endif
+    inet_ntop(AF_INET, &lease->addr, addrbuff, ADDRSTRLEN);
 
-#ifdef HAVE_BROKEN_RTC
-	  ourprintf(&err, "%u ", lease->length);
-#else
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires);
+  ourprintf(journal_stream, &journal_err, "del %s\n", addrbuff);
+}
+
+/* Write out the whole database. */
+static void write_leases(FILE *stream, int *errp)
+{
+  struct dhcp_lease *lease;
+
+  if (journal_stream)
+    ourprintf(stream, errp, "journal %u\n", journal_gen);
+  
+  for (lease = leases; lease; lease = lease->next)
+    {
+#ifdef HAVE_DHCP6
+      if (lease->flags & (LEASE_TA | LEASE_NA))
+	continue;
 #endif
+      write_lease(stream, errp, lease);
+    }
+  
+#ifdef HAVE_DHCP6  
+  if (daemon->duid)
+    {
+      int i;
+      
+      ourprintf(stream, errp, "duid ");
+      for (i = 0; i < daemon->duid_len - 1; i++)
+	ourprintf(stream, errp, "%.2x:", daemon->duid[i]);
+      ourprintf(stream, errp, "%.2x\n", daemon->duid[i]);
+      
+      for (lease = leases; lease; lease = lease->next)
+	if (lease->flags & (LEASE_TA | LEASE_NA))
+	  write_lease(stream, errp, lease);
+    }
+#endif
+}
 
-	  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
-	    ourprintf(&err, "%.2x-", lease->hwaddr_type);
-	  for (i = 0; i < lease->hwaddr_len; i++)
-	    {
-	      ourprintf(&err, "%.2x", lease->hwaddr[i]);
-	      if (i != lease->hwaddr_len - 1)
-		ourprintf(&err, ":");
-	    }
+/* Write the leasefile for the next journal generation to a new file
+   and rename it into place, so that a crash leaves either the old
+   leasefile or the new one. If that can't be done, say because we may
+   not replace the file, rewrite the leasefile in place. */
+static int compact_leases(void)
+{
+  FILE *new = NULL;
+  struct stat st;
+  char *dir, *p;
+  int fd, err = 0;
+  
+  journal_gen++;
+  
+  if ((fd = open(journal_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1 &&
+      !(new = fdopen(fd, "w")))
+    close(fd);
+  
+  if (new)
+    {
+      if (fstat(fileno(daemon->lease_stream), &st) == 0)
+	fchmod(fileno(new), st.st_mode & 07777);
+      
+      write_leases(new, &err);
+      
+      if (err || fflush(new) != 0 || fsync(fileno(new)) < 0 ||
+	  rename(journal_tmp, daemon->lease_file) == -1)
+	{
+	  fclose(new);
+	  unlink(journal_tmp);
+	  new = NULL;
+	  err = 0;
+	}
+      else
+	{
+	  fclose(daemon->lease_stream);
+	  daemon->lease_stream = new;
 	  
-	  inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
-
-	  ourprintf(&err, " %s ", daemon->addrbuff);
-	  ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	  	  
-	  if (lease->clid && lease->clid_len != 0)
+	  /* make the rename durable */
+	  dir = safe_malloc(strlen(daemon->lease_file) + 2);
+	  strcpy(dir, daemon->lease_file);
+	  if ((p = strrchr(dir, '/')))
+	    *(p == dir ? p + 1 : p) = 0;
+	  else
+	    strcpy(dir, ".");
+	  if ((fd = open(dir, O_RDONLY)) != -1)
 	    {
-	      for (i = 0; i < lease->clid_len - 1; i++)
-		ourprintf(&err, "%.2x:", lease->clid[i]);
-	      ourprintf(&err, "%.2x\n", lease->clid[i]);
+	      fsync(fd);
+	      close(fd);
 	    }
-	  else
-	    ourprintf(&err, "*\n");	  
+	  free(dir);
 	}
+    }
+  
+  if (!new)
+    {
+      errno = 0;
+      rewind(daemon->lease_stream);
+      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
+	err = errno;
       
-#ifdef HAVE_DHCP6  
-      if (daemon->duid)
+      write_leases(daemon->lease_stream, &err);
+      
+      if (fflush(daemon->lease_stream) != 0 ||
+	  fsync(fileno(daemon->lease_stream)) < 0)
+	err = errno;
+    }
+  
+  if (err)
+    journal_gen--;
+  
+  return err;
+}
+
+static void journal_clear(void)
+{
+  struct dhcp_lease *lease;
+  
+  for (lease = journal_leases; lease; lease = lease->journal_next)
+    lease->flags &= ~LEASE_JOURNAL;
+  
+  journal_leases = NULL;
+}
+
+void lease_update_file(time_t now)
+{
+  struct dhcp_lease *lease;
+  time_t next_event;
+  int err = 0;
+
+  if (file_dirty != 0 && daemon->lease_stream && journal_stream &&
+      !journal_compact && !journal_err && journal_size < daemon->lease_journal_max)
+    {
+      /* Append the leases which changed. */
+      for (lease = journal_leases; lease; lease = lease->journal_next)
+	write_lease(journal_stream, &err, lease);
+
+      if (fflush(journal_stream) != 0 ||
+	  fsync(fileno(journal_stream)) < 0)
+	err = errno;
+      
+      if (err)
+	journal_compact = 1; /* state of the journal unknown, rewrite it all next time */
+      else
+	{
+	  journal_size = ftell(journal_stream);
+	  journal_clear();
+	  file_dirty = 0;
+	}
+    }
+  else if (file_dirty != 0 && daemon->lease_stream && journal_stream)
+    {
+      /* Everything in the journal is in the leasefile now. Until the
+	 journal has been emptied and given the new generation, keep
+	 rewriting the leasefile rather than appending to it. */
+      journal_compact = 1;
+      
+      if (!(err = compact_leases()))
 	{
-	  ourprintf(&err, "duid ");
-	  for (i = 0; i < daemon->duid_len - 1; i++)
-	    ourprintf(&err, "%.2x:", daemon->duid[i]);
-	  ourprintf(&err, "%.2x\n", daemon->duid[i]);
+	  errno = 0;
+	  rewind(journal_stream);
+	  if (errno != 0 || ftruncate(fileno(journal_stream), 0) != 0)
+	    err = errno;
+	  ourprintf(journal_stream, &err, "journal %u\n", journal_gen);
+	  if (!err && (fflush(journal_stream) != 0 || fsync(fileno(journal_stream)) < 0))
+	    err = errno;
 	  
-	  for (lease = leases; lease; lease = lease->next)
+	  if (!err)
 	    {
-	      
-	      if (!(lease->flags & (LEASE_TA | LEASE_NA)))
-		continue;
-
-#ifdef HAVE_BROKEN_RTC
-	      ourprintf(&err, "%u ", lease->length);
-#else
-	      ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-    
-	      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
-	 
-	      ourprintf(&err, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
-			lease->iaid, daemon->addrbuff);
-	      ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	      
-	      if (lease->clid && lease->clid_len != 0)
-		{
-		  for (i = 0; i < lease->clid_len - 1; i++)
-		    ourprintf(&err, "%.2x:", lease->clid[i]);
-		  ourprintf(&err, "%.2x\n", lease->clid[i]);
-		}
-	      else
-		ourprintf(&err, "*\n");	  
+	      journal_size = ftell(journal_stream);
+	      journal_err = journal_compact = 0;
+	      journal_clear();
+	      file_dirty = 0;
 	    }
 	}
-#endif      
+    }
+  else if (file_dirty != 0 && daemon->lease_stream)
+    {
+      errno = 0;
+      rewind(daemon->lease_stream);
+      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
+	err = errno;
+      
+      write_leases(daemon->lease_stream, &err);
 	  
       if (fflush(daemon->lease_stream) != 0 ||
 	  fsync(fileno(daemon->lease_stream)) < 0)
@@ -329,10 +685,9 @@ void lease_update_file(time_t now)
     }
 #endif
 
-  for (lease = leases; lease; lease = lease->next)
-    if (lease->expires != 0 &&
-	(next_event == 0 || difftime(next_event, lease->expires) > 0.0))
-      next_event = lease->expires;
+  if (expiry_count != 0 &&
+      (next_event == 0 || difftime(next_event, expiry_heap[1]->expires) > 0.0))
+    next_event = expiry_heap[1]->expires;
    
   if (err)
     {
@@ -447,6 +802,7 @@ void lease_make_duid(time_t now)
   if (!daemon->duid && daemon->doing_dhcp6)
     {
       file_dirty = 1;
+      journal_compact = 1; /* the DUID lives in the leasefile proper */
       make_duid(now);
     }
 }
@@ -455,121 +811,350 @@ void lease_make_duid(time_t now)
 
 
 
+static void lease_dns_dirty(struct dhcp_lease *lease)
+{
+  dns_dirty = 1;
+
+  if (daemon->port == 0 || dns_all)
+    return;
+
+  /* Do this now, the names may be gone by the next update. */
+  cache_del_dhcp_entries(&lease->dns);
+
+  if (!(lease->flags & LEASE_DNS_DIRTY))
+    {
+      lease->flags |= LEASE_DNS_DIRTY;
+      lease->dns_next = dns_leases;
+      dns_leases = lease;
+    }
+}
+
+static void lease_dns_forget(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (lease->hostname)
+    dns_dirty = 1;
+
+  if (daemon->port == 0)
+    return;
+
+  cache_del_dhcp_entries(&lease->dns);
+  cache_send_dhcp(lease, NULL);
+
+  if (lease->flags & LEASE_DNS_DIRTY)
+    for (up = &dns_leases; *up; up = &(*up)->dns_next)
+      if (*up == lease)
+	{
+	  *up = lease->dns_next;
+	  lease->flags &= ~LEASE_DNS_DIRTY;
+	  break;
+	}
+}
+
+static void lease_add_dns(struct dhcp_lease *lease)
+{
+  int prot = AF_INET;
+	  
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    prot = AF_INET6;
+  else if (lease->hostname || lease->fqdn)
+    {
+      struct slaac_address *slaac;
+      
+      for (slaac = lease->slaac_address; slaac; slaac = slaac->next)
+	if (slaac->backoff == 0)
+	  {
+	    if (lease->fqdn)
+	      cache_add_dhcp_entry(lease->fqdn, AF_INET6, (struct all_addr *)&slaac->addr, lease->expires, &lease->dns);
+	    if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
+	      cache_add_dhcp_entry(lease->hostname, AF_INET6, (struct all_addr *)&slaac->addr, lease->expires, &lease->dns);
+	  }
+    }
+  
+  if (lease->fqdn)
+    cache_add_dhcp_entry(lease->fqdn, prot, 
+			 prot == AF_INET ? (struct all_addr *)&lease->addr : (struct all_addr *)&lease->addr6,
+			 lease->expires, &lease->dns);
+  
+  if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
+    cache_add_dhcp_entry(lease->hostname, prot, 
+			 prot == AF_INET ? (struct all_addr *)&lease->addr : (struct all_addr *)&lease->addr6, 
+			 lease->expires, &lease->dns);
+  
+#else
+  if (lease->fqdn)
+    cache_add_dhcp_entry(lease->fqdn, prot, (struct all_addr *)&lease->addr, lease->expires, &lease->dns);
+  
+  if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
+    cache_add_dhcp_entry(lease->hostname, prot, (struct all_addr *)&lease->addr, lease->expires, &lease->dns);
+#endif
+}
+
 void lease_update_dns(int force)
 {
   struct dhcp_lease *lease;
 
-  if (daemon->port != 0 && (dns_dirty || force))
+  if (daemon->port != 0 && (dns_dirty || force || dns_all))
     {
 #ifndef HAVE_BROKEN_RTC
       /* force transfer to authoritative secondaries */
       daemon->soa_sn++;
 #endif
       
-      cache_unhash_dhcp();
-
-      for (lease = leases; lease; lease = lease->next)
+      if (force || dns_all)
 	{
-	  int prot = AF_INET;
-	  
-#ifdef HAVE_DHCP6
-	  if (lease->flags & (LEASE_TA | LEASE_NA))
-	    prot = AF_INET6;
-	  else if (lease->hostname || lease->fqdn)
+	  /* start again with all the leases */
+	  for (lease = leases; lease; lease = lease->next)
 	    {
-	      struct slaac_address *slaac;
-
-	      for (slaac = lease->slaac_address; slaac; slaac = slaac->next)
-		if (slaac->backoff == 0)
-		  {
-		    if (lease->fqdn)
-		      cache_add_dhcp_entry(lease->fqdn, AF_INET6, (struct all_addr *)&slaac->addr, lease->expires);
-		    if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
-		      cache_add_dhcp_entry(lease->hostname, AF_INET6, (struct all_addr *)&slaac->addr, lease->expires);
-		  }
+	      cache_del_dhcp_entries(&lease->dns);
+	      lease->flags &= ~LEASE_DNS_DIRTY;
+	    }
+
+	  cache_send_dhcp(NULL, NULL);
+	  for (lease = leases; lease; lease = lease->next)
+	    {
+	      lease_add_dns(lease);
+	      if (lease->dns)
+		cache_send_dhcp(lease, lease->dns);
 	    }
-	  
-	  if (lease->fqdn)
-	    cache_add_dhcp_entry(lease->fqdn, prot, 
-				 prot == AF_INET ? (struct all_addr *)&lease->addr : (struct all_addr *)&lease->addr6,
-				 lease->expires);
-	     
-	  if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
-	    cache_add_dhcp_entry(lease->hostname, prot, 
-				 prot == AF_INET ? (struct all_addr *)&lease->addr : (struct all_addr *)&lease->addr6, 
-				 lease->expires);
-       
-#else
-	  if (lease->fqdn)
-	    cache_add_dhcp_entry(lease->fqdn, prot, (struct all_addr *)&lease->addr, lease->expires);
-	  
-	  if (!option_bool(OPT_DHCP_FQDN) && lease->hostname)
-	    cache_add_dhcp_entry(lease->hostname, prot, (struct all_addr *)&lease->addr, lease->expires);
-#endif
 	}
+      else
+	for (lease = dns_leases; lease; lease = lease->dns_next)
+	  {
+	    lease->flags &= ~LEASE_DNS_DIRTY;
+	    lease_add_dns(lease);
+	    cache_send_dhcp(lease, lease->dns);
+	  }
       
-      dns_dirty = 0;
+      dns_leases = NULL;
+      dns_dirty = dns_all = 0;
+      cache_flush_dhcp();
     }
 }
 
+/* In a DNS worker, the DHCP names copied at fork() are kept up to date
+   by the main process from now on, see cache_send_dhcp(). */
+void lease_keep_dns(void)
+{
+  struct dhcp_lease *lease;
+
+  for (lease = leases; lease; lease = lease->next)
+    {
+      cache_keep_dhcp(lease, lease->dns);
+      lease->dns = NULL;
+    }
+}
+
+static void lease_unlink(struct dhcp_lease *lease)
+{
+  if (lease->prev)
+    lease->prev->next = lease->next;
+  else
+    leases = lease->next;
+  
+  if (lease->next)
+    lease->next->prev = lease->prev;
+}
+
+/* Take a lease out of service and put it on old_leases 'till we can run the script. */
+static void lease_retire(struct dhcp_lease *lease)
+{
+  file_dirty = 1;
+  journal_del(lease);
+  lease_dns_forget(lease);
+  
+  lease_unlink(lease);
+  lease_hash_unlink(lease);
+  expiry_remove(lease);
+#ifdef HAVE_DHCP6
+  if (!(lease->flags & (LEASE_TA | LEASE_NA)))
+#endif
+    mark_inuse(lease->addr, 0);
+  
+  lease->next = old_leases;
+  old_leases = lease;
+  
+  leases_left++;
+}
+
 void lease_prune(struct dhcp_lease *target, time_t now)
 {
-  struct dhcp_lease *lease, *tmp, **up;
+  if (target)
+    lease_retire(target);
 
-  for (lease = leases, up = &leases; lease; lease = tmp)
+  while (expiry_count != 0 && difftime(now, expiry_heap[1]->expires) > 0)
+    lease_retire(expiry_heap[1]);
+} 
+
+static void expiry_sift(int pos)
+{
+  struct dhcp_lease *lease = expiry_heap[pos];
+  int child;
+
+  while (pos > 1 && difftime(expiry_heap[pos / 2]->expires, lease->expires) > 0)
     {
-      tmp = lease->next;
-      if ((lease->expires != 0 && difftime(now, lease->expires) > 0) || lease == target)
+      expiry_heap[pos] = expiry_heap[pos / 2];
+      expiry_heap[pos]->expiry_pos = pos;
+      pos /= 2;
+    }
+
+  while ((child = 2 * pos) <= expiry_count)
+    {
+      if (child < expiry_count && difftime(expiry_heap[child]->expires, expiry_heap[child + 1]->expires) > 0)
+	child++;
+      
+      if (difftime(lease->expires, expiry_heap[child]->expires) <= 0)
+	break;
+      
+      expiry_heap[pos] = expiry_heap[child];
+      expiry_heap[pos]->expiry_pos = pos;
+      pos = child;
+    }
+
+  expiry_heap[pos] = lease;
+  lease->expiry_pos = pos;
+}
+
+/* Call when lease->expires changes. */
+static void expiry_update(struct dhcp_lease *lease)
+{
+  if (lease->expires == 0)
+    expiry_remove(lease);
+  else
+    {
+      if (lease->expiry_pos == 0)
 	{
-	  file_dirty = 1;
-	  if (lease->hostname)
-	    dns_dirty = 1;
-	  
- 	  *up = lease->next; /* unlink */
-	  
-	  /* Put on old_leases list 'till we
-	     can run the script */
-	  lease->next = old_leases;
-	  old_leases = lease;
-	  
-	  leases_left++;
+	  lease->expiry_pos = ++expiry_count;
+	  expiry_heap[expiry_count] = lease;
+	}
+      expiry_sift(lease->expiry_pos);
+    }
+}
+
+static void expiry_remove(struct dhcp_lease *lease)
+{
+  int pos = lease->expiry_pos;
+  
+  if (pos != 0)
+    {
+      lease->expiry_pos = 0;
+      if (pos != expiry_count)
+	{
+	  expiry_heap[pos] = expiry_heap[expiry_count--];
+	  expiry_sift(pos);
 	}
       else
-	up = &lease->next;
+	expiry_count--;
     }
-} 
+}
 	
   
-struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int hw_type,
-					unsigned char *clid, int clid_len)
+static unsigned int lease_hash(const unsigned char *p, int len, unsigned int val)
 {
-  struct dhcp_lease *lease;
+  while (len--)
+    val = ((val << 7) | (val >> (32 - 7))) + *p++;
+  
+  return val & (lease_hash_size - 1);
+}
 
-  if (clid)
-    for (lease = leases; lease; lease = lease->next)
-      {
+static struct dhcp_lease **addr_bucket(struct in_addr addr)
+{
+  return &addr_hash[lease_hash((unsigned char *)&addr, INADDRSZ, 0)];
+}
+
+static struct dhcp_lease **clid_bucket(const unsigned char *clid, int clid_len)
+{
+  return &clid_hash[lease_hash(clid, clid_len, clid_len)];
+}
+
+static struct dhcp_lease **hw_bucket(const unsigned char *hwaddr, int hw_len, int hw_type)
+{
+  return &hw_hash[lease_hash(hwaddr, hw_len, hw_type)];
+}
+
+/* Link a DHCPv4 lease into the hashes under its current keys. */
+static void lease_hash_link(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+  
 #ifdef HAVE_DHCP6
-	if (lease->flags & (LEASE_TA | LEASE_NA))
-	  continue;
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    return;
 #endif
-	if (lease->clid && clid_len == lease->clid_len &&
-	    memcmp(clid, lease->clid, clid_len) == 0)
-	  return lease;
-      }
   
-  for (lease = leases; lease; lease = lease->next)	
+  up = addr_bucket(lease->addr);
+  lease->addr_next = *up;
+  *up = lease;
+  
+  if (lease->clid)
     {
+      up = clid_bucket(lease->clid, lease->clid_len);
+      lease->clid_next = *up;
+      *up = lease;
+    }
+  
+  if (lease->hwaddr_len > 0 && lease->hwaddr_len <= DHCP_CHADDR_MAX)
+    {
+      up = hw_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type);
+      lease->hw_next = *up;
+      *up = lease;
+    }
+}
+
+/* Must be called before any of the keys change. */
+static void lease_hash_unlink(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+  
 #ifdef HAVE_DHCP6
-      if (lease->flags & (LEASE_TA | LEASE_NA))
-	continue;
-#endif   
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    return;
+#endif
+  
+  for (up = addr_bucket(lease->addr); *up; up = &(*up)->addr_next)
+    if (*up == lease)
+      {
+	*up = lease->addr_next;
+	break;
+      }
+  
+  if (lease->clid)
+    for (up = clid_bucket(lease->clid, lease->clid_len); *up; up = &(*up)->clid_next)
+      if (*up == lease)
+	{
+	  *up = lease->clid_next;
+	  break;
+	}
+
+  if (lease->hwaddr_len > 0 && lease->hwaddr_len <= DHCP_CHADDR_MAX)
+    for (up = hw_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type); *up; up = &(*up)->hw_next)
+      if (*up == lease)
+	{
+	  *up = lease->hw_next;
+	  break;
+	}
+}
+
+struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int hw_type,
+					unsigned char *clid, int clid_len)
+{
+  struct dhcp_lease *lease;
+
+  if (clid)
+    for (lease = *clid_bucket(clid, clid_len); lease; lease = lease->clid_next)
+      if (clid_len == lease->clid_len &&
+	  memcmp(clid, lease->clid, clid_len) == 0)
+	return lease;
+  
+  if (hw_len > 0 && hw_len <= DHCP_CHADDR_MAX)
+    for (lease = *hw_bucket(hwaddr, hw_len, hw_type); lease; lease = lease->hw_next)
       if ((!lease->clid || !clid) && 
-	  hw_len != 0 && 
 	  lease->hwaddr_len == hw_len &&
 	  lease->hwaddr_type == hw_type &&
 	  memcmp(hwaddr, lease->hwaddr, hw_len) == 0)
 	return lease;
-    }
 
   return NULL;
 }
@@ -578,15 +1163,9 @@ struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
   struct dhcp_lease *lease;
 
-  for (lease = leases; lease; lease = lease->next)
-    {
-#ifdef HAVE_DHCP6
-      if (lease->flags & (LEASE_TA | LEASE_NA))
-	continue;
-#endif  
-      if (lease->addr.s_addr == addr.s_addr)
-	return lease;
-    }
+  for (lease = *addr_bucket(addr); lease; lease = lease->addr_next)
+    if (lease->addr.s_addr == addr.s_addr)
+      return lease;
 
   return NULL;
 }
@@ -716,6 +1295,18 @@ struct in_addr lease_find_max_addr(struct dhcp_context *context)
   return addr;
 }
 
+/* Fill in the map of taken addresses for context. */
+void lease_mark_context(struct dhcp_context *context)
+{
+  struct dhcp_lease *lease;
+  
+  for (lease = leases; lease; lease = lease->next)
+#ifdef HAVE_DHCP6
+    if (!(lease->flags & (LEASE_TA | LEASE_NA)))
+#endif
+      context_set_inuse(context, lease->addr, 1);
+}
+
 static struct dhcp_lease *lease_allocate(void)
 {
   struct dhcp_lease *lease;
@@ -730,9 +1321,12 @@ static struct dhcp_lease *lease_allocate(void)
 #endif
   lease->hwaddr_len = 256; /* illegal value */
   lease->next = leases;
+  if (leases)
+    leases->prev = lease;
   leases = lease;
+  expiry_update(lease);
   
-  file_dirty = 1;
+  lease_dirty(lease);
   leases_left--;
 
   return lease;
@@ -742,7 +1336,11 @@ struct dhcp_lease *lease4_allocate(struct in_addr addr)
 {
   struct dhcp_lease *lease = lease_allocate();
   if (lease)
-    lease->addr = addr;
+    {
+      lease->addr = addr;
+      lease_hash_link(lease);
+      mark_inuse(addr, 1);
+    }
   
   return lease;
 }
@@ -784,11 +1382,12 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
 
   if (exp != lease->expires)
     {
-      dns_dirty = 1;
+      lease_dns_dirty(lease);
       lease->expires = exp;
+      expiry_update(lease);
 #ifndef HAVE_BROKEN_RTC
       lease->flags |= LEASE_AUX_CHANGED;
-      file_dirty = 1;
+      lease_dirty(lease);
 #endif
     }
   
@@ -797,7 +1396,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
     {
       lease->length = len;
       lease->flags |= LEASE_AUX_CHANGED;
-      file_dirty = 1; 
+      lease_dirty(lease);
     }
 #endif
 } 
@@ -809,6 +1408,7 @@ void lease_set_iaid(struct dhcp_lease *lease, int iaid)
     {
       lease->iaid = iaid;
       lease->flags |= LEASE_CHANGED;
+      lease_dirty(lease);
     }
 }
 #endif
@@ -825,6 +1425,8 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
   (void)force;
   (void)now;
 
+  lease_hash_unlink(lease);
+
   if (hw_len != lease->hwaddr_len ||
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
@@ -834,7 +1436,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       lease->hwaddr_len = hw_len;
       lease->hwaddr_type = hw_type;
       lease->flags |= LEASE_CHANGED;
-      file_dirty = 1; /* run script on change */
+      lease_dirty(lease); /* run script on change */
     }
 
   /* only update clid when one is available, stops packets
@@ -848,10 +1450,13 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       if (lease->clid_len != clid_len)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease);
 	  free(lease->clid);
 	  if (!(lease->clid = whine_malloc(clid_len)))
-	    return;
+	    {
+	      lease_hash_link(lease);
+	      return;
+	    }
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	   
@@ -859,7 +1464,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       else if (memcmp(lease->clid, clid, clid_len) != 0)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease);
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	
@@ -868,6 +1473,8 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       lease->clid_len = clid_len;
       memcpy(lease->clid, clid, clid_len);
     }
+
+  lease_hash_link(lease);
   
 #ifdef HAVE_DHCP6
   if (change)
@@ -971,11 +1578,15 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
 	      return;
 	    }
 	
+	  lease_dns_dirty(lease_tmp);
 	  kill_name(lease_tmp);
+	  lease_dirty(lease_tmp);
 	  break;
 	}
     }
 
+  lease_dns_dirty(lease);
+
   if (lease->hostname)
     kill_name(lease);
 
@@ -985,8 +1596,7 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
   if (auth)
     lease->flags |= LEASE_AUTH_NAME;
   
-  file_dirty = 1;
-  dns_dirty = 1; 
+  lease_dirty(lease);
   lease->flags |= LEASE_CHANGED; /* run script on change */
 }
 
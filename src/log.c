@@ -113,7 +113,10 @@ int log_reopen(char *log_file)
   if (!log_stderr)
     {      
       if (log_fd != -1)
-	close(log_fd);
+	{
+	  poll_remove(log_fd);
+	  close(log_fd);
+	}
       
       /* NOTE: umask is set to 022 by the time this gets called */
       
@@ -443,6 +446,7 @@ void flush_log(void)
       log_write();
       if (!entries || !connection_good)
 	{
+	  poll_remove(log_fd);
 	  close(log_fd);	
 	  break;
 	}
@@ -38,9 +38,46 @@
 static struct iovec iov;
 static u32 netlink_pid;
 
+/* --add-mac: a copy of the neighbour (ARP) table, hashed on address.
+   It's loaded by a dump the first time it's needed and then kept
+   current by RTM_NEWNEIGH/RTM_DELNEIGH multicasts; if those are lost
+   it's loaded again. */
+struct neigh {
+  int family;
+  unsigned char addr[IN6ADDRSZ];
+  unsigned char mac[DHCP_CHADDR_MAX];
+  size_t maclen;
+  struct neigh *next;
+};
+
+static struct neigh **neigh_hash = NULL;
+static int neigh_hash_size = 0, neigh_count = 0, neigh_loaded = 0, neigh_live = 0;
+
+/* Copies of the kernel's answers to address and link dumps, replayed
+   to later callers of iface_enumerate() until RTM_NEWADDR, RTM_DELADDR
+   or RTM_NEWLINK multicasts say they've changed. */
+struct nl_cache {
+  unsigned char *buff;
+  size_t len, size;
+  int valid, gen;
+  time_t when;
+};
+
+static struct nl_cache nl_caches[3];
+static int nl_cache_live = 0, addr_events = 0;
+
+#ifdef HAVE_IPV6
+#  define NL_CACHE_GROUPS (RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_LINK)
+#else
+#  define NL_CACHE_GROUPS (RTMGRP_IPV4_IFADDR | RTMGRP_LINK)
+#endif
+
 static void nl_async(struct nlmsghdr *h);
+static int nl_neigh(struct nlmsghdr *h, int *family, char **inaddr, char **mac, size_t *maclen);
+static void neigh_update(int family, char *inaddr, char *mac, size_t maclen);
+static void nl_cache_flush(void);
 
-void netlink_init(void)
+static int netlink_open(u32 groups)
 {
   struct sockaddr_nl addr;
   socklen_t slen = sizeof(addr);
@@ -48,18 +85,7 @@ void netlink_init(void)
   addr.nl_family = AF_NETLINK;
   addr.nl_pad = 0;
   addr.nl_pid = 0; /* autobind */
-  addr.nl_groups = RTMGRP_IPV4_ROUTE;
-  if (option_bool(OPT_CLEVERBIND))
-    addr.nl_groups |= RTMGRP_IPV4_IFADDR;  
-#ifdef HAVE_IPV6
-  addr.nl_groups |= RTMGRP_IPV6_ROUTE;
-  if (option_bool(OPT_CLEVERBIND))
-    addr.nl_groups |= RTMGRP_IPV6_IFADDR;
-#endif
-#ifdef HAVE_DHCP6
-  if (daemon->doing_ra || daemon->doing_dhcp6)
-    addr.nl_groups |= RTMGRP_IPV6_IFADDR;
-#endif
+  addr.nl_groups = groups;
   
   /* May not be able to have permission to set multicast groups don't die in that case */
   if ((daemon->netlinkfd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) != -1)
@@ -68,21 +94,73 @@ void netlink_init(void)
 	{
 	  addr.nl_groups = 0;
 	  if (errno != EPERM || bind(daemon->netlinkfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
-	    daemon->netlinkfd = -1;
+	    {
+	      close(daemon->netlinkfd);
+	      daemon->netlinkfd = -1;
+	    }
 	}
     }
   
   if (daemon->netlinkfd == -1 || 
-      getsockname(daemon->netlinkfd, (struct sockaddr *)&addr, &slen) == 1)
-    die(_("cannot create netlink socket: %s"), NULL, EC_MISC);
+      getsockname(daemon->netlinkfd, (struct sockaddr *)&addr, &slen) == -1)
+    return 0;
    
   /* save pid assigned by bind() and retrieved by getsockname() */ 
   netlink_pid = addr.nl_pid;
+  neigh_live = (addr.nl_groups & RTMGRP_NEIGH) != 0;
+  nl_cache_live = (addr.nl_groups & NL_CACHE_GROUPS) == NL_CACHE_GROUPS;
+  nl_cache_flush();
+  
+  return 1;
+}
+
+void netlink_init(void)
+{
+  u32 groups;
+
+  /* Address changes are always wanted to keep our copies of the
+     address and link tables current, but only generate events when
+     something depends on them. */
+  groups = RTMGRP_IPV4_ROUTE | NL_CACHE_GROUPS;
+  if (option_bool(OPT_CLEVERBIND))
+    addr_events = 1;
+#ifdef HAVE_IPV6
+  groups |= RTMGRP_IPV6_ROUTE;
+#endif
+#ifdef HAVE_DHCP6
+  if (daemon->doing_ra || daemon->doing_dhcp6)
+    addr_events = 1;
+#endif
+  if (option_bool(OPT_ADD_MAC))
+    groups |= RTMGRP_NEIGH;
+  
+  if (!netlink_open(groups))
+    die(_("cannot create netlink socket: %s"), NULL, EC_MISC);
   
   iov.iov_len = 100;
   iov.iov_base = safe_malloc(iov.iov_len);
 }
 
+/* A forked process doesn't hear the notifications which keep our copies
+   of the address and link tables current, so it mustn't use them. */
+void netlink_child_init(void)
+{
+  nl_cache_live = 0;
+  nl_cache_flush();
+}
+
+/* A DNS worker mustn't read the main process's netlink socket. It only
+   needs one for --add-mac, which hears about the neighbour table. */
+void netlink_worker_init(void)
+{
+  close(daemon->netlinkfd);
+  daemon->netlinkfd = -1;
+  netlink_child_init();
+  
+  if (option_bool(OPT_ADD_MAC) && !netlink_open(RTMGRP_NEIGH))
+    my_syslog(LOG_ERR, _("cannot create netlink socket: %s"), strerror(errno));
+}
+
 static ssize_t netlink_recv(void)
 {
   struct msghdr msg;
@@ -134,6 +212,181 @@ static ssize_t netlink_recv(void)
 }
   
 
+static struct nl_cache *nl_cache_get(int family)
+{
+  if (!nl_cache_live)
+    return NULL;
+  
+  if (family == AF_INET)
+    return &nl_caches[0];
+#ifdef HAVE_IPV6
+  if (family == AF_INET6)
+    return &nl_caches[1];
+#endif
+  if (family == AF_LOCAL)
+    return &nl_caches[2];
+  
+  return NULL;
+}
+
+static void nl_cache_invalidate(struct nl_cache *cache)
+{
+  cache->valid = 0;
+  cache->gen++;
+}
+
+static void nl_cache_add(struct nl_cache *cache, struct nlmsghdr *h)
+{
+  size_t len = NLMSG_ALIGN(h->nlmsg_len);
+
+  if (cache->len + len > cache->size)
+    {
+      size_t size = (cache->len + len) * 2;
+      unsigned char *new;
+
+      if (!(new = whine_malloc(size)))
+	{
+	  /* Can't keep a complete copy. */
+	  nl_cache_invalidate(cache);
+	  return;
+	}
+      
+      if (cache->buff)
+	{
+	  memcpy(new, cache->buff, cache->len);
+	  free(cache->buff);
+	}
+      
+      cache->buff = new;
+      cache->size = size;
+    }
+  
+  memcpy(cache->buff + cache->len, h, h->nlmsg_len);
+  cache->len += len;
+}
+
+/* Pass the contents of one message to callback. age is the number of
+   seconds since it came from the kernel, to keep lifetimes right. */
+static int nl_callback(struct nlmsghdr *h, int family, void *parm, int (*callback)(), time_t age)
+{
+  (void)age;
+
+  if (h->nlmsg_type == RTM_NEWADDR && family != AF_UNSPEC && family != AF_LOCAL)
+    {
+      struct ifaddrmsg *ifa = NLMSG_DATA(h);  
+      struct rtattr *rta = IFA_RTA(ifa);
+      unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+      
+      if (ifa->ifa_family == family)
+	{
+	  if (ifa->ifa_family == AF_INET)
+	    {
+	      struct in_addr netmask, addr, broadcast;
+	      char *label = NULL;
+	      
+	      netmask.s_addr = htonl(~(in_addr_t)0 << (32 - ifa->ifa_prefixlen));
+	      
+	      addr.s_addr = 0;
+	      broadcast.s_addr = 0;
+	      
+	      while (RTA_OK(rta, len1))
+		{
+		  if (rta->rta_type == IFA_LOCAL)
+		    addr = *((struct in_addr *)(rta+1));
+		  else if (rta->rta_type == IFA_BROADCAST)
+		    broadcast = *((struct in_addr *)(rta+1));
+		  else if (rta->rta_type == IFA_LABEL)
+		    label = RTA_DATA(rta);
+		  
+		  rta = RTA_NEXT(rta, len1);
+		}
+	      
+	      if (addr.s_addr)
+		return (*callback)(addr, ifa->ifa_index, label,  netmask, broadcast, parm);
+	    }
+#ifdef HAVE_IPV6
+	  else if (ifa->ifa_family == AF_INET6)
+	    {
+	      struct in6_addr *addrp = NULL;
+	      u32 valid = 0, preferred = 0;
+	      int flags = 0;
+	      
+	      while (RTA_OK(rta, len1))
+		{
+		  if (rta->rta_type == IFA_ADDRESS)
+		    addrp = ((struct in6_addr *)(rta+1)); 
+		  else if (rta->rta_type == IFA_CACHEINFO)
+		    {
+		      struct ifa_cacheinfo *ifc = (struct ifa_cacheinfo *)(rta+1);
+		      preferred = ifc->ifa_prefered;
+		      valid = ifc->ifa_valid;
+		    }
+		  rta = RTA_NEXT(rta, len1);
+		}
+	      
+	      /* 0xffffffff is infinite. */
+	      if (age > 0)
+		{
+		  if (preferred != 0xffffffff)
+		    preferred = preferred > age ? preferred - age : 0;
+		  if (valid != 0xffffffff)
+		    valid = valid > age ? valid - age : 0;
+		}
+
+	      if (ifa->ifa_flags & IFA_F_TENTATIVE)
+		flags |= IFACE_TENTATIVE;
+	      
+	      if (ifa->ifa_flags & IFA_F_DEPRECATED)
+		flags |= IFACE_DEPRECATED;
+	      
+	      if (!(ifa->ifa_flags & IFA_F_TEMPORARY))
+		flags |= IFACE_PERMANENT;
+	      
+	      if (addrp)
+		return (*callback)(addrp, (int)(ifa->ifa_prefixlen), (int)(ifa->ifa_scope), 
+				   (int)(ifa->ifa_index), flags, 
+				   (int) preferred, (int)valid, parm);
+	    }
+#endif
+	}
+    }
+  else if (h->nlmsg_type == RTM_NEWNEIGH && family == AF_UNSPEC)
+    {
+      size_t maclen;
+      char *inaddr, *mac;
+      int nfamily;
+      
+      if (nl_neigh(h, &nfamily, &inaddr, &mac, &maclen))
+	return (*callback)(nfamily, inaddr, mac, maclen, parm);
+    }
+#ifdef HAVE_DHCP6
+  else if (h->nlmsg_type == RTM_NEWLINK && family == AF_LOCAL)
+    {
+      struct ifinfomsg *link =  NLMSG_DATA(h);
+      struct rtattr *rta = IFLA_RTA(link);
+      unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*link));
+      char *mac = NULL;
+      size_t maclen = 0;
+      
+      while (RTA_OK(rta, len1))
+	{
+	  if (rta->rta_type == IFLA_ADDRESS)
+	    {
+	      maclen = rta->rta_len - sizeof(struct rtattr);
+	      mac = (char *)(rta+1);
+	    }
+	  
+	  rta = RTA_NEXT(rta, len1);
+	}
+      
+      if (mac && !((link->ifi_flags & (IFF_LOOPBACK | IFF_POINTOPOINT))))
+	return (*callback)((int)link->ifi_index, (unsigned int)link->ifi_type, mac, maclen, parm);
+    }
+#endif
+
+  return 1;
+}
+
 /* family = AF_UNSPEC finds ARP table entries.
    family = AF_LOCAL finds MAC addresses. */
 int iface_enumerate(int family, void *parm, int (*callback)())
@@ -142,19 +395,39 @@ int iface_enumerate(int family, void *parm, int (*callback)())
   struct nlmsghdr *h;
   ssize_t len;
   static unsigned int seq = 0;
-  int callback_ok = 1;
+  int callback_ok = 1, gen = 0;
+  struct nl_cache *cache = nl_cache_get(family);
 
   struct {
     struct nlmsghdr nlh;
     struct rtgenmsg g; 
   } req;
 
+  if (cache && cache->valid)
+    {
+      time_t age = dnsmasq_time() - cache->when;
+      size_t clen = cache->len;
+      
+      for (h = (struct nlmsghdr *)cache->buff; NLMSG_OK(h, clen); h = NLMSG_NEXT(h, clen))
+	if (!nl_callback(h, family, parm, callback, age))
+	  return 0;
+      
+      return 1;
+    }
+
   addr.nl_family = AF_NETLINK;
   addr.nl_pad = 0;
   addr.nl_groups = 0;
   addr.nl_pid = 0; /* address to kernel */
  
  again: 
+  if (cache)
+    {
+      cache->len = 0;
+      cache->when = dnsmasq_time();
+      gen = cache->gen;
+    }
+
   if (family == AF_UNSPEC)
     req.nlh.nlmsg_type = RTM_GETNEIGH;
   else if (family == AF_LOCAL)
@@ -181,6 +454,8 @@ int iface_enumerate(int family, void *parm, int (*callback)())
 	{
 	  if (errno == ENOBUFS)
 	    {
+	      /* multicasts may have been lost too. */
+	      nl_cache_flush();
 	      sleep(1);
 	      goto again;
 	    }
@@ -194,133 +469,34 @@ int iface_enumerate(int family, void *parm, int (*callback)())
 	    nl_async(h);
 	  }
 	else if (h->nlmsg_type == NLMSG_DONE)
-	  return callback_ok;
-	else if (h->nlmsg_type == RTM_NEWADDR && family != AF_UNSPEC && family != AF_LOCAL)
 	  {
-	    struct ifaddrmsg *ifa = NLMSG_DATA(h);  
-	    struct rtattr *rta = IFA_RTA(ifa);
-	    unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
-	    
-	    if (ifa->ifa_family == family)
-	      {
-		if (ifa->ifa_family == AF_INET)
-		  {
-		    struct in_addr netmask, addr, broadcast;
-		    char *label = NULL;
-
-		    netmask.s_addr = htonl(~(in_addr_t)0 << (32 - ifa->ifa_prefixlen));
-
-		    addr.s_addr = 0;
-		    broadcast.s_addr = 0;
-		    
-		    while (RTA_OK(rta, len1))
-		      {
-			if (rta->rta_type == IFA_LOCAL)
-			  addr = *((struct in_addr *)(rta+1));
-			else if (rta->rta_type == IFA_BROADCAST)
-			  broadcast = *((struct in_addr *)(rta+1));
-			else if (rta->rta_type == IFA_LABEL)
-			  label = RTA_DATA(rta);
-			
-			rta = RTA_NEXT(rta, len1);
-		      }
-		    
-		    if (addr.s_addr && callback_ok)
-		      if (!((*callback)(addr, ifa->ifa_index, label,  netmask, broadcast, parm)))
-			callback_ok = 0;
-		  }
-#ifdef HAVE_IPV6
-		else if (ifa->ifa_family == AF_INET6)
-		  {
-		    struct in6_addr *addrp = NULL;
-		    u32 valid = 0, preferred = 0;
-		    int flags = 0;
-		    
-		    while (RTA_OK(rta, len1))
-		      {
-			if (rta->rta_type == IFA_ADDRESS)
-			  addrp = ((struct in6_addr *)(rta+1)); 
-			else if (rta->rta_type == IFA_CACHEINFO)
-			  {
-			    struct ifa_cacheinfo *ifc = (struct ifa_cacheinfo *)(rta+1);
-			    preferred = ifc->ifa_prefered;
-			    valid = ifc->ifa_valid;
-			  }
-			rta = RTA_NEXT(rta, len1);
-		      }
-		    
-		    if (ifa->ifa_flags & IFA_F_TENTATIVE)
-		      flags |= IFACE_TENTATIVE;
-		    
-		    if (ifa->ifa_flags & IFA_F_DEPRECATED)
-		      flags |= IFACE_DEPRECATED;
-		    
-		    if (!(ifa->ifa_flags & IFA_F_TEMPORARY))
-		      flags |= IFACE_PERMANENT;
-    		    
-		    if (addrp && callback_ok)
-		      if (!((*callback)(addrp, (int)(ifa->ifa_prefixlen), (int)(ifa->ifa_scope), 
-					(int)(ifa->ifa_index), flags, 
-					(int) preferred, (int)valid, parm)))
-			callback_ok = 0;
-		  }
-#endif
-	      }
+	    /* Valid unless a change arrived whilst we were reading. */
+	    if (cache && cache->gen == gen)
+	      cache->valid = 1;
+	    return callback_ok;
 	  }
-	else if (h->nlmsg_type == RTM_NEWNEIGH && family == AF_UNSPEC)
+	else 
 	  {
-	    struct ndmsg *neigh = NLMSG_DATA(h);  
-	    struct rtattr *rta = NDA_RTA(neigh);
-	    unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*neigh));
-	    size_t maclen = 0;
-	    char *inaddr = NULL, *mac = NULL;
+	    if (cache)
+	      nl_cache_add(cache, h);
 	    
-	    while (RTA_OK(rta, len1))
-	      {
-		if (rta->rta_type == NDA_DST)
-		  inaddr = (char *)(rta+1);
-		else if (rta->rta_type == NDA_LLADDR)
-		  {
-		    maclen = rta->rta_len - sizeof(struct rtattr);
-		    mac = (char *)(rta+1);
-		  }
-		
-		rta = RTA_NEXT(rta, len1);
-	      }
-
-	    if (!(neigh->ndm_state & (NUD_NOARP | NUD_INCOMPLETE | NUD_FAILED)) &&
-		inaddr && mac && callback_ok)
-	      if (!((*callback)(neigh->ndm_family, inaddr, mac, maclen, parm)))
-		callback_ok = 0;
-	  }
-#ifdef HAVE_DHCP6
-	else if (h->nlmsg_type == RTM_NEWLINK && family == AF_LOCAL)
-	  {
-	    struct ifinfomsg *link =  NLMSG_DATA(h);
-	    struct rtattr *rta = IFLA_RTA(link);
-	    unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*link));
-	    char *mac = NULL;
-	    size_t maclen = 0;
-
-	    while (RTA_OK(rta, len1))
-	      {
-		if (rta->rta_type == IFLA_ADDRESS)
-		  {
-		    maclen = rta->rta_len - sizeof(struct rtattr);
-		    mac = (char *)(rta+1);
-		  }
-		
-		rta = RTA_NEXT(rta, len1);
-	      }
-
-	    if (mac && callback_ok && !((link->ifi_flags & (IFF_LOOPBACK | IFF_POINTOPOINT))) && 
-		!((*callback)((int)link->ifi_index, (unsigned int)link->ifi_type, mac, maclen, parm)))
+	    if (callback_ok && !nl_callback(h, family, parm, callback, 0))
 	      callback_ok = 0;
 	  }
-#endif
     }
 }
 
+/* Forget everything we know: notifications have been lost. */
+static void nl_cache_flush(void)
+{
+  int i;
+
+  for (i = 0; i < 3; i++)
+    nl_cache_invalidate(&nl_caches[i]);
+  
+  neigh_loaded = 0;
+}
+
 void netlink_multicast(void)
 {
   ssize_t len;
@@ -335,6 +511,8 @@ void netlink_multicast(void)
   if ((len = netlink_recv()) != -1)
     for (h = (struct nlmsghdr *)iov.iov_base; NLMSG_OK(h, (size_t)len); h = NLMSG_NEXT(h, len))
       nl_async(h);
+  else if (errno == ENOBUFS)
+    nl_cache_flush();
   
   /* restore non-blocking status */
   fcntl(daemon->netlinkfd, F_SETFL, flags);
@@ -361,7 +539,192 @@ static void nl_async(struct nlmsghdr *h)
 	queue_event(EVENT_NEWROUTE);
     }
   else if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR) 
-    queue_event(EVENT_NEWADDR);
+    {
+      struct ifaddrmsg *ifa = NLMSG_DATA(h);
+      struct nl_cache *cache = nl_cache_get(ifa->ifa_family);
+      
+      if (cache)
+	nl_cache_invalidate(cache);
+      
+      if (addr_events)
+	queue_event(EVENT_NEWADDR);
+    }
+  else if (h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK)
+    {
+      /* Interface flags or hardware address may have changed. */
+      nl_cache_invalidate(&nl_caches[0]);
+      nl_cache_invalidate(&nl_caches[1]);
+      nl_cache_invalidate(&nl_caches[2]);
+    }
+  else if (neigh_loaded &&
+	   (h->nlmsg_type == RTM_NEWNEIGH || h->nlmsg_type == RTM_DELNEIGH))
+    {
+      size_t maclen;
+      char *inaddr, *mac;
+      int family;
+      
+      /* An entry which is no longer usable is removed. */
+      if (nl_neigh(h, &family, &inaddr, &mac, &maclen) && h->nlmsg_type == RTM_NEWNEIGH)
+	neigh_update(family, inaddr, mac, maclen);
+      else if (inaddr)
+	neigh_update(family, inaddr, NULL, 0);
+    }
+}
+
+/* Extract address and MAC from a neighbour message, returns
+   zero if the entry is not usable. */
+static int nl_neigh(struct nlmsghdr *h, int *family, char **inaddr, char **mac, size_t *maclen)
+{
+  struct ndmsg *neigh = NLMSG_DATA(h);  
+  struct rtattr *rta = NDA_RTA(neigh);
+  unsigned int len1 = h->nlmsg_len - NLMSG_LENGTH(sizeof(*neigh));
+
+  *family = neigh->ndm_family;
+  *inaddr = *mac = NULL;
+  *maclen = 0;
+
+  while (RTA_OK(rta, len1))
+    {
+      if (rta->rta_type == NDA_DST)
+	*inaddr = (char *)(rta+1);
+      else if (rta->rta_type == NDA_LLADDR)
+	{
+	  *maclen = rta->rta_len - sizeof(struct rtattr);
+	  *mac = (char *)(rta+1);
+	}
+      
+      rta = RTA_NEXT(rta, len1);
+    }
+  
+  return !(neigh->ndm_state & (NUD_NOARP | NUD_INCOMPLETE | NUD_FAILED)) && *inaddr && *mac;
+}
+
+static struct neigh **neigh_find(int family, char *inaddr)
+{
+  int addrlen = (family == AF_INET6) ? IN6ADDRSZ : INADDRSZ, i;
+  unsigned int h = family;
+  struct neigh **up;
+
+  for (i = 0; i < addrlen; i++)
+    h = (h << 5) + h + (unsigned char)inaddr[i];
+  
+  for (up = &neigh_hash[h & (neigh_hash_size - 1)]; *up; up = &(*up)->next)
+    if ((*up)->family == family && memcmp((*up)->addr, inaddr, addrlen) == 0)
+      break;
+
+  return up;
+}
+
+/* mac == NULL -> remove entry */
+static void neigh_update(int family, char *inaddr, char *mac, size_t maclen)
+{
+  struct neigh **up, *n;
+  
+  if ((family != AF_INET && family != AF_INET6) || maclen > DHCP_CHADDR_MAX)
+    return;
+
+  /* Keep chains short: double the table as it fills. */
+  if (mac && neigh_count >= neigh_hash_size)
+    {
+      struct neigh **old = neigh_hash, *tmp;
+      int i, old_size = neigh_hash_size;
+      
+      neigh_hash_size = old_size == 0 ? 64 : old_size * 2;
+      if (!(neigh_hash = whine_malloc(neigh_hash_size * sizeof(struct neigh *))))
+	{
+	  neigh_hash = old;
+	  neigh_hash_size = old_size;
+	  if (!old)
+	    return;
+	}
+      else
+	for (i = 0; i < old_size; i++)
+	  for (n = old[i]; n; n = tmp)
+	    {
+	      tmp = n->next;
+	      up = neigh_find(n->family, (char *)n->addr);
+	      n->next = *up;
+	      *up = n;
+	    }
+      
+      free(old);
+    }
+
+  if (neigh_hash_size == 0)
+    return;
+  
+  up = neigh_find(family, inaddr);
+  
+  if (!mac)
+    {
+      if ((n = *up))
+	{
+	  *up = n->next;
+	  free(n);
+	  neigh_count--;
+	}
+      return;
+    }
+
+  if (!(n = *up))
+    {
+      if (!(n = whine_malloc(sizeof(struct neigh))))
+	return;
+      n->family = family;
+      memcpy(n->addr, inaddr, family == AF_INET6 ? IN6ADDRSZ : INADDRSZ);
+      n->next = NULL;
+      *up = n;
+      neigh_count++;
+    }
+
+  memcpy(n->mac, mac, maclen);
+  n->maclen = maclen;
+}
+
+static int neigh_load(int family, char *inaddr, char *mac, size_t maclen, void *parm)
+{
+  (void)parm;
+  neigh_update(family, inaddr, mac, maclen);
+  return 1;
+}
+
+/* Find the MAC address for the neighbour at addr, returns length or zero. */
+size_t neigh_mac(union mysockaddr *addr, unsigned char **mac)
+{
+  struct neigh *n, *tmp;
+  char *inaddr = (char *)&addr->in.sin_addr;
+  int i;
+
+#ifdef HAVE_IPV6
+  if (addr->sa.sa_family == AF_INET6)
+    inaddr = (char *)&addr->in6.sin6_addr;
+#endif
+  
+  if (daemon->netlinkfd == -1)
+    return 0;
+  
+  /* Without multicasts, we can't trust our copy: start afresh each time. */
+  if (!neigh_loaded || !neigh_live)
+    {
+      for (i = 0; i < neigh_hash_size; i++)
+	{
+	  for (n = neigh_hash[i]; n; n = tmp)
+	    {
+	      tmp = n->next;
+	      free(n);
+	    }
+	  neigh_hash[i] = NULL;
+	}
+      neigh_count = 0;
+      neigh_loaded = 1;
+      iface_enumerate(AF_UNSPEC, NULL, neigh_load);
+    }
+  
+  if (neigh_hash_size == 0 || !(n = *neigh_find(addr->sa.sa_family, inaddr)))
+    return 0;
+  
+  *mac = n->mac;
+  return n->maclen;
 }
 #endif
 
@@ -662,11 +662,33 @@ int enumerate_interfaces(int reset)
 	      l->iface->done = 0;
 	      
 	      if (l->fd != -1)
-		close(l->fd);
+		{
+		  poll_remove(l->fd);
+		  close(l->fd);
+		}
 	      if (l->tcpfd != -1)
-		close(l->tcpfd);
+		{
+		  poll_remove(l->tcpfd);
+		  close(l->tcpfd);
+		}
 	      if (l->tftpfd != -1)
-		close(l->tftpfd);
+		{
+		  poll_remove(l->tftpfd);
+		  close(l->tftpfd);
+		}
+	      if (l->workerfds)
+		{
+		  int i;
+		  
+		  for (i = 0; i < daemon->dns_workers; i++)
+		    if (l->workerfds[i] != -1)
+		      {
+			poll_remove(l->workerfds[i]);
+			close(l->workerfds[i]);
+		      }
+		  free(l->workerfds);
+		  reload_dns_workers(0);
+		}
 	      
 	      free(l);
 	    }
@@ -734,6 +756,13 @@ static int make_sock(union mysockaddr *addr, int type, int dienow)
   
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 || !fix_fd(fd))
     goto err;
+
+#ifdef SO_REUSEPORT
+  /* --dns-workers share UDP ports, the kernel spreads queries between them. */
+  if (type == SOCK_DGRAM && daemon->dns_workers != 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+    goto err;
+#endif
   
 #ifdef HAVE_IPV6
   if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1)
@@ -873,7 +902,7 @@ int tcp_interface(int fd, int af)
 static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, int dienow)
 {
   struct listener *l = NULL;
-  int fd = -1, tcpfd = -1, tftpfd = -1;
+  int fd = -1, tcpfd = -1, tftpfd = -1, *workerfds = NULL;
 
   (void)do_tftp;
 
@@ -881,6 +910,20 @@ static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, in
     {
       fd = make_sock(addr, SOCK_DGRAM, dienow);
       tcpfd = make_sock(addr, SOCK_STREAM, dienow);
+
+      /* Sockets for the DNS workers are made now, whilst we can still
+	 bind to port 53; a worker started later picks up its own. */
+      if (fd != -1 && daemon->dns_workers != 0)
+	{
+	  int i;
+
+	  workerfds = safe_malloc(daemon->dns_workers * sizeof(int));
+	  for (i = 0; i < daemon->dns_workers; i++)
+	    if (daemon->workers && daemon->workers[i].pid == -1)
+	      workerfds[i] = -1;
+	    else
+	      workerfds[i] = make_sock(addr, SOCK_DGRAM, dienow);
+	}
     }
   
 #ifdef HAVE_TFTP
@@ -914,6 +957,7 @@ static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, in
       l->fd = fd;
       l->tcpfd = tcpfd;
       l->tftpfd = tftpfd;	
+      l->workerfds = workerfds;
       l->iface = NULL;
     }
 
@@ -968,6 +1012,7 @@ void create_bound_listeners(int dienow)
 	new->next = daemon->listeners;
 	daemon->listeners = new;
 	iface->done = 1;
+	reload_dns_workers(0);
       }
 
   /* Check for --listen-address options that haven't been used because there's
@@ -1252,6 +1297,45 @@ static struct serverfd *allocate_sfd(union mysockaddr *addr, char *intname)
   return sfd; 
 }
 
+/* In a DNS worker, replace the server sockets inherited from the
+   main process with our own, so that replies come back to us. */
+int renew_sfds(void)
+{
+  struct serverfd *sfd, *tmp;
+  struct server *serv;
+
+  for (sfd = daemon->sfds; sfd; sfd = tmp)
+    {
+      tmp = sfd->next;
+      poll_remove(sfd->fd);
+      close(sfd->fd);
+      free(sfd);
+    }
+  
+  daemon->sfds = NULL;
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (serv->sfd && !(serv->sfd = allocate_sfd(&serv->source_addr, serv->interface)))
+      return 0;
+  
+  return 1;
+}
+
+/* Close the sockets made for a DNS worker which has been given up on,
+   so that the kernel stops giving it a share of the queries. */
+void close_worker_socks(int index)
+{
+  struct listener *l;
+
+  for (l = daemon->listeners; l; l = l->next)
+    if (l->workerfds && l->workerfds[index] != -1)
+      {
+	poll_remove(l->workerfds[index]);
+	close(l->workerfds[index]);
+	l->workerfds[index] = -1;
+      }
+}
+
 /* create upstream sockets during startup, before root is dropped which may be needed
    this allows query_port to be a low port and interface binding */
 void pre_allocate_sfds(void)
@@ -1314,6 +1398,156 @@ void mark_servers(int flag)
     }
 }
 
+/* Servers for a domain are hashed on that domain, so that search_servers()
+   only has to look at those whose domain is a suffix of the query name. 
+   The hash is computed from the end of the name, so that the hashes of
+   all the suffixes of a name fall out of a single pass over it. */
+static struct server **domain_hash = NULL, *nodots_servers = NULL, *default_list = NULL;
+static int domain_hash_size = 0;
+
+static unsigned int domain_hash_step(unsigned int val, unsigned int c)
+{
+  /* don't use tolower and friends here - they may be messed up by LOCALE */
+  if (c >= 'A' && c <= 'Z')
+    c += 'a' - 'A';
+  return ((val << 5) | (val >> (32 - 5))) ^ c;
+}
+
+void index_servers(void)
+{
+  struct server *serv, **up;
+  int i, count = 0, new_size;
+  
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if ((serv->flags & SERV_HAS_DOMAIN) && serv->domain)
+      count++;
+
+  /* hash_size is a power of two. */
+  for (new_size = 64; new_size < count; new_size = new_size << 1);
+  
+  /* must succeed in getting first instance, failure later is non-fatal,
+     the old table is still usable, just slower. */
+  if (!domain_hash)
+    {
+      domain_hash = safe_malloc(new_size * sizeof(struct server *));
+      domain_hash_size = new_size;
+    }
+  else if (new_size != domain_hash_size)
+    {
+      struct server **new = whine_malloc(new_size * sizeof(struct server *));
+      
+      if (new)
+	{
+	  free(domain_hash);
+	  domain_hash = new;
+	  domain_hash_size = new_size;
+	}
+    }
+  
+  for (i = 0; i < domain_hash_size; i++)
+    domain_hash[i] = NULL;
+  nodots_servers = default_list = NULL;
+  
+  /* Chain order doesn't matter, domain_servers() sorts on serial. */
+  for (i = 0, serv = daemon->servers; serv; serv = serv->next, i++)
+    {
+      serv->serial = i;
+
+      if ((serv->flags & SERV_HAS_DOMAIN) && serv->domain)
+	{
+	  unsigned int val = 0;
+	  char *p;
+
+	  for (p = serv->domain + strlen(serv->domain); p != serv->domain; p--)
+	    val = domain_hash_step(val, (unsigned char)*(p-1));
+	  
+	  up = &domain_hash[(val ^ (val >> 16)) & (domain_hash_size - 1)];
+	}
+      else if (serv->flags & SERV_FOR_NODOTS)
+	up = &nodots_servers;
+      else if (!(serv->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR)))
+	up = &default_list;
+      else
+	continue;
+
+      serv->domain_next = *up;
+      *up = serv;
+    }
+}
+
+/* Servers for queries in no particular domain, chained through domain_next,
+   in reverse order. */
+struct server *default_servers(void)
+{
+  return default_list;
+}
+
+static struct server **found_servers = NULL;
+static int found_size = 0;
+
+static int add_found_server(struct server *serv, int count)
+{
+  if (count == found_size)
+    {
+      struct server **new;
+      
+      if (!(new = whine_malloc((found_size + 16) * sizeof(struct server *))))
+	return count;
+      if (found_servers)
+	{
+	  memcpy(new, found_servers, found_size * sizeof(struct server *));
+	  free(found_servers);
+	}
+      found_servers = new;
+      found_size += 16;
+    }
+
+  found_servers[count] = serv;
+  return count + 1;
+}
+
+/* Return the servers which search_servers() needs to consider for name, 
+   in the order they appear in daemon->servers. Those are the servers
+   whose domain is a suffix of name at a label boundary, and the servers for
+   unqualified names, if name has no dots. */
+struct server **domain_servers(char *name, int *count)
+{
+  unsigned int val = 0;
+  int i, j, namelen = strlen(name);
+  struct server *serv;
+  
+  *count = 0;
+
+  if (!domain_hash)
+    return NULL;
+  
+  /* The empty suffix, then the one starting after each dot, and the whole name. */
+  for (i = namelen; i >= 0; i--)
+    {
+      if (i != namelen)
+	val = domain_hash_step(val, (unsigned char)name[i]);
+      
+      if (i == namelen || i == 0 || name[i-1] == '.')
+	for (serv = domain_hash[(val ^ (val >> 16)) & (domain_hash_size - 1)]; serv; serv = serv->domain_next)
+	  if (hostname_isequal(serv->domain, name + i))
+	    *count = add_found_server(serv, *count);
+    }
+  
+  if (namelen != 0 && !strchr(name, '.'))
+    for (serv = nodots_servers; serv; serv = serv->domain_next)
+      *count = add_found_server(serv, *count);
+
+  /* Back into list order: there are only ever a handful of these. */
+  for (i = 1; i < *count; i++)
+    for (j = i, serv = found_servers[i]; j > 0 && found_servers[j-1]->serial > serv->serial; j--)
+      {
+	found_servers[j] = found_servers[j-1];
+	found_servers[j-1] = serv;
+      }
+  
+  return found_servers;
+}
+
 void cleanup_servers(void)
 {
   struct server *serv, *tmp, **up;
@@ -1334,6 +1568,8 @@ void cleanup_servers(void)
        up = &serv->next;
     }
 
+  index_servers();
+  
 #ifdef HAVE_LOOP
   /* Now we have a new set of servers, test for loops. */
   loop_send_probes();
@@ -1498,6 +1734,7 @@ void check_servers(void)
     }
 
   cleanup_servers();
+  reload_dns_workers(0);
 }
 
 /* Return zero if no servers found, in that case we keep polling.
@@ -1594,6 +1831,9 @@ void newaddress(time_t now)
       daemon->doing_dhcp6 || daemon->relay6 || daemon->doing_ra)
     enumerate_interfaces(0);
   
+  /* DNS workers have a copy of the interface list. */
+  reload_dns_workers(0);
+  
   if (option_bool(OPT_CLEVERBIND))
     create_bound_listeners(0);
   
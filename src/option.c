@@ -154,6 +154,14 @@ struct myoption {
 #define LOPT_HOST_INOTIFY  342
 #define LOPT_DNSSEC_STAMP  343
 #define LOPT_TFTP_NO_FAIL  344
+#define LOPT_FASTEST       345
+#define LOPT_HEDGE         346
+#define LOPT_TCP_NOFORK    347
+#define LOPT_DNS_WORKERS   348
+#define LOPT_LEASE_JOURNAL 349
+#define LOPT_CACHE_SLRU    350
+#define LOPT_PREFETCH      351
+#define LOPT_SERVE_STALE   352
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -174,6 +182,9 @@ static const struct myoption opts[] =
     { "mx-host", 1, 0, 'm' },
     { "mx-target", 1, 0, 't' },
     { "cache-size", 2, 0, 'c' },
+    { "cache-slru", 2, 0, LOPT_CACHE_SLRU },
+    { "prefetch", 2, 0, LOPT_PREFETCH },
+    { "serve-stale", 2, 0, LOPT_SERVE_STALE },
     { "port", 1, 0, 'p' },
     { "dhcp-leasefile", 2, 0, 'l' },
     { "dhcp-lease", 1, 0, 'l' },
@@ -231,12 +242,17 @@ static const struct myoption opts[] =
     { "conf-dir", 1, 0, '7' },
     { "log-facility", 1, 0 ,'8' },
     { "leasefile-ro", 0, 0, '9' },
+    { "leasefile-journal", 2, 0, LOPT_LEASE_JOURNAL },
     { "dns-forward-max", 1, 0, '0' },
     { "clear-on-reload", 0, 0, LOPT_RELOAD },
     { "dhcp-ignore-names", 2, 0, LOPT_NO_NAMES },
     { "enable-tftp", 2, 0, LOPT_TFTP },
     { "tftp-secure", 0, 0, LOPT_SECURE },
     { "tftp-no-fail", 0, 0, LOPT_TFTP_NO_FAIL },
+    { "fastest-server", 0, 0, LOPT_FASTEST },
+    { "hedge-queries", 0, 0, LOPT_HEDGE },
+    { "no-tcp-fork", 0, 0, LOPT_TCP_NOFORK },
+    { "dns-workers", 1, 0, LOPT_DNS_WORKERS },
     { "tftp-unique-root", 0, 0, LOPT_APREF },
     { "tftp-root", 1, 0, LOPT_PREFIX },
     { "tftp-max", 1, 0, LOPT_TFTP_MAX },
@@ -334,6 +350,9 @@ static struct {
   { 'b', OPT_BOGUSPRIV, NULL, gettext_noop("Fake reverse lookups for RFC1918 private address ranges."), NULL },
   { 'B', ARG_DUP, "<ipaddr>", gettext_noop("Treat ipaddr as NXDOMAIN (defeats Verisign wildcard)."), NULL }, 
   { 'c', ARG_ONE, "<integer>", gettext_noop("Specify the size of the cache in entries (defaults to %s)."), "$" },
+  { LOPT_CACHE_SLRU, ARG_ONE, "[=<percent>]", gettext_noop("Protect names used more than once from cache evictions."), NULL },
+  { LOPT_PREFETCH, ARG_ONE, "[=<hits>[,<percent>]]", gettext_noop("Refresh popular cached names before they expire."), NULL },
+  { LOPT_SERVE_STALE, ARG_ONE, "[=<seconds>[,<milliseconds>]]", gettext_noop("Answer from expired cache entries when upstream servers fail."), NULL },
   { 'C', ARG_DUP, "<path>", gettext_noop("Specify configuration file (defaults to %s)."), CONFFILE },
   { 'd', OPT_DEBUG, NULL, gettext_noop("Do NOT fork into the background: run in debug mode."), NULL },
   { 'D', OPT_NODOTS_LOCAL, NULL, gettext_noop("Do NOT forward queries with no domain part."), NULL }, 
@@ -413,6 +432,7 @@ static struct {
   { '7', ARG_DUP, "<path>", gettext_noop("Read configuration from all the files in this directory."), NULL },
   { '8', ARG_ONE, "<facilty>|<file>", gettext_noop("Log to this syslog facility or file. (defaults to DAEMON)"), NULL },
   { '9', OPT_LEASE_RO, NULL, gettext_noop("Do not use leasefile."), NULL },
+  { LOPT_LEASE_JOURNAL, ARG_ONE, "[=<bytes>]", gettext_noop("Append lease changes to a journal; optionally set its size limit."), NULL },
   { '0', ARG_ONE, "<integer>", gettext_noop("Maximum number of concurrent DNS queries. (defaults to %s)"), "!" }, 
   { LOPT_RELOAD, OPT_RELOAD, NULL, gettext_noop("Clear DNS cache when reloading %s."), RESOLVFILE },
   { LOPT_NO_NAMES, ARG_DUP, "[=tag:<tag>]...", gettext_noop("Ignore hostnames provided by DHCP clients."), NULL },
@@ -432,6 +452,10 @@ static struct {
   { LOPT_LOC_REBND, OPT_LOCAL_REBIND, NULL, gettext_noop("Allow rebinding of 127.0.0.0/8, for RBL servers."), NULL },
   { LOPT_NO_REBIND, ARG_DUP, "/<domain>/", gettext_noop("Inhibit DNS-rebind protection on this domain."), NULL },
   { LOPT_NOLAST, OPT_ALL_SERVERS, NULL, gettext_noop("Always perform DNS queries to all servers."), NULL },
+  { LOPT_FASTEST, OPT_FASTEST_SERVER, NULL, gettext_noop("Send DNS queries to the server with the lowest round trip time."), NULL },
+  { LOPT_HEDGE, OPT_HEDGE, NULL, gettext_noop("Send DNS queries to a second server if the first is slow to answer."), NULL },
+  { LOPT_TCP_NOFORK, OPT_TCP_NOFORK, NULL, gettext_noop("Answer DNS queries over TCP without forking a process per connection."), NULL },
+  { LOPT_DNS_WORKERS, ARG_ONE, "<integer>", gettext_noop("Answer UDP DNS queries in this many extra processes."), NULL },
   { LOPT_MATCH, ARG_DUP, "set:<tag>,<optspec>", gettext_noop("Set tag if client includes matching option in request."), NULL },
   { LOPT_ALTPORT, ARG_ONE, "[=<ports>]", gettext_noop("Use alternative ports for DHCP."), NULL },
   { LOPT_NAPTR, ARG_DUP, "<name>,<naptr>", gettext_noop("Specify NAPTR DNS record."), NULL },
@@ -1758,6 +1782,12 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
     case 'l':  /* --dhcp-leasefile */
       daemon->lease_file = opt_string_alloc(arg);
       break;
+
+    case LOPT_LEASE_JOURNAL: /* --leasefile-journal */
+      daemon->lease_journal_max = LEASE_JOURNAL_MAX; /* default */
+      if (arg && (!atoi_check(arg, &daemon->lease_journal_max) || daemon->lease_journal_max <= 0))
+	ret_err(gen_err);
+      break;
       
       /* Sorry about the gross pre-processor abuse */
     case '6':             /* --dhcp-script */
@@ -2492,6 +2522,39 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	  }
 	break;
       }
+
+    case LOPT_CACHE_SLRU: /* --cache-slru */
+      daemon->cache_protect = CACHE_PROTECT; /* default */
+      if (arg && (!atoi_check(arg, &daemon->cache_protect) ||
+		  daemon->cache_protect <= 0 || daemon->cache_protect >= 100))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_PREFETCH: /* --prefetch */
+      daemon->prefetch_hits = PREFETCH_HITS; /* defaults */
+      daemon->prefetch_percent = PREFETCH_PERCENT;
+      if (arg)
+	{
+	  comma = split(arg);
+	  if (!atoi_check(arg, &daemon->prefetch_hits) ||
+	      daemon->prefetch_hits <= 0 || daemon->prefetch_hits > 255 ||
+	      (comma && (!atoi_check(comma, &daemon->prefetch_percent) ||
+			 daemon->prefetch_percent <= 0 || daemon->prefetch_percent >= 100)))
+	    ret_err(gen_err);
+	}
+      break;
+
+    case LOPT_SERVE_STALE: /* --serve-stale */
+      daemon->stale_max = STALE_MAX; /* defaults */
+      daemon->stale_wait = STALE_WAIT;
+      if (arg)
+	{
+	  comma = split(arg);
+	  if (!atoi_check(arg, &daemon->stale_max) || daemon->stale_max <= 0 ||
+	      (comma && (!atoi_check(comma, &daemon->stale_wait) || daemon->stale_wait <= 0)))
+	    ret_err(gen_err);
+	}
+      break;
       
     case 'p':  /* --port */
       if (!atoi_check16(arg, &daemon->port))
@@ -2531,6 +2594,13 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	break;
       }
       
+#if defined(HAVE_LINUX_NETWORK) && !defined(NO_FORK)
+    case LOPT_DNS_WORKERS: /* --dns-workers */
+      if (!atoi_check(arg, &daemon->dns_workers) || daemon->dns_workers > DNS_WORKERS_MAX)
+	ret_err(gen_err);
+      break;
+#endif
+
     case 'Q':  /* --query-port */
       if (!atoi_check16(arg, &daemon->query_port))
 	ret_err(gen_err);
@@ -2974,20 +3044,17 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	    }
 	  else if (strchr(a[j], '.') && (inet_pton(AF_INET, a[j], &in) > 0))
 	    {
-	      struct dhcp_config *configs;
-	      
 	      new->addr = in;
 	      new->flags |= CONFIG_ADDR;
 
 	      /* If the same IP appears in more than one host config, then DISCOVER
 		 for one of the hosts will get the address, but REQUEST will be NAKed,
 		 since the address is reserved by the other one -> protocol loop. */
-	      for (configs = daemon->dhcp_conf; configs; configs = configs->next) 
-		if ((configs->flags & CONFIG_ADDR) && configs->addr.s_addr == in.s_addr)
-		  {
-		    sprintf(errstr, _("duplicate dhcp-host IP address %s"),  inet_ntoa(in));
-		    return 0;
-		  }	      
+	      if (config_find_by_address(daemon->dhcp_conf, in))
+		{
+		  sprintf(errstr, _("duplicate dhcp-host IP address %s"),  inet_ntoa(in));
+		  return 0;
+		}	      
 	    }
 	  else
 	    {
@@ -4339,6 +4406,8 @@ void reread_dhcp(void)
     {
       struct dhcp_config *configs, *cp, **up;
   
+      config_index_reset();
+
       /* remove existing... */
       for (up = &daemon->dhcp_conf, configs = daemon->dhcp_conf; configs; configs = cp)
 	{
@@ -4466,6 +4535,7 @@ void read_opts(int argc, char **argv, char *compile_opts)
   add_txt("auth.bind", NULL, TXT_STAT_AUTH);
 #endif
   add_txt("servers.bind", NULL, TXT_STAT_SERVERS);
+  add_txt("protected.bind", NULL, TXT_STAT_PROTECTED);
 
   while (1) 
     {
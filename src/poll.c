@@ -16,9 +16,16 @@
 
 #include "dnsmasq.h"
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Wrapper for poll(). Allocates and extends array of struct pollfds,
    keeps them in fd order so that we can set and test conditions on
-   fd using a simple but efficient binary chop. */
+   fd using a simple but efficient binary chop. 
+
+   Where epoll is available, that's used instead, behind the same
+   interface: see below. */
 
 /* poll_reset()
    poll_listen(fd, event)
@@ -37,6 +44,9 @@
     .
 
     event is OR of POLLIN, POLLOUT, POLLERR, etc
+
+    poll_remove(fd) must be called before closing an fd which 
+    has been passed to poll_listen().
 */
 
 static struct pollfd *pollfds = NULL;
@@ -68,19 +78,280 @@ static nfds_t fd_search(int fd)
     }
 }
 
+#ifdef HAVE_EPOLL
+/* With epoll, fds stay registered with the kernel from one call to the
+   next. poll_listen() just notes the events wanted this pass, in a 
+   table indexed by fd, do_poll() tells the kernel about any changes
+   since the last pass and then marks only the fds which are ready.
+
+   The kernel drops an fd when it's closed, without telling us, which
+   is why poll_remove() is needed. Each registration carries a serial 
+   number: if the kernel reports an fd we don't know about, (closed 
+   but still open in a child, say) the epoll set is rebuilt from scratch.
+
+   The POLL* and EPOLL* event bits have the same values. */
+
+struct epoll_fd {
+  unsigned int listen_pass, ready_pass, serial;
+  int kindex;                   /* position in kfds, if registered */
+  short events, kevents, revents;
+  char always;                  /* fd can't be polled (eg a file), so always ready */
+};
+
+static int epfd = -1, epoll_failed = 0;
+static pid_t epoll_pid;
+static struct epoll_fd *efds = NULL;
+static int efds_size = 0;
+static unsigned int pass = 0, serial = 0;
+static int *listened = NULL, nlistened = 0, listened_size = 0;
+static int *kfds = NULL, nkfds = 0, kfds_size = 0;
+static struct epoll_event *ready = NULL;
+static int ready_size = 0;
+
+static int grow_fds(int **arrp, int *sizep, int need)
+{
+  int *new, size = (*sizep == 0) ? 64 : *sizep;
+
+  if (need <= *sizep)
+    return 1;
+
+  while (size < need)
+    size *= 2;
+
+  if (!(new = whine_malloc(size * sizeof(int))))
+    return 0;
+
+  if (*arrp)
+    {
+      memcpy(new, *arrp, *sizep * sizeof(int));
+      free(*arrp);
+    }
+
+  *arrp = new;
+  *sizep = size;
+  return 1;
+}
+
+static void epoll_unregister(int fd)
+{
+  struct epoll_fd *e = &efds[fd];
+  
+  if (!e->always)
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  
+  kfds[e->kindex] = kfds[--nkfds];
+  efds[kfds[e->kindex]].kindex = e->kindex;
+  e->kevents = 0;
+  e->always = 0;
+}
+
+static int epoll_register(int fd)
+{
+  struct epoll_fd *e = &efds[fd];
+  
+  if (!e->kevents && !grow_fds(&kfds, &kfds_size, nkfds + 1))
+    return 0;
+  
+  if (!e->always)
+    {
+      struct epoll_event ev;
+      int op = e->kevents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  
+      if (op == EPOLL_CTL_ADD)
+	e->serial = ++serial;
+      ev.events = e->events;
+      ev.data.u64 = ((u64)e->serial << 32) | (unsigned int)fd;
+  
+      if (epoll_ctl(epfd, op, fd, &ev) == -1)
+	{
+	  /* Our idea of what the kernel has is out of date. */
+	  if (errno == ENOENT)
+	    {
+	      ev.data.u64 = ((u64)(e->serial = ++serial) << 32) | (unsigned int)fd;
+	      op = EPOLL_CTL_ADD;
+	    }
+	  else if (errno == EEXIST)
+	    op = EPOLL_CTL_MOD;
+	  else if (errno == EPERM)
+	    e->always = 1;
+	  else
+	    return 0;
+	  
+	  if (!e->always && epoll_ctl(epfd, op, fd, &ev) == -1)
+	    return 0;
+	}
+    }
+  
+  if (!e->kevents)
+    {
+      e->kindex = nkfds;
+      kfds[nkfds++] = fd;
+    }
+  
+  e->kevents = e->events;
+  return 1;
+}
+
+static void epoll_init(void)
+{
+  int i;
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+      epoll_failed = 1;
+      return;
+    }
+  
+  epoll_pid = getpid();
+
+  /* Nothing registered with the new set. */
+  for (i = 0; i < nkfds; i++)
+    {
+      efds[kfds[i]].kevents = 0;
+      efds[kfds[i]].always = 0;
+    }
+  nkfds = 0;
+}
+
+static int epoll_poll(int timeout)
+{
+  int i, n, hits = 0, stale = 0;
+  
+  /* Pass changes to the kernel. */
+  for (i = 0; i < nlistened; i++)
+    {
+      int fd = listened[i];
+      
+      if (efds[fd].events != efds[fd].kevents && !epoll_register(fd))
+	{
+	  /* Can't happen, but don't hang if it does. */
+	  efds[fd].revents = POLLERR;
+	  efds[fd].ready_pass = pass;
+	  hits++;
+	}
+      
+      if (efds[fd].always)
+	{
+	  efds[fd].revents = efds[fd].events & (POLLIN | POLLOUT);
+	  efds[fd].ready_pass = pass;
+	  hits++;
+	}
+    }
+  
+  for (i = 0; i < nkfds; i++)
+    if (efds[kfds[i]].listen_pass != pass)
+      epoll_unregister(kfds[i--]);
+  
+  if (hits != 0)
+    timeout = 0;
+  
+  if (ready_size < nkfds || ready_size == 0)
+    {
+      struct epoll_event *new;
+      int size = ready_size;
+
+      while (size < nkfds || size == 0)
+	size = (size == 0) ? 64 : size * 2;
+      
+      if ((new = whine_malloc(size * sizeof(struct epoll_event))))
+	{
+	  free(ready);
+	  ready = new;
+	  ready_size = size;
+	}
+    }
+
+  if (ready_size == 0)
+    return hits;
+  
+  if ((n = epoll_wait(epfd, ready, ready_size, timeout)) == -1)
+    return hits ? hits : -1;
+  
+  for (i = 0; i < n; i++)
+    {
+      int fd = (int)(ready[i].data.u64 & 0xffffffff);
+      unsigned int ser = (unsigned int)(ready[i].data.u64 >> 32);
+      
+      if (fd >= efds_size || !efds[fd].kevents || efds[fd].serial != ser)
+	stale = 1;
+      else if (efds[fd].ready_pass != pass)
+	{
+	  efds[fd].revents = ready[i].events;
+	  efds[fd].ready_pass = pass;
+	  hits++;
+	}
+    }
+  
+  if (stale)
+    {
+      /* Leave the old set behind, with whatever it's holding,
+	 and register everything again next time. */
+      close(epfd);
+      epoll_init();
+    }
+  
+  return hits;
+}
+#endif
+
 void poll_reset(void)
 {
   nfds = 0;
+  
+#ifdef HAVE_EPOLL
+  /* A forked process which polls needs its own set. */
+  if (epfd != -1 && getpid() != epoll_pid)
+    {
+      close(epfd);
+      epoll_init();
+    }
+  else if (epfd == -1 && !epoll_failed)
+    epoll_init();
+
+  pass++;
+  nlistened = 0;
+#endif
 }
 
 int do_poll(int timeout)
 {
+#ifdef HAVE_EPOLL
+  if (epfd != -1)
+    return epoll_poll(timeout);
+#endif
+
   return poll(pollfds, nfds, timeout);
 }
 
+void poll_remove(int fd)
+{
+#ifdef HAVE_EPOLL
+  /* Forked children share the epoll set, so must leave it alone. */
+  if (epfd != -1 && fd >= 0 && fd < efds_size && getpid() == epoll_pid)
+    {
+      if (efds[fd].kevents)
+	epoll_unregister(fd);
+      efds[fd].ready_pass = 0;
+    }
+#else
+  (void)fd;
+#endif
+}
+
 int poll_check(int fd, short event)
 {
-  nfds_t i = fd_search(fd);
+  nfds_t i;
+
+#ifdef HAVE_EPOLL
+  if (epfd != -1)
+    {
+      if (fd >= 0 && fd < efds_size && efds[fd].ready_pass == pass)
+	return efds[fd].revents & event;
+      return 0;
+    }
+#endif
+
+  i = fd_search(fd);
   
   if (i < nfds && pollfds[i].fd == fd)
     return pollfds[i].revents & event;
@@ -90,7 +361,54 @@ int poll_check(int fd, short event)
 
 void poll_listen(int fd, short event)
 {
-   nfds_t i = fd_search(fd);
+   nfds_t i;
+
+#ifdef HAVE_EPOLL
+   if (epfd != -1)
+     {
+       struct epoll_fd *e;
+       
+       if (fd < 0)
+	 return;
+       
+       if (fd >= efds_size)
+	 {
+	   struct epoll_fd *new;
+	   int size = (efds_size == 0) ? 64 : efds_size;
+	   
+	   while (size <= fd)
+	     size *= 2;
+	   
+	   if (!(new = whine_malloc(size * sizeof(struct epoll_fd))))
+	     return;
+	   
+	   memset(new, 0, size * sizeof(struct epoll_fd));
+	   if (efds)
+	     {
+	       memcpy(new, efds, efds_size * sizeof(struct epoll_fd));
+	       free(efds);
+	     }
+	   
+	   efds = new;
+	   efds_size = size;
+	 }
+       
+       e = &efds[fd];
+       
+       if (e->listen_pass == pass)
+	 e->events |= event;
+       else if (grow_fds(&listened, &listened_size, nlistened + 1))
+	 {
+	   e->listen_pass = pass;
+	   e->events = event;
+	   listened[nlistened++] = fd;
+	 }
+       
+       return;
+     }
+#endif
+   
+   i = fd_search(fd);
   
    if (i < nfds && pollfds[i].fd == fd)
      pollfds[i].events |= event;
@@ -575,6 +575,7 @@ size_t add_pseudoheader(struct dns_header *header, size_t plen, unsigned char *l
   
 }
 
+#ifndef HAVE_LINUX_NETWORK
 static int filter_mac(int family, char *addrp, char *mac, size_t maclen, void *parmv)
 {
   struct macparm *parm = parmv;
@@ -598,9 +599,20 @@ static int filter_mac(int family, char *addrp, char *mac, size_t maclen, void *p
   
   return 0; /* done */
 }	      
+#endif
      
 size_t add_mac(struct dns_header *header, size_t plen, char *limit, union mysockaddr *l3)
 {
+#ifdef HAVE_LINUX_NETWORK
+  /* Linux keeps a copy of the neighbour table in netlink.c */
+  unsigned char *mac;
+  size_t maclen;
+
+  if ((maclen = neigh_mac(l3, &mac)) != 0)
+    plen = add_pseudoheader(header, plen, (unsigned char *)limit, PACKETSZ, EDNS0_OPTION_MAC, mac, maclen, 0);
+
+  return plen;
+#else
   struct macparm parm;
      
   parm.header = header;
@@ -611,6 +623,7 @@ size_t add_mac(struct dns_header *header, size_t plen, char *limit, union mysock
   iface_enumerate(AF_UNSPEC, &parm, filter_mac);
   
   return parm.plen; 
+#endif
 }
 
 struct subnet_opt {
@@ -1508,6 +1521,10 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
   if  (crecp->flags & (F_IMMORTAL | F_DHCP))
     return daemon->local_ttl;
   
+  /* Expired, only found with --serve-stale */
+  if (difftime(crecp->ttd, now) <= 0)
+    return STALE_TTL;
+
   /* Return the Max TTL value if it is lower then the actual TTL */
   if (daemon->max_ttl == 0 || ((unsigned)(crecp->ttd - now) < daemon->max_ttl))
     return crecp->ttd - now;
@@ -1516,10 +1533,12 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
 }
   
 
-/* return zero if we can't answer from cache, or packet size if we can */
+/* return zero if we can't answer from cache, or packet size if we can.
+   If prefetch is non-NULL, set *prefetch when the answer should be
+   refreshed from upstream, see cache_prefetch_due(). */
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,  
 		      struct in_addr local_addr, struct in_addr local_netmask, 
-		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader) 
+		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader, int *prefetch) 
 {
   char *name = daemon->namebuff;
   unsigned char *p, *ansp;
@@ -1534,6 +1553,9 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   struct mx_srv_record *rec;
   size_t len;
   
+  if (prefetch)
+    *prefetch = 0;
+
   if (ntohs(header->ancount) != 0 ||
       ntohs(header->nscount) != 0 ||
       ntohs(header->qdcount) == 0 || 
@@ -1715,6 +1737,9 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			  
 			  if (!(crecp->flags & F_DNSSECOK))
 			    sec_data = 0;
+			  
+			  if (!dryrun && prefetch && cache_prefetch_due(crecp, now))
+			    *prefetch = 1;
 			   
 			  ans = 1;
 			   
@@ -1903,6 +1928,9 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			if (!(crecp->flags & F_DNSSECOK))
 			  sec_data = 0;
 			
+			if (!dryrun && prefetch && cache_prefetch_due(crecp, now))
+			  *prefetch = 1;
+			
 			if (crecp->flags & F_CNAME)
 			  {
 			    char *cname_target = cache_get_cname_target(crecp);
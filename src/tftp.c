@@ -608,6 +608,7 @@ void check_tftp_listeners(time_t now)
 
 static void free_transfer(struct tftp_transfer *transfer)
 {
+  poll_remove(transfer->sockfd);
   close(transfer->sockfd);
   if (transfer->file && (--transfer->file->refcount) == 0)
     {